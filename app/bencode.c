@@ -1,6 +1,7 @@
 #include "bencode_internal.h"
 #include "debug.h"
 #include <assert.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,9 +24,15 @@ enum bencode_type bencode_get_type(const char *bencoded_value) {
 }
 
 void bencode_free(bencode *b) {
+  if (b->flags & BENCODE_F_ARENA) {
+    return;
+  }
+
   switch (b->type) {
   case BENCODE_STRING: {
-    free(((bencode_string *)b)->value);
+    if (!(b->flags & BENCODE_F_VIEW)) {
+      free((void *)((bencode_string *)b)->value);
+    }
     break;
   }
   case BENCODE_LIST: {
@@ -33,14 +40,19 @@ void bencode_free(bencode *b) {
     for (int i = 0; i < list->length; i++) {
       bencode_free(list->values[i]);
     }
+    free(list->values);
     break;
   }
   case BENCODE_DICT: {
     bencode_dict *dict = (bencode_dict *)b;
     for (int i = 0; i < dict->length; i++) {
-      free(dict->keys[i]);
+      if (!(b->flags & BENCODE_F_VIEW)) {
+        free((void *)dict->keys[i].value);
+      }
       bencode_free(dict->values[i]);
     }
+    free(dict->keys);
+    free(dict->values);
     break;
   }
   default:
@@ -50,255 +62,338 @@ void bencode_free(bencode *b) {
   free(b);
 }
 
-bencode *bencode_invalid() {
-  fprintf(stderr, "invalid bencode");
-  bencode *result = malloc(sizeof(bencode));
+static void *decode_alloc(bencode_decoder *d, size_t size) {
+  if (d->arena) {
+    return bencode_arena_alloc(d->arena, size);
+  }
+
+  void *result = malloc(size);
   assert(result != NULL);
-  result->type = BENCODE_INVALID;
   return result;
 }
 
-bencode *decode_string_bencode(const char *bencoded_value) {
-  int len = atoi(bencoded_value);
-  const char *colon_index = strchr(bencoded_value, ':');
-  if (colon_index == NULL) {
-    return bencode_invalid();
+static void decode_release(bencode_decoder *d, void *ptr) {
+  if (!d->arena) {
+    free(ptr);
+  }
+}
+
+void bencode_scratch_push(bencode_scratch *s, const void *data, size_t size) {
+  if (s->length + size > s->capacity) {
+    s->capacity = s->capacity ? s->capacity * 2 : 256;
+    if (s->capacity < s->length + size) {
+      s->capacity = s->length + size;
+    }
+    s->data = realloc(s->data, s->capacity);
+    assert(s->data != NULL);
   }
 
-  const char *start = colon_index + 1;
-  char *decoded_str = (char *)malloc(len + 1);
-  memcpy(decoded_str, start, len);
-  decoded_str[len] = '\0';
+  memcpy(s->data + s->length, data, size);
+  s->length += size;
+}
 
-  bencode_string *result = NULL;
-  result = malloc(sizeof(*result));
-  assert(result != NULL);
+// decode_string_into decodes a bencoded string into an existing node, so
+// dict keys can be stored inline without a node allocation each.
+// It returns -1 in case of errors.
+static int decode_string_into(bencode_decoder *d, bencode_string *result) {
+  const char *start = d->cur;
+  const char *cur = d->cur;
+  size_t len = 0;
+
+  while (cur < d->end && is_digit(*cur)) {
+    len = len * 10 + (*cur - '0');
+    if (len > INT_MAX) {
+      return -1;
+    }
+    cur++;
+  }
+  if (cur == start || cur == d->end || *cur != ':') {
+    return -1;
+  }
+  cur++;
+
+  if (len > (size_t)(d->end - cur)) {
+    return -1;
+  }
+
+  if (d->flags & BENCODE_F_VIEW) {
+    result->value = cur;
+  } else {
+    char *decoded_str = (char *)decode_alloc(d, len + 1);
+    memcpy(decoded_str, cur, len);
+    decoded_str[len] = '\0';
+    result->value = decoded_str;
+  }
 
   result->type = BENCODE_STRING;
+  result->flags = d->flags;
   result->length = len;
-  result->value = decoded_str;
-  result->raw_size = (colon_index - bencoded_value + len + 1);
-  return (bencode *)result;
+  result->raw_size = (cur - start + len);
+  result->raw = start;
+  d->cur = cur + len;
+  return 0;
 }
 
-bencode *decode_integer_bencode(const char *bencoded_value) {
-  const char *e_index = strchr(bencoded_value, 'e');
-  int len = e_index - bencoded_value - 1;
-  if (len <= 0 || bencoded_value[len + 1] != 'e') {
-    return bencode_invalid();
-  }
+bencode *decode_string_bencode(bencode_decoder *d) {
+  bencode_string *result = decode_alloc(d, sizeof(*result));
 
-  bencode_integer *result = NULL;
-  result = malloc(sizeof(*result));
-  assert(result != NULL);
+  if (decode_string_into(d, result) == -1) {
+    decode_release(d, result);
+    return NULL;
+  }
 
-  result->type = BENCODE_INTEGER;
-  result->value = atol(bencoded_value + 1);
-  result->raw_size = (e_index - bencoded_value + 1);
   return (bencode *)result;
 }
 
-bencode *decode_list_bencode(const char *bencoded_value) {
-  const char *e_index = strchr(bencoded_value, 'e');
-  if (!e_index) {
-    return bencode_invalid();
+bencode *decode_integer_bencode(bencode_decoder *d) {
+  const char *start = d->cur;
+  const char *cur = start + 1;
+
+  bool negative = false;
+  if (cur < d->end && *cur == '-') {
+    negative = true;
+    cur++;
   }
 
-  bencode_list *result = NULL;
-  result = malloc(sizeof(*result));
-  assert(result != NULL);
+  // the most negative value is one further from zero than LONG_MAX.
+  unsigned long limit = negative ? (unsigned long)LONG_MAX + 1 : LONG_MAX;
+  const char *digits = cur;
+  unsigned long value = 0;
+  while (cur < d->end && is_digit(*cur)) {
+    unsigned long digit = *cur - '0';
+    if (value > (limit - digit) / 10) {
+      return NULL;
+    }
+    value = value * 10 + digit;
+    cur++;
+  }
+  if (cur == digits || cur == d->end || *cur != 'e') {
+    return NULL;
+  }
+  cur++;
 
-  result->type = BENCODE_LIST;
-  result->length = 0;
-  result->values = NULL;
-  result->raw_size = 2;
+  bencode_integer *result = decode_alloc(d, sizeof(*result));
 
-  bencode *b;
+  result->type = BENCODE_INTEGER;
+  result->flags = d->flags;
+  result->value = negative ? (long int)-value : (long int)value;
+  result->raw_size = (cur - start);
+  result->raw = start;
+  d->cur = cur;
+  return (bencode *)result;
+}
 
-  const char *cur = bencoded_value + 1;
-  while (cur - bencoded_value < strlen(bencoded_value) - 1) {
-    if (cur[0] == 'e') {
+bencode *decode_list_bencode(bencode_decoder *d) {
+  const char *start = d->cur;
+  size_t base = d->scratch->length;
+  int length = 0;
+
+  d->cur++;
+
+  while (d->cur < d->end) {
+    if (d->cur[0] == 'e') {
+      d->cur++;
+
+      bencode_list *result = decode_alloc(d, sizeof(*result));
+      result->type = BENCODE_LIST;
+      result->flags = d->flags;
+      result->raw_size = d->cur - start;
+      result->raw = start;
+      result->length = length;
+      result->values = NULL;
+      if (length > 0) {
+        result->values = decode_alloc(d, sizeof(bencode *) * length);
+        memcpy(result->values, d->scratch->data + base,
+               sizeof(bencode *) * length);
+      }
+
+      d->scratch->length = base;
       return (bencode *)result;
     }
 
-    b = decode_bencode(cur);
-    result->length++;
-    result->values =
-        realloc(result->values, sizeof(bencode *) * result->length);
-    assert(result->values != NULL);
-    result->values[result->length - 1] = b;
-    cur += b->raw_size;
-    result->raw_size += b->raw_size;
+    bencode *b = decode_bencode_next(d);
+    if (b == NULL) {
+      break;
+    }
+
+    bencode_scratch_push(d->scratch, &b, sizeof(b));
+    length++;
   }
 
-  // should be unreachable code.
-  return (bencode *)result;
+  // ran out of input before the closing 'e' or a value failed to decode.
+  bencode **values = (bencode **)(d->scratch->data + base);
+  for (int i = 0; i < length; i++) {
+    bencode_free(values[i]);
+  }
+  d->scratch->length = base;
+  return NULL;
 }
 
-bencode *decode_dict_bencode(const char *bencoded_value) {
-  const char *e_index = strchr(bencoded_value, 'e');
-  if (!e_index) {
-    return bencode_invalid();
+typedef struct {
+  bencode_string key;
+  bencode *value;
+} dict_entry;
+
+// key_compare orders keys the way bencode requires dicts to be sorted: as
+// raw byte strings, a prefix before any longer key.
+static int key_compare(const char *a, size_t a_len, const char *b,
+                       size_t b_len) {
+  int c = memcmp(a, b, a_len < b_len ? a_len : b_len);
+  if (c != 0) {
+    return c;
   }
+  return (a_len > b_len) - (a_len < b_len);
+}
 
-  bencode_dict *result = NULL;
-  result = malloc(sizeof *result);
-  assert(result != NULL);
-
-  result->keys = NULL;
-  result->values = NULL;
-  result->type = BENCODE_DICT;
-  result->raw_size = 2;
-  result->length = 0;
-
-  bencode *key = NULL;
-  bencode *value = NULL;
-
-  const char *cur = bencoded_value + 1;
-  while (cur - bencoded_value < strlen(bencoded_value) - 1) {
-    if (cur[0] == 'e') {
+bencode *decode_dict_bencode(bencode_decoder *d) {
+  const char *start = d->cur;
+  size_t base = d->scratch->length;
+  int length = 0;
+  bool sorted = true;
+  bencode_string previous = {0};
+
+  d->cur++;
+
+  while (d->cur < d->end) {
+    if (d->cur[0] == 'e') {
+      d->cur++;
+
+      bencode_dict *result = decode_alloc(d, sizeof(*result));
+      result->type = BENCODE_DICT;
+      result->flags = d->flags | (sorted ? BENCODE_F_SORTED : 0);
+      result->raw_size = d->cur - start;
+      result->raw = start;
+      result->length = length;
+      result->keys = NULL;
+      result->values = NULL;
+      if (length > 0) {
+        result->keys = decode_alloc(d, sizeof(*result->keys) * length);
+        result->values = decode_alloc(d, sizeof(bencode *) * length);
+        dict_entry *entries = (dict_entry *)(d->scratch->data + base);
+        for (int i = 0; i < length; i++) {
+          result->keys[i] = entries[i].key;
+          result->values[i] = entries[i].value;
+        }
+      }
+
+      d->scratch->length = base;
       return (bencode *)result;
     }
 
-    // decode the key
-    if (bencode_get_type(cur) != BENCODE_STRING) {
-      return bencode_invalid();
+    dict_entry entry;
+    if (decode_string_into(d, &entry.key) == -1) {
+      break;
     }
 
-    key = decode_bencode(cur);
-    result->raw_size += key->raw_size;
-
-    cur += key->raw_size;
+    entry.value = decode_bencode_next(d);
+    if (entry.value == NULL) {
+      if (!(d->flags & BENCODE_F_VIEW)) {
+        decode_release(d, (void *)entry.key.value);
+      }
+      break;
+    }
 
-    // decode the value
-    value = decode_bencode(cur);
-    result->raw_size += value->raw_size;
+    if (length > 0 &&
+        key_compare(previous.value, previous.length, entry.key.value,
+                    entry.key.length) >= 0) {
+      sorted = false;
+    }
+    previous = entry.key;
 
-    result->length++;
+    bencode_scratch_push(d->scratch, &entry, sizeof(entry));
+    length++;
+  }
 
-    result->keys = realloc(result->keys, sizeof(char *) * result->length);
-    assert(result->keys != NULL);
-    result->values =
-        realloc(result->values, sizeof(bencode *) * result->length);
-    assert(result->values != NULL);
+  // ran out of input before the closing 'e' or a value failed to decode.
+  dict_entry *entries = (dict_entry *)(d->scratch->data + base);
+  for (int i = 0; i < length; i++) {
+    if (!(d->flags & BENCODE_F_VIEW)) {
+      decode_release(d, (void *)entries[i].key.value);
+    }
+    bencode_free(entries[i].value);
+  }
+  d->scratch->length = base;
+  return NULL;
+}
 
-    bencode_string *str = (bencode_string *)key;
-    result->keys[result->length - 1] = malloc(str->length + 1);
-    strncpy(result->keys[result->length - 1], str->value, str->length);
-    result->keys[result->length - 1][str->length] = 0;
-    bencode_free(key);
+bencode *decode_bencode_next(bencode_decoder *d) {
+  if (d->cur >= d->end) {
+    return NULL;
+  }
 
-    result->values[result->length - 1] = value;
+  enum bencode_type t = bencode_get_type(d->cur);
+  if (t == BENCODE_STRING)
+    return decode_string_bencode(d);
+  if (t == BENCODE_INTEGER)
+    return decode_integer_bencode(d);
+  if (t != BENCODE_LIST && t != BENCODE_DICT)
+    return NULL;
 
-    cur += value->raw_size;
-  }
+  // containers recurse, so crafted input must not nest them without bound.
+  if (d->depth == BENCODE_MAX_DEPTH)
+    return NULL;
+  d->depth++;
+  bencode *result =
+      t == BENCODE_LIST ? decode_list_bencode(d) : decode_dict_bencode(d);
+  d->depth--;
+  return result;
+}
 
-  // should be unreachable code.
-  return (bencode *)result;
+bencode *decode_bencode_n(const char *buffer, size_t size, int flags) {
+  bencode_scratch scratch = {0};
+  bencode_decoder d = {
+      .cur = buffer,
+      .end = buffer + size,
+      .flags = flags,
+      .scratch = &scratch,
+  };
+
+  bencode *result = decode_bencode_next(&d);
+  free(scratch.data);
+  return result;
 }
 
 bencode *decode_bencode(const char *bencoded_value) {
-  enum bencode_type t = bencode_get_type(bencoded_value);
-  if (t == BENCODE_STRING)
-    return decode_string_bencode(bencoded_value);
-  if (t == BENCODE_INTEGER)
-    return decode_integer_bencode(bencoded_value);
-  if (t == BENCODE_LIST)
-    return decode_list_bencode(bencoded_value);
-  if (t == BENCODE_DICT)
-    return decode_dict_bencode(bencoded_value);
-
-  fprintf(stderr, "Not supported: %s\n", bencoded_value);
-  exit(1);
+  return decode_bencode_n(bencoded_value, strlen(bencoded_value), 0);
 }
 
-void bencode_json(bencode *b) {
-  switch (b->type) {
-  case BENCODE_STRING: {
-    printf("\"%s\"", ((bencode_string *)b)->value);
-    break;
-  }
-  case BENCODE_INTEGER: {
-    printf("%ld", ((bencode_integer *)b)->value);
-    break;
-  }
-  case BENCODE_LIST: {
-    printf("[");
-    bencode_list *list = (bencode_list *)b;
-    for (int i = 0; i < list->length; i++) {
-      bencode_json(list->values[i]);
-      if (i < list->length - 1)
-        printf(",");
-    }
-    printf("]");
-    break;
-  }
-  case BENCODE_DICT: {
-    printf("{");
-    bencode_dict *dict = (bencode_dict *)b;
-    for (int i = 0; i < dict->length; i++) {
-      printf("\"%s\":", dict->keys[i]);
-      bencode_json(dict->values[i]);
-      if (i < dict->length - 1)
-        printf(",");
-    }
-    printf("}");
-    break;
-  }
+bencode *decode_bencode_view(const char *bencoded_value) {
+  return decode_bencode_n(bencoded_value, strlen(bencoded_value),
+                          BENCODE_F_VIEW);
+}
 
-  default:
-    fprintf(stderr, "invalid bencode");
-    return;
+typedef struct {
+  char *buffer;
+  size_t size;
+  size_t n;
+} print_target;
+
+static int print_write(void *userdata, const char *data, size_t size) {
+  print_target *target = userdata;
+  if (size > target->size - target->n) {
+    return -1;
   }
+  memcpy(target->buffer + target->n, data, size);
+  target->n += size;
+  return 0;
 }
 
 size_t bencode_print(bencode *b, char *buffer, size_t size) {
-  switch (b->type) {
-  case BENCODE_STRING: {
-    bencode_string *s = (bencode_string *)b;
-    int n = snprintf(buffer, size, "%d:", s->length);
-    assert(size - n > s->length);
-    memcpy(buffer + n, s->value, s->length);
-    return n + s->length;
-  }
-  case BENCODE_INTEGER: {
-    bencode_integer *i = (bencode_integer *)b;
-    return snprintf(buffer, size, "i%lde", i->value);
-  }
-  case BENCODE_LIST: {
-    int n = 0;
-    n += snprintf(buffer, size - n, "l");
-    bencode_list *list = (bencode_list *)b;
-    for (int i = 0; i < list->length; i++) {
-      n += bencode_print(list->values[i], buffer + n, size - n);
-    }
-    n += snprintf(buffer + n, size - n, "e");
-    return n;
-    break;
-  }
-  case BENCODE_DICT: {
-    int n = 0;
-    n += snprintf(buffer, size - n, "d");
-    bencode_dict *dict = (bencode_dict *)b;
-    for (int i = 0; i < dict->length; i++) {
-      n += snprintf(buffer + n, size - n, "%lu:%s", strlen(dict->keys[i]),
-                    dict->keys[i]);
-#ifdef _DEBUG
-      fprintf(stderr, "key[%d]: %s\n", i, dict->keys[i]);
-#endif
-      n += bencode_print(dict->values[i], buffer + n, size - n);
-    }
-    n += snprintf(buffer + n, size - n, "e");
-    return n;
-    break;
+  print_target target = {.buffer = buffer, .size = size};
+  bencode_writer w;
+  bencode_writer_init(&w, print_write, &target);
+
+  int err = bencode_write_value(&w, b);
+  if (err == 0) {
+    err = bencode_writer_flush(&w);
   }
+  bencode_writer_free(&w);
 
-  default:
-    fprintf(stderr, "invalid bencode");
+  if (err == -1) {
+    fprintf(stderr, "bencode does not fit in %lu bytes\n", size);
     return 0;
   }
-
-  return 0;
+  return target.n;
 }
 
 size_t bencode_to_string(bencode *b, char *buffer, size_t size) {
@@ -319,17 +414,94 @@ size_t bencode_to_string(bencode *b, char *buffer, size_t size) {
   }
 }
 
+const char *bencode_raw(bencode *b, size_t *size) {
+  if (!b || b->type == BENCODE_INVALID) {
+    return NULL;
+  }
+
+  *size = b->raw_size;
+  return b->raw;
+}
+
 bencode *bencode_key(bencode *b, const char *key) {
   if (!b || b->type != BENCODE_DICT) {
     return NULL;
   }
 
   bencode_dict *dict = (bencode_dict *)b;
+  size_t len = strlen(key);
+
+  if (b->flags & BENCODE_F_SORTED) {
+    int lo = 0;
+    int hi = dict->length - 1;
+    while (lo <= hi) {
+      int mid = lo + (hi - lo) / 2;
+      int c = key_compare(dict->keys[mid].value, dict->keys[mid].length, key,
+                          len);
+      if (c == 0) {
+        return dict->values[mid];
+      }
+      if (c < 0) {
+        lo = mid + 1;
+      } else {
+        hi = mid - 1;
+      }
+    }
+    return NULL;
+  }
+
   for (int i = 0; i < dict->length; i++) {
-    if (strcmp(dict->keys[i], key) == 0) {
+    if ((size_t)dict->keys[i].length == len &&
+        memcmp(dict->keys[i].value, key, len) == 0) {
       return dict->values[i];
     }
   }
 
   return NULL;
 }
+
+int bencode_keys(bencode *b, const char **keys, bencode **values, int n) {
+  if (!b || b->type != BENCODE_DICT) {
+    return -1;
+  }
+
+  bencode_dict *dict = (bencode_dict *)b;
+  int found = 0;
+
+  // with both sides sorted a single merge pass finds every key.
+  bool merge = b->flags & BENCODE_F_SORTED;
+  for (int i = 1; merge && i < n; i++) {
+    if (key_compare(keys[i - 1], strlen(keys[i - 1]), keys[i],
+                    strlen(keys[i])) >= 0) {
+      merge = false;
+    }
+  }
+
+  if (!merge) {
+    for (int i = 0; i < n; i++) {
+      values[i] = bencode_key(b, keys[i]);
+      found += values[i] != NULL;
+    }
+    return found;
+  }
+
+  int j = 0;
+  for (int i = 0; i < n; i++) {
+    size_t len = strlen(keys[i]);
+    values[i] = NULL;
+
+    int c = -1;
+    while (j < dict->length &&
+           (c = key_compare(dict->keys[j].value, dict->keys[j].length,
+                            keys[i], len)) < 0) {
+      j++;
+    }
+
+    if (j < dict->length && c == 0) {
+      values[i] = dict->values[j];
+      found++;
+    }
+  }
+
+  return found;
+}
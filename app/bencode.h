@@ -3,19 +3,211 @@
 
 #ifndef BENCODE_INTERNAL_H__
 typedef void bencode;
+typedef void bencode_arena;
+typedef void bencode_stream;
 #endif
 
 #include "stddef.h"
 
+enum bencode_flags {
+  // string values and dict keys point into the source buffer instead of
+  // being owned by the node.
+  BENCODE_F_VIEW = 1 << 0,
+};
+
+// decode_bencode_n decodes the first value in the size bytes at buffer in a
+// single pass. It never reads past buffer + size, so the input does not need
+// to be NUL terminated and may contain binary data.
+// in case of errors, it will return NULL.
+bencode *decode_bencode_n(const char *buffer, size_t size, int flags);
+
+// bencode_arena_create creates an arena that trees can be decoded into.
+// all nodes, child arrays and copied strings are bump allocated from blocks
+// of block_size bytes (0 picks a default).
+bencode_arena *bencode_arena_create(size_t block_size);
+
+// bencode_arena_reset drops every tree decoded into the arena but keeps a
+// block around, so decoding in a loop does not go back to malloc.
+void bencode_arena_reset(bencode_arena *arena);
+
+// bencode_arena_free frees the arena along with every tree decoded into it.
+void bencode_arena_free(bencode_arena *arena);
+
+// decode_bencode_arena works like decode_bencode_n but allocates the tree
+// from arena. The result must not be passed to bencode_free, it is released
+// by bencode_arena_reset or bencode_arena_free.
+// in case of errors, it will return NULL.
+bencode *decode_bencode_arena(bencode_arena *arena, const char *buffer,
+                              size_t size, int flags);
+
+// decode_bencode decodes a NUL terminated bencoded value.
+// in case of errors, it will return NULL.
 bencode *decode_bencode(const char *bencoded_value);
+
+// decode_bencode_view decodes without copying: string values and dict keys
+// are views into bencoded_value, so the returned tree is only valid as long
+// as that buffer is. Views are not NUL terminated.
+bencode *decode_bencode_view(const char *bencoded_value);
+
 void bencode_free(bencode *b);
 
 size_t bencode_to_string(bencode *b, char *buffer, size_t size);
-void bencode_json(bencode *b);
+
+// bencode_print encodes b into buffer and returns the number of bytes
+// written, or 0 if the encoding does not fit in size bytes.
 size_t bencode_print(bencode *b, char *buffer, size_t size);
 
+// bencode_write_callback receives the output of bencode_writer and
+// bencode_json_write, returning -1 fails the write.
+typedef int (*bencode_write_callback)(void *userdata, const char *data,
+                                      size_t size);
+
+// bencode_json prints b as JSON to stdout.
+void bencode_json(bencode *b);
+
+// bencode_json_write formats b as JSON into a large buffer that is handed
+// to write in big chunks. Strings are escaped, bytes that are not valid
+// UTF-8 (such as the binary pieces string) come out as \u00XX escapes so the
+// output is always valid JSON.
+// It returns -1 if write failed.
+int bencode_json_write(bencode *b, bencode_write_callback write,
+                       void *userdata);
+
+// bencode_cursor reads bencode in place without building a tree: values are
+// consumed one at a time and anything not needed is skipped, so extracting
+// a few fields costs no allocation whatever the size of the input.
+typedef struct {
+  const char *cur;
+  const char *end;
+  int error;
+} bencode_cursor;
+
+void bencode_cursor_init(bencode_cursor *c, const char *buffer, size_t size);
+
+// bencode_cursor_peek returns the bencode_event_type of the next value,
+// BENCODE_EV_END at the end of a container or 0 at the end of the input and
+// after errors.
+int bencode_cursor_peek(bencode_cursor *c);
+
+// bencode_cursor_enter steps into the list or dict at the cursor.
+int bencode_cursor_enter(bencode_cursor *c);
+
+// bencode_cursor_next returns 1 if the entered list has another value and 0
+// after consuming its end.
+int bencode_cursor_next(bencode_cursor *c);
+
+// bencode_cursor_next_key reads the next key of the entered dict as a view,
+// the cursor is then on its value. It returns 0 after consuming the end of
+// the dict.
+int bencode_cursor_next_key(bencode_cursor *c, const char **key,
+                            size_t *size);
+
+// bencode_cursor_find advances the entered dict to key and returns 1 with
+// the cursor on its value, or 0 if the dict ended without it.
+int bencode_cursor_find(bencode_cursor *c, const char *key);
+
+// bencode_cursor_string and bencode_cursor_int read the value at the cursor,
+// strings are views into the input.
+int bencode_cursor_string(bencode_cursor *c, const char **data, size_t *size);
+int bencode_cursor_int(bencode_cursor *c, long int *value);
+
+// bencode_cursor_skip skips the whole value at the cursor and, if raw is
+// not NULL, stores the span it occupied in the input.
+int bencode_cursor_skip(bencode_cursor *c, const char **raw, size_t *size);
+
+// all bencode_cursor functions return -1 on malformed input, the error is
+// sticky.
+
+// bencode_writer encodes bencode without building a tree. Without a write
+// callback the output accumulates in data, which grows as needed. With one,
+// data is a small staging buffer that is handed to the callback whenever it
+// fills up and on bencode_writer_flush.
+typedef struct {
+  char *data;
+  size_t length;
+  size_t capacity;
+  bencode_write_callback write;
+  void *userdata;
+  int error;
+} bencode_writer;
+
+void bencode_writer_init(bencode_writer *w, bencode_write_callback write,
+                         void *userdata);
+int bencode_writer_flush(bencode_writer *w);
+void bencode_writer_free(bencode_writer *w);
+
+// the bencode_write functions append a value to the output, lists and dicts
+// are opened with bencode_write_list/bencode_write_dict and closed with
+// bencode_write_end. Dict keys are written with bencode_write_string and
+// have to come in sorted order.
+//
+// They return -1 once the write callback failed, the error is sticky.
+int bencode_write_int(bencode_writer *w, long int value);
+int bencode_write_string(bencode_writer *w, const char *data, size_t size);
+int bencode_write_list(bencode_writer *w);
+int bencode_write_dict(bencode_writer *w);
+int bencode_write_end(bencode_writer *w);
+int bencode_write_value(bencode_writer *w, bencode *b);
+
+// bencode_raw returns the bytes b was decoded from and stores their count
+// in size, the span points into the buffer passed to the decoder.
+// in case of errors, it will return NULL.
+const char *bencode_raw(bencode *b, size_t *size);
+
 // bencode key returns the value associated to a key in bencode dict.
 // in case of errors, it will return NULL.
 bencode *bencode_key(bencode *b, const char *key);
 
+// bencode_keys looks up n keys at once and stores the value of keys[i], or
+// NULL if it is missing, in values[i]. When keys are passed in bencode sort
+// order the dict is walked only once.
+// It returns the number of keys found or -1 if b is not a dict.
+int bencode_keys(bencode *b, const char **keys, bencode **values, int n);
+
+enum bencode_event_type {
+  BENCODE_EV_INTEGER = 1,
+  BENCODE_EV_STRING = 2,
+  BENCODE_EV_LIST_BEGIN = 3,
+  BENCODE_EV_DICT_BEGIN = 4,
+  BENCODE_EV_END = 5,
+};
+
+// bencode_event is reported by a bencode_stream as soon as a value (or the
+// part of a string that has arrived so far) is complete. depth is 0 for the
+// top level value and grows by one inside every list or dict.
+//
+// dict keys arrive whole in a single event with is_key set. string values
+// arrive in one or more fragments: data and length cover the bytes at offset
+// within a string of total bytes, the last fragment ends at total.
+typedef struct {
+  enum bencode_event_type type;
+  int depth;
+  int is_key;
+  long int integer;
+  const char *data;
+  size_t length;
+  size_t offset;
+  size_t total;
+} bencode_event;
+
+// bencode_stream_callback is called for every event, returning -1 aborts
+// the stream.
+typedef int (*bencode_stream_callback)(void *userdata,
+                                       const bencode_event *event);
+
+// bencode_stream_create creates a push parser that accepts the input in
+// fragments of any size and keeps its state between them.
+bencode_stream *bencode_stream_create(bencode_stream_callback callback,
+                                      void *userdata);
+
+// bencode_stream_feed parses the next size bytes of input and reports
+// every event they complete. It returns -1 if the input is malformed or the
+// callback aborted, the stream is unusable afterwards.
+int bencode_stream_feed(bencode_stream *stream, const char *data, size_t size);
+
+// bencode_stream_done returns 1 once the top level value is complete.
+int bencode_stream_done(bencode_stream *stream);
+
+void bencode_stream_free(bencode_stream *stream);
+
 #endif /* BENCODE_H__*/
@@ -0,0 +1,84 @@
+#include "bencode_internal.h"
+#include "debug.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCODE_ARENA_BLOCK_SIZE (1 << 16)
+
+bencode_arena *bencode_arena_create(size_t block_size) {
+  bencode_arena *arena = malloc(sizeof(*arena));
+  assert(arena != NULL);
+  memset(arena, 0, sizeof(*arena));
+
+  arena->block_size = block_size > 0 ? block_size : BENCODE_ARENA_BLOCK_SIZE;
+  return arena;
+}
+
+void *bencode_arena_alloc(bencode_arena *arena, size_t size) {
+  size = (size + BENCODE_ARENA_ALIGN - 1) & ~(size_t)(BENCODE_ARENA_ALIGN - 1);
+
+  bencode_arena_block *block = arena->blocks;
+  if (block == NULL || block->size - block->used < size) {
+    size_t block_size = arena->block_size;
+    if (size > block_size) {
+      block_size = size;
+    }
+
+    block = malloc(sizeof(*block) + block_size);
+    assert(block != NULL);
+    block->size = block_size;
+    block->used = 0;
+    block->next = arena->blocks;
+    arena->blocks = block;
+  }
+
+  void *result = block->data + block->used;
+  block->used += size;
+  return result;
+}
+
+void bencode_arena_reset(bencode_arena *arena) {
+  bencode_arena_block *block = arena->blocks;
+  if (block == NULL) {
+    return;
+  }
+
+  // keep the newest block, it is the one the next decode starts filling.
+  bencode_arena_block *next = block->next;
+  while (next) {
+    bencode_arena_block *tmp = next->next;
+    free(next);
+    next = tmp;
+  }
+
+  block->next = NULL;
+  block->used = 0;
+}
+
+void bencode_arena_free(bencode_arena *arena) {
+  bencode_arena_block *block = arena->blocks;
+  while (block) {
+    bencode_arena_block *next = block->next;
+    free(block);
+    block = next;
+  }
+
+  free(arena->scratch.data);
+  free(arena);
+}
+
+bencode *decode_bencode_arena(bencode_arena *arena, const char *buffer,
+                              size_t size, int flags) {
+  bencode_decoder d = {
+      .cur = buffer,
+      .end = buffer + size,
+      .flags = flags | BENCODE_F_ARENA,
+      .arena = arena,
+      .scratch = &arena->scratch,
+  };
+
+  bencode *result = decode_bencode_next(&d);
+  arena->scratch.length = 0;
+  return result;
+}
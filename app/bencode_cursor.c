@@ -0,0 +1,200 @@
+#include "bencode_internal.h"
+#include "debug.h"
+#include <limits.h>
+#include <string.h>
+
+void bencode_cursor_init(bencode_cursor *c, const char *buffer, size_t size) {
+  c->cur = buffer;
+  c->end = buffer + size;
+  c->error = 0;
+}
+
+static int cursor_fail(bencode_cursor *c) {
+  c->error = 1;
+  return -1;
+}
+
+int bencode_cursor_peek(bencode_cursor *c) {
+  if (c->error || c->cur >= c->end) {
+    return 0;
+  }
+
+  char ch = c->cur[0];
+  if (ch >= '0' && ch <= '9')
+    return BENCODE_EV_STRING;
+  if (ch == 'i')
+    return BENCODE_EV_INTEGER;
+  if (ch == 'l')
+    return BENCODE_EV_LIST_BEGIN;
+  if (ch == 'd')
+    return BENCODE_EV_DICT_BEGIN;
+  if (ch == 'e')
+    return BENCODE_EV_END;
+
+  return 0;
+}
+
+int bencode_cursor_enter(bencode_cursor *c) {
+  int type = bencode_cursor_peek(c);
+  if (type != BENCODE_EV_LIST_BEGIN && type != BENCODE_EV_DICT_BEGIN) {
+    return cursor_fail(c);
+  }
+
+  c->cur++;
+  return 0;
+}
+
+int bencode_cursor_next(bencode_cursor *c) {
+  int type = bencode_cursor_peek(c);
+  if (type == 0) {
+    return cursor_fail(c);
+  }
+
+  if (type == BENCODE_EV_END) {
+    c->cur++;
+    return 0;
+  }
+
+  return 1;
+}
+
+int bencode_cursor_string(bencode_cursor *c, const char **data, size_t *size) {
+  if (c->error) {
+    return -1;
+  }
+
+  const char *cur = c->cur;
+  size_t len = 0;
+  while (cur < c->end && *cur >= '0' && *cur <= '9') {
+    len = len * 10 + (*cur - '0');
+    if (len > INT_MAX) {
+      return cursor_fail(c);
+    }
+    cur++;
+  }
+
+  if (cur == c->cur || cur == c->end || *cur != ':') {
+    return cursor_fail(c);
+  }
+  cur++;
+
+  if (len > (size_t)(c->end - cur)) {
+    return cursor_fail(c);
+  }
+
+  *data = cur;
+  *size = len;
+  c->cur = cur + len;
+  return 0;
+}
+
+int bencode_cursor_int(bencode_cursor *c, long int *value) {
+  if (bencode_cursor_peek(c) != BENCODE_EV_INTEGER) {
+    return cursor_fail(c);
+  }
+
+  const char *cur = c->cur + 1;
+  int negative = 0;
+  if (cur < c->end && *cur == '-') {
+    negative = 1;
+    cur++;
+  }
+
+  // the most negative value is one further from zero than LONG_MAX.
+  unsigned long limit = negative ? (unsigned long)LONG_MAX + 1 : LONG_MAX;
+  const char *digits = cur;
+  unsigned long n = 0;
+  while (cur < c->end && *cur >= '0' && *cur <= '9') {
+    unsigned long digit = *cur - '0';
+    if (n > (limit - digit) / 10) {
+      return cursor_fail(c);
+    }
+    n = n * 10 + digit;
+    cur++;
+  }
+
+  if (cur == digits || cur == c->end || *cur != 'e') {
+    return cursor_fail(c);
+  }
+
+  *value = negative ? (long int)-n : (long int)n;
+  c->cur = cur + 1;
+  return 0;
+}
+
+int bencode_cursor_next_key(bencode_cursor *c, const char **key,
+                            size_t *size) {
+  int more = bencode_cursor_next(c);
+  if (more != 1) {
+    return more;
+  }
+
+  if (bencode_cursor_string(c, key, size) == -1) {
+    return -1;
+  }
+  return 1;
+}
+
+int bencode_cursor_skip(bencode_cursor *c, const char **raw, size_t *size) {
+  const char *start = c->cur;
+  int depth = 0;
+
+  // containers are walked with a depth counter, strings are jumped over
+  // using their length prefix, so skipping never recurses or allocates.
+  do {
+    const char *data;
+    size_t len;
+    long int value;
+
+    switch (bencode_cursor_peek(c)) {
+    case BENCODE_EV_STRING:
+      if (bencode_cursor_string(c, &data, &len) == -1) {
+        return -1;
+      }
+      break;
+    case BENCODE_EV_INTEGER:
+      if (bencode_cursor_int(c, &value) == -1) {
+        return -1;
+      }
+      break;
+    case BENCODE_EV_LIST_BEGIN:
+    case BENCODE_EV_DICT_BEGIN:
+      c->cur++;
+      depth++;
+      break;
+    case BENCODE_EV_END:
+      if (depth == 0) {
+        return cursor_fail(c);
+      }
+      c->cur++;
+      depth--;
+      break;
+    default:
+      return cursor_fail(c);
+    }
+  } while (depth > 0);
+
+  if (raw != NULL) {
+    *raw = start;
+    *size = c->cur - start;
+  }
+  return 0;
+}
+
+int bencode_cursor_find(bencode_cursor *c, const char *key) {
+  size_t key_size = strlen(key);
+
+  const char *k;
+  size_t k_size;
+  int more;
+  while ((more = bencode_cursor_next_key(c, &k, &k_size)) == 1) {
+    if (k_size == key_size && memcmp(k, key, key_size) == 0) {
+      return 1;
+    }
+    if (bencode_cursor_skip(c, NULL, NULL) == -1) {
+      return -1;
+    }
+  }
+
+  return more;
+}
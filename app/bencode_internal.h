@@ -1,6 +1,8 @@
 #ifndef BENCODE_INTERNAL_H__
 #define BENCODE_INTERNAL_H__
 
+#include <stddef.h>
+
 enum bencode_type {
   BENCODE_INVALID = 0,
   BENCODE_STRING = 1,
@@ -9,45 +11,149 @@ enum bencode_type {
   BENCODE_DICT = 4
 };
 
+// BENCODE_F_ARENA marks nodes owned by a bencode_arena, bencode_free leaves
+// them alone. It is kept clear of the public bencode_flags bits.
+#define BENCODE_F_ARENA (1 << 16)
+
+// BENCODE_F_SORTED is set on dicts whose keys were found in strictly
+// increasing order while decoding, so lookups can binary search them.
+#define BENCODE_F_SORTED (1 << 17)
+
+// raw and raw_size are the span the value was decoded from in the source
+// buffer, valid for as long as that buffer is.
 typedef struct {
   enum bencode_type type;
+  int flags;
   int raw_size;
+  const char *raw;
 } bencode;
 
 typedef struct {
   enum bencode_type type;
+  int flags;
   int raw_size;
+  const char *raw;
   int length;
-  char *value;
+  const char *value;
 } bencode_string;
 
 typedef struct {
   enum bencode_type type;
+  int flags;
   int raw_size;
+  const char *raw;
   long int value;
 } bencode_integer;
 
 typedef struct {
   enum bencode_type type;
+  int flags;
   int raw_size;
+  const char *raw;
   int length;
   bencode **values;
 } bencode_list;
 
 typedef struct {
   enum bencode_type type;
+  int flags;
   int raw_size;
+  const char *raw;
   int length;
-  char **keys;
+  bencode_string *keys;
   bencode **values;
 } bencode_dict;
 
-bencode *bencode_invalid();
-bencode *decode_string_bencode(const char *bencoded_value);
-bencode *decode_integer_bencode(const char *bencoded_value);
-bencode *decode_list_bencode(const char *bencoded_value);
-bencode *decode_dict_bencode(const char *bencoded_value);
+// bencode_scratch is a growable stack the decoder collects children on, so
+// that each list or dict allocates its child arrays once, at their final size.
+typedef struct {
+  char *data;
+  size_t length;
+  size_t capacity;
+} bencode_scratch;
+
+void bencode_scratch_push(bencode_scratch *s, const void *data, size_t size);
+
+// BENCODE_ARENA_ALIGN is the alignment of every arena allocation. data is
+// aligned to it as well, so the header is padded up to a multiple of it.
+#define BENCODE_ARENA_ALIGN 16
+
+typedef struct bencode_arena_block {
+  struct bencode_arena_block *next;
+  size_t size;
+  size_t used;
+  _Alignas(BENCODE_ARENA_ALIGN) char data[];
+} bencode_arena_block;
+
+typedef struct {
+  bencode_arena_block *blocks;
+  size_t block_size;
+  bencode_scratch scratch;
+} bencode_arena;
+
+void *bencode_arena_alloc(bencode_arena *arena, size_t size);
+
+// BENCODE_MAX_DEPTH is how deeply lists and dicts may nest, in the decoders
+// and the push parser alike.
+#define BENCODE_MAX_DEPTH 64
+
+// bencode_decoder walks the input once: every decode function consumes the
+// value at cur, advances cur past it and never reads at or beyond end. depth
+// counts the lists and dicts open around cur.
+typedef struct {
+  const char *cur;
+  const char *end;
+  int depth;
+  int flags;
+  bencode_arena *arena;
+  bencode_scratch *scratch;
+} bencode_decoder;
+
+bencode *decode_string_bencode(bencode_decoder *d);
+bencode *decode_integer_bencode(bencode_decoder *d);
+bencode *decode_list_bencode(bencode_decoder *d);
+bencode *decode_dict_bencode(bencode_decoder *d);
+bencode *decode_bencode_next(bencode_decoder *d);
+
+// bencode_stream needs the public callback type, it is completed below.
+typedef struct bencode_stream bencode_stream;
 
 #include "bencode.h"
 
+#define BENCODE_STREAM_MAX_DEPTH BENCODE_MAX_DEPTH
+
+enum bencode_stream_state {
+  BENCODE_STREAM_VALUE = 0,
+  BENCODE_STREAM_INTEGER,
+  BENCODE_STREAM_STRING_LENGTH,
+  BENCODE_STREAM_STRING_DATA,
+  BENCODE_STREAM_DONE,
+  BENCODE_STREAM_ERROR,
+};
+
+typedef struct {
+  char type;
+  int expect_key;
+} bencode_stream_frame;
+
+struct bencode_stream {
+  enum bencode_stream_state state;
+  bencode_stream_callback callback;
+  void *userdata;
+
+  int depth;
+  bencode_stream_frame stack[BENCODE_STREAM_MAX_DEPTH];
+
+  // integer or string length being read.
+  int negative;
+  int digits;
+  unsigned long number;
+
+  // string being read, keys are collected in key so they arrive whole.
+  int is_key;
+  size_t string_total;
+  size_t string_offset;
+  bencode_scratch key;
+};
+
 #endif /* BENCODE_INTERNAL_H_ */
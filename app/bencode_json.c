@@ -0,0 +1,223 @@
+#include "bencode_internal.h"
+#include "debug.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define JSON_BUFFER_SIZE (1 << 16)
+
+typedef struct {
+  char data[JSON_BUFFER_SIZE];
+  size_t length;
+  bencode_write_callback write;
+  void *userdata;
+  int error;
+} json_writer;
+
+static void json_flush(json_writer *w) {
+  // after an error the output is dropped, but the buffer is still emptied.
+  if (!w->error && w->length > 0 &&
+      w->write(w->userdata, w->data, w->length) == -1) {
+    w->error = 1;
+  }
+  w->length = 0;
+}
+
+static void json_put(json_writer *w, const char *data, size_t size) {
+  while (size > 0) {
+    if (w->length == JSON_BUFFER_SIZE) {
+      json_flush(w);
+    }
+
+    size_t n = JSON_BUFFER_SIZE - w->length;
+    if (n > size) {
+      n = size;
+    }
+    memcpy(w->data + w->length, data, n);
+    w->length += n;
+    data += n;
+    size -= n;
+  }
+}
+
+static void json_put_char(json_writer *w, char c) {
+  if (w->length == JSON_BUFFER_SIZE) {
+    json_flush(w);
+  }
+  w->data[w->length++] = c;
+}
+
+static void json_integer(json_writer *w, long int value) {
+  char buffer[24];
+  char *cur = buffer + sizeof(buffer);
+
+  unsigned long n = value < 0 ? -(unsigned long)value : (unsigned long)value;
+  do {
+    *--cur = '0' + n % 10;
+    n /= 10;
+  } while (n > 0);
+  if (value < 0) {
+    *--cur = '-';
+  }
+
+  json_put(w, cur, buffer + sizeof(buffer) - cur);
+}
+
+// utf8_length returns the length of the valid UTF-8 sequence at s, or 0 if
+// it is malformed, overlong, a surrogate or cut short.
+static size_t utf8_length(const unsigned char *s, size_t size) {
+  size_t len;
+  unsigned int min;
+  unsigned int cp;
+
+  if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+    len = 2, min = 0x80, cp = s[0] & 0x1f;
+  } else if ((s[0] & 0xf0) == 0xe0) {
+    len = 3, min = 0x800, cp = s[0] & 0x0f;
+  } else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+    len = 4, min = 0x10000, cp = s[0] & 0x07;
+  } else {
+    return 0;
+  }
+
+  if (len > size) {
+    return 0;
+  }
+  for (size_t i = 1; i < len; i++) {
+    if ((s[i] & 0xc0) != 0x80) {
+      return 0;
+    }
+    cp = (cp << 6) | (s[i] & 0x3f);
+  }
+
+  if (cp < min || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff)) {
+    return 0;
+  }
+  return len;
+}
+
+static void json_string(json_writer *w, const char *value, size_t size) {
+  static const char hex[] = "0123456789abcdef";
+  const unsigned char *s = (const unsigned char *)value;
+  const unsigned char *end = s + size;
+
+  json_put_char(w, '"');
+  while (s < end) {
+    // copy runs of plain ASCII in one go.
+    const unsigned char *run = s;
+    while (s < end && *s >= 0x20 && *s < 0x80 && *s != '"' && *s != '\\') {
+      s++;
+    }
+    json_put(w, (const char *)run, s - run);
+    if (s == end) {
+      break;
+    }
+
+    if (*s >= 0x80) {
+      size_t len = utf8_length(s, end - s);
+      if (len > 0) {
+        json_put(w, (const char *)s, len);
+        s += len;
+        continue;
+      }
+    }
+
+    char escape[6] = {'\\', 0};
+    size_t escape_size = 2;
+    switch (*s) {
+    case '"':
+      escape[1] = '"';
+      break;
+    case '\\':
+      escape[1] = '\\';
+      break;
+    case '\n':
+      escape[1] = 'n';
+      break;
+    case '\r':
+      escape[1] = 'r';
+      break;
+    case '\t':
+      escape[1] = 't';
+      break;
+    default:
+      // control characters and bytes that are not valid UTF-8.
+      memcpy(escape + 1, "u00", 3);
+      escape[4] = hex[*s >> 4];
+      escape[5] = hex[*s & 0xf];
+      escape_size = 6;
+      break;
+    }
+    json_put(w, escape, escape_size);
+    s++;
+  }
+  json_put_char(w, '"');
+}
+
+static void json_value(json_writer *w, bencode *b) {
+  switch (b->type) {
+  case BENCODE_STRING: {
+    bencode_string *s = (bencode_string *)b;
+    json_string(w, s->value, s->length);
+    break;
+  }
+  case BENCODE_INTEGER: {
+    json_integer(w, ((bencode_integer *)b)->value);
+    break;
+  }
+  case BENCODE_LIST: {
+    json_put_char(w, '[');
+    bencode_list *list = (bencode_list *)b;
+    for (int i = 0; i < list->length; i++) {
+      if (i > 0)
+        json_put_char(w, ',');
+      json_value(w, list->values[i]);
+    }
+    json_put_char(w, ']');
+    break;
+  }
+  case BENCODE_DICT: {
+    json_put_char(w, '{');
+    bencode_dict *dict = (bencode_dict *)b;
+    for (int i = 0; i < dict->length; i++) {
+      if (i > 0)
+        json_put_char(w, ',');
+      json_string(w, dict->keys[i].value, dict->keys[i].length);
+      json_put_char(w, ':');
+      json_value(w, dict->values[i]);
+    }
+    json_put_char(w, '}');
+    break;
+  }
+
+  default:
+    fprintf(stderr, "invalid bencode");
+    w->error = 1;
+    return;
+  }
+}
+
+int bencode_json_write(bencode *b, bencode_write_callback write,
+                       void *userdata) {
+  json_writer *w = malloc(sizeof(*w));
+  assert(w != NULL);
+  w->length = 0;
+  w->write = write;
+  w->userdata = userdata;
+  w->error = 0;
+
+  json_value(w, b);
+  json_flush(w);
+
+  int err = w->error ? -1 : 0;
+  free(w);
+  return err;
+}
+
+static int json_stdout(void *userdata, const char *data, size_t size) {
+  (void)userdata;
+  return fwrite(data, 1, size, stdout) == size ? 0 : -1;
+}
+
+void bencode_json(bencode *b) { bencode_json_write(b, json_stdout, NULL); }
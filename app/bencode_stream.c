@@ -0,0 +1,259 @@
+#include "bencode_internal.h"
+#include "debug.h"
+#include <assert.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+bencode_stream *bencode_stream_create(bencode_stream_callback callback,
+                                      void *userdata) {
+  bencode_stream *stream = malloc(sizeof(*stream));
+  assert(stream != NULL);
+  memset(stream, 0, sizeof(*stream));
+
+  stream->state = BENCODE_STREAM_VALUE;
+  stream->callback = callback;
+  stream->userdata = userdata;
+  return stream;
+}
+
+void bencode_stream_free(bencode_stream *stream) {
+  free(stream->key.data);
+  free(stream);
+}
+
+int bencode_stream_done(bencode_stream *stream) {
+  return stream->state == BENCODE_STREAM_DONE;
+}
+
+static int stream_fail(bencode_stream *stream) {
+  stream->state = BENCODE_STREAM_ERROR;
+  return -1;
+}
+
+static int stream_emit(bencode_stream *stream, bencode_event *event) {
+  event->depth = stream->depth;
+  if (stream->callback(stream->userdata, event) == -1) {
+    return stream_fail(stream);
+  }
+  return 0;
+}
+
+// stream_value_done moves on after a value at the current depth completed:
+// inside a dict keys and values alternate, at the top level we are done.
+static void stream_value_done(bencode_stream *stream) {
+  if (stream->depth == 0) {
+    stream->state = BENCODE_STREAM_DONE;
+    return;
+  }
+
+  bencode_stream_frame *top = &stream->stack[stream->depth - 1];
+  if (top->type == 'd') {
+    top->expect_key = !top->expect_key;
+  }
+  stream->state = BENCODE_STREAM_VALUE;
+}
+
+static int stream_string_done(bencode_stream *stream) {
+  if (stream->is_key) {
+    bencode_event event = {
+        .type = BENCODE_EV_STRING,
+        .is_key = 1,
+        .data = stream->key.data,
+        .length = stream->key.length,
+        .total = stream->key.length,
+    };
+    if (stream_emit(stream, &event) == -1) {
+      return -1;
+    }
+  }
+
+  stream_value_done(stream);
+  return 0;
+}
+
+static int stream_value(bencode_stream *stream, char c) {
+  bencode_stream_frame *top =
+      stream->depth > 0 ? &stream->stack[stream->depth - 1] : NULL;
+
+  if (c == 'e' && top != NULL) {
+    if (top->type == 'd' && !top->expect_key) {
+      // a key without a value.
+      return stream_fail(stream);
+    }
+
+    stream->depth--;
+    bencode_event event = {.type = BENCODE_EV_END};
+    if (stream_emit(stream, &event) == -1) {
+      return -1;
+    }
+    stream_value_done(stream);
+    return 0;
+  }
+
+  int expect_key = top != NULL && top->type == 'd' && top->expect_key;
+  if (expect_key && !(c >= '0' && c <= '9')) {
+    return stream_fail(stream);
+  }
+
+  if (c >= '0' && c <= '9') {
+    stream->state = BENCODE_STREAM_STRING_LENGTH;
+    stream->is_key = expect_key;
+    stream->number = c - '0';
+    stream->digits = 1;
+    return 0;
+  }
+
+  if (c == 'i') {
+    stream->state = BENCODE_STREAM_INTEGER;
+    stream->negative = 0;
+    stream->number = 0;
+    stream->digits = 0;
+    return 0;
+  }
+
+  if (c == 'l' || c == 'd') {
+    if (stream->depth == BENCODE_STREAM_MAX_DEPTH) {
+      return stream_fail(stream);
+    }
+
+    bencode_event event = {
+        .type = c == 'l' ? BENCODE_EV_LIST_BEGIN : BENCODE_EV_DICT_BEGIN,
+    };
+    if (stream_emit(stream, &event) == -1) {
+      return -1;
+    }
+
+    stream->stack[stream->depth].type = c;
+    stream->stack[stream->depth].expect_key = 1;
+    stream->depth++;
+    return 0;
+  }
+
+  return stream_fail(stream);
+}
+
+static int stream_integer(bencode_stream *stream, char c) {
+  if (c == '-' && stream->digits == 0 && !stream->negative) {
+    stream->negative = 1;
+    return 0;
+  }
+
+  if (c >= '0' && c <= '9') {
+    // the most negative value is one further from zero than LONG_MAX.
+    unsigned long limit =
+        stream->negative ? (unsigned long)LONG_MAX + 1 : LONG_MAX;
+    unsigned long digit = c - '0';
+    if (stream->number > (limit - digit) / 10) {
+      return stream_fail(stream);
+    }
+    stream->number = stream->number * 10 + digit;
+    stream->digits++;
+    return 0;
+  }
+
+  if (c == 'e' && stream->digits > 0) {
+    bencode_event event = {
+        .type = BENCODE_EV_INTEGER,
+        .integer = stream->negative ? (long int)-stream->number
+                                    : (long int)stream->number,
+    };
+    if (stream_emit(stream, &event) == -1) {
+      return -1;
+    }
+    stream_value_done(stream);
+    return 0;
+  }
+
+  return stream_fail(stream);
+}
+
+static int stream_string_length(bencode_stream *stream, char c) {
+  if (c >= '0' && c <= '9') {
+    stream->number = stream->number * 10 + (c - '0');
+    if (stream->number > INT_MAX) {
+      return stream_fail(stream);
+    }
+    return 0;
+  }
+
+  if (c != ':') {
+    return stream_fail(stream);
+  }
+
+  stream->state = BENCODE_STREAM_STRING_DATA;
+  stream->string_total = stream->number;
+  stream->string_offset = 0;
+  stream->key.length = 0;
+
+  if (stream->string_total > 0) {
+    return 0;
+  }
+
+  // an empty string is complete as soon as its length is.
+  if (!stream->is_key) {
+    bencode_event event = {.type = BENCODE_EV_STRING, .data = ""};
+    if (stream_emit(stream, &event) == -1) {
+      return -1;
+    }
+  }
+  return stream_string_done(stream);
+}
+
+int bencode_stream_feed(bencode_stream *stream, const char *data,
+                        size_t size) {
+  const char *cur = data;
+  const char *end = data + size;
+
+  while (cur < end) {
+    int err = 0;
+
+    switch (stream->state) {
+    case BENCODE_STREAM_VALUE:
+      err = stream_value(stream, *cur++);
+      break;
+    case BENCODE_STREAM_INTEGER:
+      err = stream_integer(stream, *cur++);
+      break;
+    case BENCODE_STREAM_STRING_LENGTH:
+      err = stream_string_length(stream, *cur++);
+      break;
+    case BENCODE_STREAM_STRING_DATA: {
+      // hand out everything of the string this fragment holds at once.
+      size_t n = stream->string_total - stream->string_offset;
+      if (n > (size_t)(end - cur)) {
+        n = end - cur;
+      }
+
+      if (stream->is_key) {
+        bencode_scratch_push(&stream->key, cur, n);
+      } else {
+        bencode_event event = {
+            .type = BENCODE_EV_STRING,
+            .data = cur,
+            .length = n,
+            .offset = stream->string_offset,
+            .total = stream->string_total,
+        };
+        err = stream_emit(stream, &event);
+      }
+
+      cur += n;
+      stream->string_offset += n;
+      if (err == 0 && stream->string_offset == stream->string_total) {
+        err = stream_string_done(stream);
+      }
+      break;
+    }
+    default:
+      // trailing data after the top level value, or a previous error.
+      return stream_fail(stream);
+    }
+
+    if (err == -1) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,173 @@
+#include "bencode_internal.h"
+#include "debug.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCODE_WRITER_BUFFER_SIZE (1 << 12)
+
+void bencode_writer_init(bencode_writer *w, bencode_write_callback write,
+                         void *userdata) {
+  memset(w, 0, sizeof(*w));
+  w->write = write;
+  w->userdata = userdata;
+}
+
+void bencode_writer_free(bencode_writer *w) {
+  free(w->data);
+  memset(w, 0, sizeof(*w));
+}
+
+int bencode_writer_flush(bencode_writer *w) {
+  if (w->error) {
+    return -1;
+  }
+
+  if (w->write == NULL || w->length == 0) {
+    return 0;
+  }
+
+  if (w->write(w->userdata, w->data, w->length) == -1) {
+    w->error = 1;
+    return -1;
+  }
+
+  w->length = 0;
+  return 0;
+}
+
+// writer_reserve makes room for size more bytes and returns where they go.
+static char *writer_reserve(bencode_writer *w, size_t size) {
+  if (w->error) {
+    return NULL;
+  }
+
+  if (w->length + size > w->capacity) {
+    if (w->write != NULL && bencode_writer_flush(w) == -1) {
+      return NULL;
+    }
+
+    if (w->length + size > w->capacity) {
+      size_t capacity = w->capacity ? w->capacity : BENCODE_WRITER_BUFFER_SIZE;
+      while (capacity < w->length + size) {
+        capacity *= 2;
+      }
+      w->data = realloc(w->data, capacity);
+      assert(w->data != NULL);
+      w->capacity = capacity;
+    }
+  }
+
+  char *result = w->data + w->length;
+  w->length += size;
+  return result;
+}
+
+// format_decimal writes value in decimal to the end of buffer and returns
+// where the digits start.
+static char *format_decimal(char *end, unsigned long value) {
+  char *cur = end;
+  do {
+    *--cur = '0' + value % 10;
+    value /= 10;
+  } while (value > 0);
+  return cur;
+}
+
+static int writer_put(bencode_writer *w, const char *data, size_t size) {
+  char *out = writer_reserve(w, size);
+  if (out == NULL) {
+    return -1;
+  }
+  memcpy(out, data, size);
+  return 0;
+}
+
+int bencode_write_int(bencode_writer *w, long int value) {
+  char buffer[24];
+  char *end = buffer + sizeof(buffer);
+  *--end = 'e';
+
+  unsigned long magnitude =
+      value < 0 ? -(unsigned long)value : (unsigned long)value;
+  char *cur = format_decimal(end, magnitude);
+  if (value < 0) {
+    *--cur = '-';
+  }
+  *--cur = 'i';
+
+  return writer_put(w, cur, buffer + sizeof(buffer) - cur);
+}
+
+int bencode_write_string(bencode_writer *w, const char *data, size_t size) {
+  char buffer[24];
+  char *end = buffer + sizeof(buffer);
+  *--end = ':';
+  char *cur = format_decimal(end, size);
+
+  if (writer_put(w, cur, buffer + sizeof(buffer) - cur) == -1) {
+    return -1;
+  }
+
+  // large payloads go straight to the callback instead of via the buffer.
+  if (w->write != NULL && size >= BENCODE_WRITER_BUFFER_SIZE) {
+    if (bencode_writer_flush(w) == -1) {
+      return -1;
+    }
+    if (w->write(w->userdata, data, size) == -1) {
+      w->error = 1;
+      return -1;
+    }
+    return 0;
+  }
+
+  return writer_put(w, data, size);
+}
+
+int bencode_write_list(bencode_writer *w) { return writer_put(w, "l", 1); }
+
+int bencode_write_dict(bencode_writer *w) { return writer_put(w, "d", 1); }
+
+int bencode_write_end(bencode_writer *w) { return writer_put(w, "e", 1); }
+
+int bencode_write_value(bencode_writer *w, bencode *b) {
+  switch (b->type) {
+  case BENCODE_STRING: {
+    bencode_string *s = (bencode_string *)b;
+    return bencode_write_string(w, s->value, s->length);
+  }
+  case BENCODE_INTEGER: {
+    return bencode_write_int(w, ((bencode_integer *)b)->value);
+  }
+  case BENCODE_LIST: {
+    bencode_list *list = (bencode_list *)b;
+    if (bencode_write_list(w) == -1) {
+      return -1;
+    }
+    for (int i = 0; i < list->length; i++) {
+      if (bencode_write_value(w, list->values[i]) == -1) {
+        return -1;
+      }
+    }
+    return bencode_write_end(w);
+  }
+  case BENCODE_DICT: {
+    bencode_dict *dict = (bencode_dict *)b;
+    if (bencode_write_dict(w) == -1) {
+      return -1;
+    }
+    for (int i = 0; i < dict->length; i++) {
+      if (bencode_write_string(w, dict->keys[i].value,
+                               dict->keys[i].length) == -1 ||
+          bencode_write_value(w, dict->values[i]) == -1) {
+        return -1;
+      }
+    }
+    return bencode_write_end(w);
+  }
+
+  default:
+    w->error = 1;
+    return -1;
+  }
+}
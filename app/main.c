@@ -9,6 +9,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 int start(int argc, char *argv[]) {
@@ -29,6 +30,10 @@ int start(int argc, char *argv[]) {
     char *torrent_file = argv[2];
     const char *encoded_str = torrent_file;
     bencode *b = decode_bencode(encoded_str);
+    if (b == NULL) {
+      fprintf(stderr, "invalid bencode\n");
+      return 1;
+    }
     bencode_json(b);
     printf("\n");
     bencode_free(b);
@@ -54,6 +59,12 @@ int start(int argc, char *argv[]) {
       printf("%02x", t.info_hash[i]);
     }
     printf("\nPiece Length: %lu\n", t.piece_length);
+    if (t.no_of_files > 1) {
+      printf("Files:\n");
+      for (int i = 0; i < t.no_of_files; i++) {
+        printf("%lu %s\n", t.files[i].length, t.files[i].path);
+      }
+    }
     printf("Piece Hashes:\n");
 
     for (int i = 0; i < t.no_of_piece_hashes; i++) {
@@ -63,7 +74,6 @@ int start(int argc, char *argv[]) {
       printf("\n");
     }
 
-    free(t.pieces);
     torrent_close(h);
 
     return result;
@@ -86,6 +96,7 @@ int start(int argc, char *argv[]) {
       printf("%s:%d\n", inet_ntoa(addr), ntohs(peers[i].port));
     }
 
+    free(peers);
     torrent_close(h);
     return 0;
   }
@@ -180,25 +191,299 @@ int start(int argc, char *argv[]) {
     THandle h = torrent_open(torrent_file);
     assert(h);
 
-    TInfo info = {0};
-    torrent_get_info(h, &info);
+    // TORRENT_IO=uring drives the connections through io_uring.
+    const char *io = getenv("TORRENT_IO");
+    if (io != NULL && strcmp(io, "uring") == 0) {
+      torrent_set_backend(h, TORRENT_BACKEND_URING);
+    }
 
-    unsigned char *buffer = malloc(info.length + 1);
+    // multi-file torrents are laid out below output_file as a directory.
+    // pieces are written there as soon as they are verified, only a few
+    // of them are in memory at a time.
+    if (torrent_storage_open(h, output_file) == -1) {
+      torrent_close(h);
+      return 1;
+    }
 
-    int n = torrent_download(h, buffer, info.length);
-    assert(n > 0);
+    if (torrent_download(h, NULL, 0) == -1) {
+      fprintf(stderr, "error downloading %s\n", torrent_file);
+      torrent_close(h);
+      return 1;
+    }
 
-    int fd = open(output_file, O_RDWR | O_CREAT, 0644);
-    if (fd < 0) {
-      perror("error opening output_file");
+    torrent_close(h);
+    return 0;
+  }
+
+  if (strcmp(command, "index") == 0) {
+    if (argc != 4) {
+      fprintf(stderr, "Usage: %s index <torrent_dir> <index_file>\n",
+              argv[0]);
       return 1;
     }
 
-    write(fd, buffer, n);
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
 
+    TIndex index = torrent_index_build(argv[2], 0);
+    int n = torrent_index_count(index);
+    int result = torrent_index_save(index, argv[3]);
+    torrent_index_free(index);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ms = (end.tv_sec - begin.tv_sec) * 1e3 +
+                (end.tv_nsec - begin.tv_nsec) / 1e6;
+    printf("Indexed %d torrents in %.1f ms\n", n, ms);
+    return result == 0 ? 0 : 1;
+  }
+
+  if (strcmp(command, "lookup") == 0) {
+    if (argc != 4 || strlen(argv[3]) != SHA_DIGEST_LENGTH * 2) {
+      fprintf(stderr, "Usage: %s lookup <index_file> <info_hash>\n",
+              argv[0]);
+      return 1;
+    }
+
+    uint8_t info_hash[SHA_DIGEST_LENGTH];
+    for (int i = 0; i < SHA_DIGEST_LENGTH; i++) {
+      unsigned int byte;
+      if (sscanf(argv[3] + i * 2, "%2x", &byte) != 1) {
+        fprintf(stderr, "invalid info hash\n");
+        return 1;
+      }
+      info_hash[i] = byte;
+    }
+
+    TIndex index = torrent_index_load(argv[2]);
+    if (index == NULL) {
+      return 1;
+    }
+
+    const TIndexEntry *entry = torrent_index_find(index, info_hash);
+    if (entry == NULL) {
+      fprintf(stderr, "info hash not found\n");
+      torrent_index_free(index);
+      return 1;
+    }
+
+    printf("Path: %s\n", entry->path);
+    printf("Tracker URL: %s\n", entry->tracker);
+    printf("Length: %lu\n", entry->length);
+    printf("Piece Length: %lu\n", entry->piece_length);
+    printf("Pieces: %d\n", entry->no_of_piece_hashes);
+
+    torrent_index_free(index);
+    return 0;
+  }
+
+  if (strcmp(command, "verify") == 0) {
+    if (argc != 5) {
+      fprintf(stderr, "Usage: %s verify <torrent> <path> <bitfield_file>\n",
+              argv[0]);
+      return 1;
+    }
+
+    THandle h = torrent_open(argv[2]);
+    if (h == NULL) {
+      return 1;
+    }
+    TInfo info = {0};
+    torrent_get_info(h, &info);
+
+    size_t size = (info.no_of_piece_hashes + 7) / 8;
+    uint8_t *bitfield = malloc(size > 0 ? size : 1);
+    assert(bitfield);
+    int good = torrent_verify(h, argv[3], 0, bitfield);
+    if (good == -1) {
+      free(bitfield);
+      torrent_close(h);
+      return 1;
+    }
+
+    int fd = open(argv[4], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write(fd, bitfield, size) != (ssize_t)size) {
+      perror(argv[4]);
+      if (fd >= 0) {
+        close(fd);
+      }
+      free(bitfield);
+      torrent_close(h);
+      return 1;
+    }
     close(fd);
+
+    printf("Pieces: %d/%d\n", good, info.no_of_piece_hashes);
+    free(bitfield);
     torrent_close(h);
-    return 0;
+    return good == info.no_of_piece_hashes ? 0 : 2;
+  }
+
+  if (strcmp(command, "sha1_bench") == 0) {
+    unsigned long piece = strtoul(argv[2], NULL, 10);
+    int count = argc > 3 ? atoi(argv[3]) : 1024;
+    if (piece == 0 || count <= 0) {
+      fprintf(stderr, "Usage: %s sha1_bench <piece_length> [pieces]\n",
+              argv[0]);
+      return 1;
+    }
+
+    unsigned char *data = malloc(piece * count);
+    const unsigned char **pieces = malloc(count * sizeof(*pieces));
+    uint8_t(*expected)[SHA_DIGEST_LENGTH] = malloc(count * SHA_DIGEST_LENGTH);
+    uint8_t(*hashes)[SHA_DIGEST_LENGTH] = malloc(count * SHA_DIGEST_LENGTH);
+    assert(data && pieces && expected && hashes);
+    unsigned int seed = 1;
+    for (unsigned long i = 0; i < piece * count; i++) {
+      data[i] = rand_r(&seed);
+    }
+    for (int i = 0; i < count; i++) {
+      pieces[i] = data + piece * i;
+      SHA1(pieces[i], piece, expected[i]);
+    }
+
+    const char *names[] = {"auto", "openssl", "sha-ni", "avx2"};
+    int result = 0;
+    for (int k = 0; k <= TORRENT_SHA1_AVX2; k++) {
+      if (!torrent_sha1_supported(k)) {
+        printf("%-8s not supported\n", names[k]);
+        continue;
+      }
+
+      // every length up to a few blocks checks the padding as well.
+      int exact = 1;
+      for (unsigned long length = 0; length < 300 && length <= piece;
+           length++) {
+        uint8_t hash[SHA_DIGEST_LENGTH], want[SHA_DIGEST_LENGTH];
+        torrent_sha1_many(k, pieces, 1, length, &hash);
+        SHA1(pieces[0], length, want);
+        exact = exact && memcmp(hash, want, SHA_DIGEST_LENGTH) == 0;
+      }
+
+      struct timespec begin, end;
+      clock_gettime(CLOCK_MONOTONIC, &begin);
+      torrent_sha1_many(k, pieces, count, piece, hashes);
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      double s = (end.tv_sec - begin.tv_sec) +
+                 (end.tv_nsec - begin.tv_nsec) / 1e9;
+      exact = exact &&
+              memcmp(hashes, expected, count * SHA_DIGEST_LENGTH) == 0;
+
+      printf("%-8s %6.2f GB/s%s\n", names[k], piece * count / s / 1e9,
+             exact ? "" : "  MISMATCH");
+      if (!exact) {
+        result = 1;
+      }
+    }
+
+    free(data);
+    free(pieces);
+    free(expected);
+    free(hashes);
+    return result;
+  }
+
+  if (strcmp(command, "decode_bench") == 0) {
+    int pieces = atoi(argv[2]);
+    int files = argc > 3 ? atoi(argv[3]) : 0;
+    int rounds = argc > 4 ? atoi(argv[4]) : 10;
+    if (pieces <= 0 || files < 0 || rounds <= 0) {
+      fprintf(stderr,
+              "Usage: %s decode_bench <pieces> [files] [rounds] [output]\n",
+              argv[0]);
+      return 1;
+    }
+
+    // a metainfo file of the given shape, written with the writer.
+    bencode_writer w;
+    bencode_writer_init(&w, NULL, NULL);
+    bencode_write_dict(&w);
+    bencode_write_string(&w, "announce", 8);
+    bencode_write_string(&w, "http://localhost/announce", 25);
+    bencode_write_string(&w, "info", 4);
+    bencode_write_dict(&w);
+    if (files > 0) {
+      bencode_write_string(&w, "files", 5);
+      bencode_write_list(&w);
+      for (int i = 0; i < files; i++) {
+        char name[32];
+        int n = snprintf(name, sizeof(name), "file%d.bin", i);
+        bencode_write_dict(&w);
+        bencode_write_string(&w, "length", 6);
+        bencode_write_int(&w, 1000 + i);
+        bencode_write_string(&w, "path", 4);
+        bencode_write_list(&w);
+        bencode_write_string(&w, "data", 4);
+        bencode_write_string(&w, name, n);
+        bencode_write_end(&w);
+        bencode_write_end(&w);
+      }
+      bencode_write_end(&w);
+    } else {
+      bencode_write_string(&w, "length", 6);
+      bencode_write_int(&w, (long)pieces << 18);
+    }
+    bencode_write_string(&w, "name", 4);
+    bencode_write_string(&w, "bench", 5);
+    bencode_write_string(&w, "piece length", 12);
+    bencode_write_int(&w, 1 << 18);
+    bencode_write_string(&w, "pieces", 6);
+    char *hashes = malloc(pieces * SHA_DIGEST_LENGTH);
+    assert(hashes);
+    unsigned int seed = 1;
+    for (int i = 0; i < pieces * SHA_DIGEST_LENGTH; i++) {
+      hashes[i] = rand_r(&seed);
+    }
+    bencode_write_string(&w, hashes, pieces * SHA_DIGEST_LENGTH);
+    free(hashes);
+    bencode_write_end(&w);
+    bencode_write_end(&w);
+
+    // output keeps the generated file, so other builds can be timed on the
+    // same input; tests/decode_reference.c times the old decoder on it.
+    if (argc > 5) {
+      int fd = open(argv[5], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0 || write(fd, w.data, w.length) != (ssize_t)w.length) {
+        perror(argv[5]);
+        bencode_writer_free(&w);
+        return 1;
+      }
+      close(fd);
+    }
+
+    const char *names[] = {"copy", "view", "arena"};
+    bencode_arena *arena = bencode_arena_create(0);
+    int result = 0;
+    for (int mode = 0; mode < 3; mode++) {
+      struct timespec begin, end;
+      clock_gettime(CLOCK_MONOTONIC, &begin);
+      for (int i = 0; i < rounds; i++) {
+        bencode *b = NULL;
+        if (mode == 2) {
+          b = decode_bencode_arena(arena, w.data, w.length, 0);
+        } else {
+          b = decode_bencode_n(w.data, w.length, mode ? BENCODE_F_VIEW : 0);
+        }
+        if (b == NULL) {
+          fprintf(stderr, "%s: invalid bencode\n", names[mode]);
+          result = 1;
+          break;
+        }
+        if (mode == 2) {
+          bencode_arena_reset(arena);
+        } else {
+          bencode_free(b);
+        }
+      }
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      double ms = (end.tv_sec - begin.tv_sec) * 1e3 +
+                  (end.tv_nsec - begin.tv_nsec) / 1e6;
+      printf("%-6s %9.3f ms per decode of %lu bytes\n", names[mode],
+             ms / rounds, w.length);
+    }
+
+    bencode_arena_free(arena);
+    bencode_writer_free(&w);
+    return result;
   }
 
   fprintf(stderr, "Unknown command: %s\n", command);
@@ -4,12 +4,18 @@
 #include <arpa/inet.h>
 #include <assert.h>
 #include <curl/curl.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -33,115 +39,403 @@ int url_encode(char *output, int output_size,
   return SHA_DIGEST_LENGTH * 3;
 }
 
+// torrent_read_path joins the components of a file path list with '/'.
+// Components that could escape the download directory are rejected.
+static char *torrent_read_path(bencode_cursor *c) {
+  if (bencode_cursor_enter(c) == -1) {
+    return NULL;
+  }
+
+  char *path = NULL;
+  size_t path_size = 0;
+  int more;
+  while ((more = bencode_cursor_next(c)) == 1) {
+    const char *part;
+    size_t part_size;
+    if (bencode_cursor_string(c, &part, &part_size) == -1 ||
+        part_size == 0 || memchr(part, '/', part_size) != NULL ||
+        memchr(part, '\0', part_size) != NULL ||
+        (part_size == 1 && part[0] == '.') ||
+        (part_size == 2 && memcmp(part, "..", 2) == 0)) {
+      free(path);
+      return NULL;
+    }
+
+    path = realloc(path, path_size + part_size + 2);
+    assert(path);
+    if (path_size > 0) {
+      path[path_size++] = '/';
+    }
+    memcpy(path + path_size, part, part_size);
+    path_size += part_size;
+    path[path_size] = '\0';
+  }
+
+  if (more == -1 || path == NULL) {
+    free(path);
+    return NULL;
+  }
+  return path;
+}
+
+// torrent_read_files reads the files list of a multi-file info dict.
+static int torrent_read_files(bencode_cursor *c, THandle handle) {
+  if (bencode_cursor_enter(c) == -1) {
+    return -1;
+  }
+
+  int capacity = 0;
+  int more;
+  while ((more = bencode_cursor_next(c)) == 1) {
+    if (handle->info.no_of_files == capacity) {
+      capacity = capacity ? capacity * 2 : 16;
+      handle->files = realloc(handle->files, capacity * sizeof(TFile));
+      assert(handle->files);
+    }
+
+    TFile *file = &handle->files[handle->info.no_of_files];
+    long int length = -1;
+    char *path = NULL;
+
+    if (bencode_cursor_enter(c) == -1) {
+      return -1;
+    }
+
+    const char *key;
+    size_t key_size;
+    while ((more = bencode_cursor_next_key(c, &key, &key_size)) == 1) {
+      int err = 0;
+      if (key_size == 6 && memcmp(key, "length", 6) == 0) {
+        err = bencode_cursor_int(c, &length);
+      } else if (key_size == 4 && memcmp(key, "path", 4) == 0 &&
+                 path == NULL) {
+        path = torrent_read_path(c);
+        err = path == NULL ? -1 : 0;
+      } else {
+        err = bencode_cursor_skip(c, NULL, NULL);
+      }
+      if (err == -1) {
+        more = -1;
+        break;
+      }
+    }
+
+    if (more == -1 || length < 0 || path == NULL) {
+      free(path);
+      return -1;
+    }
+
+    file->path = path;
+    file->length = length;
+    handle->info.no_of_files++;
+  }
+
+  return more == -1 || handle->info.no_of_files == 0 ? -1 : 0;
+}
+
+// torrent_read_info walks the info dict at the cursor and fills in the
+// lengths, piece hashes and files.
+static int torrent_read_info(bencode_cursor *c, THandle handle) {
+  TInfo *result = &handle->info;
+  const char *pieces = NULL;
+  size_t pieces_size = 0;
+  const char *name = NULL;
+  size_t name_size = 0;
+  long int length = -1;
+  long int piece_length = -1;
+  int found_files = 0;
+
+  if (bencode_cursor_enter(c) == -1) {
+    return -1;
+  }
+
+  const char *key;
+  size_t key_size;
+  int more;
+  while ((more = bencode_cursor_next_key(c, &key, &key_size)) == 1) {
+    int err = 0;
+    if (key_size == 6 && memcmp(key, "length", 6) == 0) {
+      err = bencode_cursor_int(c, &length);
+    } else if (key_size == 5 && memcmp(key, "files", 5) == 0 &&
+               !found_files) {
+      err = torrent_read_files(c, handle);
+      found_files = 1;
+      handle->multi_file = 1;
+    } else if (key_size == 4 && memcmp(key, "name", 4) == 0) {
+      err = bencode_cursor_string(c, &name, &name_size);
+    } else if (key_size == 12 && memcmp(key, "piece length", 12) == 0) {
+      err = bencode_cursor_int(c, &piece_length);
+    } else if (key_size == 6 && memcmp(key, "pieces", 6) == 0) {
+      err = bencode_cursor_string(c, &pieces, &pieces_size);
+    } else {
+      err = bencode_cursor_skip(c, NULL, NULL);
+    }
+    if (err == -1) {
+      return -1;
+    }
+  }
+
+  // exactly one of length (single file) and files (multi-file) is allowed.
+  if (more == -1 || (length < 0) == !found_files || piece_length <= 0 ||
+      pieces == NULL || pieces_size % SHA_DIGEST_LENGTH != 0 ||
+      name == NULL || name_size == 0 ||
+      name_size > SMALL_BUFFER_SIZE - 1 ||
+      memchr(name, '\0', name_size) != NULL) {
+    return -1;
+  }
+
+  memcpy(result->name, name, name_size);
+  result->name[name_size] = '\0';
+
+  if (!found_files) {
+    handle->files = malloc(sizeof(TFile));
+    assert(handle->files);
+    handle->files[0].path = strdup(result->name);
+    assert(handle->files[0].path);
+    handle->files[0].length = length;
+    result->no_of_files = 1;
+  }
+
+  unsigned long offset = 0;
+  for (int i = 0; i < result->no_of_files; i++) {
+    if (handle->files[i].length > ULONG_MAX - offset) {
+      return -1;
+    }
+    handle->files[i].offset = offset;
+    offset += handle->files[i].length;
+  }
+
+  // one hash per piece, only the last piece may be short. A wrong count
+  // would put the last piece's end somewhere other than the data's end.
+  unsigned long count = offset / piece_length + (offset % piece_length != 0);
+  if (count > INT_MAX || pieces_size / SHA_DIGEST_LENGTH != count) {
+    return -1;
+  }
+
+  result->length = offset;
+  result->piece_length = piece_length;
+  result->no_of_piece_hashes = pieces_size / SHA_DIGEST_LENGTH;
+  // the hash table is used in place, straight out of the mapped file.
+  result->pieces = (const unsigned char(*)[SHA_DIGEST_LENGTH])pieces;
+  result->files = handle->files;
+  return 0;
+}
+
+// torrent_build_extents records the non-empty files in the order they
+// appear in the torrent data, the map torrent_map_extents searches.
+static void torrent_build_extents(THandle handle) {
+  const TInfo *info = &handle->info;
+  handle->extents = malloc(info->no_of_files * sizeof(torrent_extent));
+  assert(handle->extents);
+
+  for (int i = 0; i < info->no_of_files; i++) {
+    if (info->files[i].length == 0) {
+      continue;
+    }
+    torrent_extent *e = &handle->extents[handle->no_of_extents++];
+    e->offset = info->files[i].offset;
+    e->length = info->files[i].length;
+    e->file = i;
+  }
+}
+
+// torrent_parse parses the metainfo of an opened torrent into handle->info.
+static int torrent_parse(THandle handle) {
+  TInfo *result = &handle->info;
+  bencode_cursor c;
+  bencode_cursor_init(&c, handle->torrent_file, handle->torrent_file_size);
+
+  int found_info = 0;
+  int found_announce = 0;
+
+  int more = bencode_cursor_enter(&c);
+  const char *key;
+  size_t key_size;
+  while (more != -1 &&
+         (more = bencode_cursor_next_key(&c, &key, &key_size)) == 1) {
+    if (key_size == 8 && memcmp(key, "announce", 8) == 0) {
+      const char *tracker;
+      size_t tracker_size;
+      if (bencode_cursor_string(&c, &tracker, &tracker_size) == -1) {
+        break;
+      }
+      if (tracker_size > SMALL_BUFFER_SIZE - 1) {
+        tracker_size = SMALL_BUFFER_SIZE - 1;
+      }
+      memcpy(result->tracker, tracker, tracker_size);
+      result->tracker[tracker_size] = '\0';
+      found_announce = 1;
+    } else if (key_size == 4 && memcmp(key, "info", 4) == 0 && !found_info) {
+      // the info hash covers the info dict exactly as it appears in the
+      // file, so remember where it starts and hash the span once read.
+      const char *info_raw = c.cur;
+      if (torrent_read_info(&c, handle) == -1) {
+        more = -1;
+        break;
+      }
+      torrent_sha1((const unsigned char *)info_raw, c.cur - info_raw,
+                   result->info_hash);
+      found_info = 1;
+    } else if (bencode_cursor_skip(&c, NULL, NULL) == -1) {
+      more = -1;
+    }
+  }
+
+  if (more == -1 || !found_info || !found_announce) {
+    fprintf(stderr, "invalid torrent file\n");
+    return -1;
+  }
+
+  torrent_build_extents(handle);
+  return 0;
+}
+
 THandle torrent_open(const char *torrent_file_path) {
-  FILE *file = fopen(torrent_file_path, "r");
-  if (!file) {
+  int fd = open(torrent_file_path, O_RDONLY);
+  if (fd < 0) {
     fprintf(stderr, "Failed to open the file.\n");
     return NULL;
   }
 
-  fseek(file, 0, SEEK_END);
-  long file_size = ftell(file);
-  fseek(file, 0, SEEK_SET);
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size == 0) {
+    fprintf(stderr, "Failed to read file.\n");
+    close(fd);
+    return NULL;
+  }
+
+  // the metainfo is mapped rather than read, parsed values (the piece hash
+  // table in particular) point straight into the mapping.
+  void *file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (file == MAP_FAILED) {
+    perror("mmap");
+    return NULL;
+  }
+
   THandle torrent = (THandle)malloc(sizeof(*torrent));
   assert(torrent);
   memset(torrent, 0, sizeof(*torrent));
 
-  torrent->torrent_file = malloc(file_size);
-  assert(torrent->torrent_file);
+  torrent->torrent_file = file;
+  torrent->torrent_file_size = st.st_size;
+  torrent->queue_depth = REQUEST_QUEUE_DEPTH;
+  torrent->endgame = 1;
+  torrent->piece_buffers = PIECE_BUFFERS;
 
-  size_t bytes_read = fread(torrent->torrent_file, 1, file_size, file);
-  if (bytes_read != file_size) {
-    fprintf(stderr, "Failed to read file.\n");
-    free(torrent->torrent_file);
-    free(torrent);
-    fclose(file);
+  if (torrent_parse(torrent) == -1) {
+    torrent_close(torrent);
     return NULL;
   }
 
-  fclose(file);
   return torrent;
-};
+}
 
 void torrent_close(THandle handle) {
-  if (handle->socketfd > 0) {
-    close(handle->socketfd);
+  if (handle->peer.fd > 0) {
+    close(handle->peer.fd);
   }
-  free(handle->torrent_file);
+  free(handle->peer.bitfield);
+  wire_reader_free(&handle->peer.in);
+  free(handle->received);
+  piece_hash_free(&handle->hash);
+  for (int i = 0; handle->fds != NULL && i < handle->info.no_of_files; i++) {
+    if (handle->fds[i] >= 0) {
+      close(handle->fds[i]);
+    }
+  }
+  for (int i = 0; i < handle->info.no_of_files; i++) {
+    free((void *)handle->files[i].path);
+  }
+  free(handle->fds);
+  free(handle->files);
+  free(handle->extents);
+  munmap((void *)handle->torrent_file, handle->torrent_file_size);
   free(handle);
 }
 
-int torrent_get_info(THandle handle, TInfo *result) {
-  bencode *root = decode_bencode(handle->torrent_file);
-  assert(root != NULL);
-  bencode *annouce = bencode_key(root, "announce");
-  assert(annouce != NULL);
-  bencode *info = bencode_key(root, "info");
-  assert(info != NULL);
-  bencode *length = bencode_key(info, "length");
-  assert(length != NULL);
-
-  bencode_to_string(annouce, result->tracker, SMALL_BUFFER_SIZE);
-
-  char buffer[SMALL_BUFFER_SIZE] = {0};
-  bencode_to_string(length, buffer, SMALL_BUFFER_SIZE);
-  result->length = atol(buffer);
-
-  memset(buffer, 0, SMALL_BUFFER_SIZE);
-  int n = bencode_print(info, buffer, SMALL_BUFFER_SIZE);
+unsigned long torrent_piece_length(const TInfo *info, int index) {
+  unsigned long remainder = info->length % info->piece_length;
+  if (remainder > 0 && index == info->no_of_piece_hashes - 1) {
+    return remainder;
+  }
+  return info->piece_length;
+}
 
-  unsigned char hash[SHA_DIGEST_LENGTH];
-  SHA1((const unsigned char *)buffer, n, hash);
-  memcpy(result->info_hash, hash, SHA_DIGEST_LENGTH);
+int torrent_get_info(THandle handle, TInfo *result) {
+  *result = handle->info;
+  return 0;
+}
 
-  bencode *piece_length = bencode_key(info, "piece length");
-  assert(piece_length != NULL);
-  memset(buffer, 0, SMALL_BUFFER_SIZE);
-  bencode_to_string(piece_length, buffer, SMALL_BUFFER_SIZE);
-  result->piece_length = atol(buffer);
+static int tracker_event(void *userdata, const bencode_event *event) {
+  tracker_response *response = userdata;
 
-  bencode *pieces = bencode_key(info, "pieces");
-  assert(pieces != NULL);
+  // only the top level fields of the response dict are interesting.
+  if (event->depth != 1 || event->type != BENCODE_EV_STRING) {
+    return 0;
+  }
 
-  char b_pieces[LARGE_BUFFER_SIZE] = {0};
-  n = bencode_to_string(pieces, b_pieces, LARGE_BUFFER_SIZE);
-  for (int i = 0; i * SHA_DIGEST_LENGTH < n; i++) {
-    result->no_of_piece_hashes = i + 1;
-    int size = result->no_of_piece_hashes * sizeof(*result->pieces);
-    result->pieces = realloc(result->pieces, size);
-    memcpy(result->pieces[i], &b_pieces[i * SHA_DIGEST_LENGTH],
-           SHA_DIGEST_LENGTH);
+  if (event->is_key) {
+    response->field = TRACKER_FIELD_NONE;
+    if (event->length == 5 && memcmp(event->data, "peers", 5) == 0) {
+      response->field = TRACKER_FIELD_PEERS;
+    } else if (event->length == 14 &&
+               memcmp(event->data, "failure reason", 14) == 0) {
+      response->field = TRACKER_FIELD_FAILURE;
+    }
+    return 0;
   }
 
-  bencode_free(root);
+  if (response->field == TRACKER_FIELD_PEERS) {
+    if (event->offset == 0) {
+      response->has_peers = 1;
+      response->peers_size = 0;
+      // an empty string is reported once, with nothing to copy.
+      if (event->total == 0) {
+        return 0;
+      }
+      response->peers = realloc(response->peers, event->total);
+      assert(response->peers);
+    }
+    memcpy(response->peers + event->offset, event->data, event->length);
+    response->peers_size += event->length;
+  } else if (response->field == TRACKER_FIELD_FAILURE) {
+    size_t n = event->length;
+    if (event->offset + n >= sizeof(response->failure)) {
+      n = event->offset < sizeof(response->failure) - 1
+              ? sizeof(response->failure) - 1 - event->offset
+              : 0;
+    }
+    memcpy(response->failure + event->offset, event->data, n);
+  }
 
   return 0;
 }
 
 size_t get_peers_callback(char *ptr, size_t size, size_t nmemb,
                           void *userdata) {
+  tracker_response *response = userdata;
   size_t total_size = size * nmemb;
-  memcpy(userdata, ptr, total_size);
+  if (bencode_stream_feed(response->stream, ptr, total_size) == -1) {
+    // a short count makes curl abort the transfer.
+    return 0;
+  }
   return total_size;
 }
 
 int torrent_get_peers(THandle handle, TPeers *result) {
-  TInfo t = {0};
-  if (torrent_get_info(handle, &t) == -1) {
-    return -1;
-  }
-  free(t.pieces);
+  TInfo *t = &handle->info;
 
   char info_hash[SMALL_BUFFER_SIZE] = {0};
-  url_encode(info_hash, SMALL_BUFFER_SIZE, t.info_hash);
+  url_encode(info_hash, SMALL_BUFFER_SIZE, t->info_hash);
 
   char url[LARGE_BUFFER_SIZE] = {0};
   snprintf(url, LARGE_BUFFER_SIZE,
            "%s?info_hash=%s&peer_id=00112233445566778899&port=6881&uploaded="
            "0&downloaded=0&left=%lu&compact=1",
-           t.tracker, info_hash, t.length);
+           t->tracker, info_hash, t->length);
 
-  char response[LARGE_BUFFER_SIZE] = {0};
+  tracker_response response = {0};
   CURL *curl;
   CURLcode res;
   curl = curl_easy_init();
@@ -152,46 +446,87 @@ int torrent_get_peers(THandle handle, TPeers *result) {
 
   curl_easy_setopt(curl, CURLOPT_URL, url);
   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, get_peers_callback);
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, response);
+  // the response is parsed as curl hands it over, chunk by chunk.
+  response.stream = bencode_stream_create(tracker_event, &response);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
   curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-  // Set the buffer as the user data to be passed to the callback function
   res = curl_easy_perform(curl);
-  if (res != CURLE_OK) {
-    fprintf(stderr, "request failed: %s\n", curl_easy_strerror(res));
+  curl_easy_cleanup(curl);
+
+  int done = bencode_stream_done(response.stream);
+  bencode_stream_free(response.stream);
+
+  if (res != CURLE_OK || !done) {
+    fprintf(stderr, "request failed: %s\n",
+            res != CURLE_OK ? curl_easy_strerror(res)
+                            : "invalid tracker response");
+    free(response.peers);
     return -1;
   }
 
-  curl_easy_cleanup(curl);
+  if (response.failure[0]) {
+    fprintf(stderr, "tracker error: %s\n", response.failure);
+    free(response.peers);
+    return -1;
+  }
 
-  bencode *root = decode_bencode(response);
-  bencode *peers = bencode_key(root, "peers");
-  if (peers == NULL) {
+  if (!response.has_peers) {
     fprintf(stderr, "peers key not found in response\n");
+    free(response.peers);
     return -1;
   }
 
-  unsigned char b_peers[SMALL_BUFFER_SIZE] = {0};
-  int n = bencode_to_string(peers, (char *)b_peers, SMALL_BUFFER_SIZE);
+  int count = (response.peers_size / 6);
+  if (count == 0) {
+    free(response.peers);
+    return 0;
+  }
 
-  int count = (n / 6);
   int size = count * sizeof(*result[0]);
   *result = realloc(*result, size);
   assert(*result);
 
   for (int i = 0; i < count; i++) {
-    memcpy(&(*result)[i].ip, &b_peers[i * 6], 4);
-    memcpy(&(*result)[i].port, &b_peers[i * 6 + 4], 2);
+    memcpy(&(*result)[i].ip, &response.peers[i * 6], 4);
+    memcpy(&(*result)[i].port, &response.peers[i * 6 + 4], 2);
   }
 
-  bencode_free(root);
+  free(response.peers);
 
   return count;
 }
 
+// peer_fill reads more bytes into the receive ring, it fails on errors and
+// EOF.
+static int peer_fill(torrent_peer *peer) {
+  for (;;) {
+    ssize_t n = wire_reader_fill(&peer->in, peer->fd);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    return n > 0 ? 0 : -1;
+  }
+}
+
+// peer_recv_message waits for the next message from the peer and returns
+// like wire_reader_next. Every message that arrived with the same read is
+// served from the ring.
+static int peer_recv_message(torrent_peer *peer, wire_message *m) {
+  for (;;) {
+    int n = wire_reader_next(&peer->in, m);
+    if (n != 0) {
+      return n;
+    }
+    if (peer_fill(peer) == -1) {
+      return -1;
+    }
+  }
+}
+
 int torrent_do_handshake(THandle handle, TPeer peer,
                          uint8_t info_hash[SHA_DIGEST_LENGTH],
                          uint8_t (*peer_id)[20]) {
-  if (handle->socketfd > 0) {
+  if (handle->peer.fd > 0) {
     fprintf(stderr, "handshake already done\n");
     return -1;
   }
@@ -213,6 +548,11 @@ int torrent_do_handshake(THandle handle, TPeer peer,
     return -1;
   }
 
+  // requests are small and pipelined, Nagle would hold them back waiting
+  // for acks of the previous ones.
+  int nodelay = 1;
+  setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
   struct __attribute__((packed)) {
     uint8_t size;
     uint8_t message[19];
@@ -229,167 +569,241 @@ int torrent_do_handshake(THandle handle, TPeer peer,
   int n = send(sockfd, &handshake, sizeof(handshake), 0);
   assert(n == sizeof(handshake));
 
-  n = recv(sockfd, &ack, sizeof(ack), 0);
-  if (n == -1) {
-    fprintf(stderr, "error reading peer handshake");
-    return -1;
+  // the bitfield often arrives with the handshake, the ring keeps it.
+  handle->peer.fd = sockfd;
+  wire_reader_init(&handle->peer.in, torrent_max_message(&handle->info));
+  while (wire_reader_read(&handle->peer.in, &ack, sizeof(ack)) == -1) {
+    if (peer_fill(&handle->peer) == -1) {
+      fprintf(stderr, "error reading peer handshake\n");
+      return -1;
+    }
   }
-  assert(n == sizeof(ack));
+  // block bodies are read straight into their place from now on.
+  wire_reader_split(&handle->peer.in, MSG_PIECE, sizeof(piece_response));
 
   memcpy(peer_id, ack.peer_id, sizeof(*peer_id));
 
-  handle->socketfd = sockfd;
-
   return 0;
 }
 
 int torrent_declare_interest(THandle handle) {
-  unsigned char buffer[SMALL_BUFFER_SIZE] = {0};
+  torrent_peer *peer = &handle->peer;
+  wire_message m;
 
-  int n = recv(handle->socketfd, &buffer, SMALL_BUFFER_SIZE, 0);
-  if (n == -1) {
+  if (peer_recv_message(peer, &m) == -1) {
     fprintf(stderr, "error reading bit field message\n");
     return -1;
   }
-
-  peer_message *bitfield = (peer_message *)buffer;
-  if (bitfield->id != MSG_BITFIELD) {
+  if (m.id != MSG_BITFIELD) {
     fprintf(stderr, "unexpect peer message\n");
     return -1;
   }
 
+  // keep the pieces the peer has, download_piece checks against them.
+  size_t size = (handle->info.no_of_piece_hashes + 7) / 8;
+  free(peer->bitfield);
+  peer->bitfield = calloc(size + 1, 1);
+  assert(peer->bitfield);
+  memcpy(peer->bitfield, m.payload, m.size < size ? m.size : size);
+
+  unsigned char buffer[5];
   peer_message *interest = (peer_message *)buffer;
   int len = 1;
   interest->length = ltob(len);
   interest->id = MSG_INTERESTED;
-  n = send(handle->socketfd, buffer, 4 + len, 0);
+  int n = send(peer->fd, buffer, 4 + len, 0);
   assert(n == 4 + len);
 
-  memset(buffer, 0, SMALL_BUFFER_SIZE);
-  n = recv(handle->socketfd, &buffer, SMALL_BUFFER_SIZE, 0);
-  if (n == -1) {
-    fprintf(stderr, "error reading unchock message");
-    return -1;
-  }
+  // have messages may come before the unchoke.
+  do {
+    n = peer_recv_message(peer, &m);
+    if (n == -1) {
+      fprintf(stderr, "error reading unchock message\n");
+      return -1;
+    }
+    if (n == WIRE_SPLIT) {
+      // a block we never asked for.
+      wire_reader_direct(&peer->in, NULL);
+    }
+    if (m.id == MSG_HAVE && m.size == 4) {
+      uint32_t piece;
+      memcpy(&piece, m.payload, 4);
+      piece = ltob(piece);
+      if (piece < size * 8) {
+        peer->bitfield[piece / 8] |= 0x80 >> (piece % 8);
+      }
+    }
+  } while (m.id != MSG_UNCHOCK);
 
-  peer_message *unchock = (peer_message *)buffer;
-  assert(unchock->id == MSG_UNCHOCK);
+  return 0;
+}
+
+// peer_send_requests sends count block requests of piece index starting at
+// block first, as few sends as possible.
+static int peer_send_requests(int fd, int index, unsigned long piece_length,
+                              int first, int count) {
+  enum { REQUEST_SIZE = 4 + 1 + sizeof(piece_request), BATCH = 64 };
+  unsigned char buffer[BATCH * REQUEST_SIZE];
+
+  for (int i = first; i < first + count;) {
+    unsigned char *cur = buffer;
+    for (; i < first + count && cur < buffer + sizeof(buffer); i++) {
+      unsigned long begin = (unsigned long)i * BLOCK_SIZE;
+      unsigned long length = piece_length - begin;
+      if (length > BLOCK_SIZE) {
+        length = BLOCK_SIZE;
+      }
+
+      peer_message *request = (peer_message *)cur;
+      request->length = ltob(1 + sizeof(piece_request));
+      request->id = MSG_REQUEST;
+
+      piece_request piece = {
+          .index = ltob(index),
+          .begin = ltob(begin),
+          .length = ltob(length),
+      };
+      memcpy(request->payload, &piece, sizeof(piece));
+      cur += REQUEST_SIZE;
+    }
 
+    if (send(fd, buffer, cur - buffer, 0) != cur - buffer) {
+      return -1;
+    }
+  }
   return 0;
 }
 
 int torrent_download_piece(THandle handle, TPeer peer, int index,
                            unsigned char *output, unsigned long output_size) {
-  TInfo info = {0};
-  torrent_get_info(handle, &info);
+  const TInfo *info = &handle->info;
 
-  unsigned long piece_length = info.piece_length;
-  unsigned long remainder = info.length % piece_length;
-  if (remainder > 0 && index == info.no_of_piece_hashes - 1) {
-    piece_length = remainder;
+  if (index < 0 || index >= info->no_of_piece_hashes) {
+    fprintf(stderr, "piece index out of range\n");
+    return -1;
   }
 
-  if (piece_length > output_size) {
-    fprintf(stderr, "not enough space in the output buffer\n");
+  if (handle->peer.bitfield != NULL &&
+      !(handle->peer.bitfield[index / 8] & (0x80 >> (index % 8)))) {
+    fprintf(stderr, "peer does not have piece %d\n", index);
     return -1;
   }
 
-  assert(info.no_of_piece_hashes > 0);
-
-  unsigned char buffer[SMALL_BUFFER_SIZE] = {0};
-  unsigned long request_size = 1 << 14;
-  unsigned char piece_buffer[PIECE_BUFFER_SIZE] = {0};
-  signed long chunk_length = 0;
+  unsigned long piece_length = torrent_piece_length(info, index);
 
-  for (unsigned long i = 0; i < piece_length; i += request_size) {
-    memset(buffer, 0, SMALL_BUFFER_SIZE);
-    peer_message *request = (peer_message *)buffer;
-    int len = 1 + sizeof(piece_request);
-    request->length = ltob(len);
-    request->id = MSG_REQUEST;
-
-    piece_request *piece = (piece_request *)&request->payload;
-    piece->index = ltob(index);
-    piece->begin = ltob(i);
+  if (piece_length > output_size) {
+    fprintf(stderr, "not enough space in the output buffer\n");
+    return -1;
+  }
 
-    chunk_length = piece_length - i;
-    if (chunk_length > request_size) {
-      chunk_length = request_size;
+  // keep up to queue_depth requests in flight instead of waiting a round
+  // trip per block. Blocks are matched by their offset, so peers are free
+  // to answer out of order.
+  int blocks = (piece_length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  if (handle->received == NULL) {
+    // no piece has more blocks than a full one.
+    int max_blocks = (info->piece_length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    handle->received = malloc(max_blocks > 0 ? max_blocks : 1);
+    assert(handle->received);
+  }
+  char *received = handle->received;
+  memset(received, 0, blocks);
+
+  int requested = 0;
+  int completed = 0;
+
+  // the hash follows the blocks received in a row from the start, blocks
+  // out of order wait until the gap before them is filled.
+  piece_hash *hash = &handle->hash;
+  piece_hash_init(hash);
+  int hashed = 0;
+
+  while (completed < blocks) {
+    int window = handle->queue_depth - (requested - completed);
+    if (window > blocks - requested) {
+      window = blocks - requested;
+    }
+    if (window > 0) {
+      if (peer_send_requests(handle->peer.fd, index, piece_length,
+                             requested, window) == -1) {
+        perror("error sending requests");
+        return -1;
+      }
+      requested += window;
     }
-    piece->length = ltob(chunk_length);
-
-    int n = send(handle->socketfd, buffer, 4 + len, 0);
-    assert(n == 4 + len);
 
-    memset(piece_buffer, 0, PIECE_BUFFER_SIZE);
-    n = recv(handle->socketfd, piece_buffer, 4, MSG_WAITALL);
+    // block bodies are read straight into output once their header is
+    // in, other messages are framed out of the receive ring.
+    wire_message m;
+    int n = peer_recv_message(&handle->peer, &m);
     if (n == -1) {
-      perror("error reciving data\n");
+      fprintf(stderr, "error reciving data\n");
       return -1;
     }
-    len = ltob(((peer_message *)piece_buffer)->length);
-    n = recv(handle->socketfd, piece_buffer + 4, len, MSG_WAITALL);
-    if (n == -1) {
-      perror("error reciving data\n");
+
+    if (m.id == MSG_CHOKE) {
+      fprintf(stderr, "choked by peer\n");
       return -1;
     }
+    if (m.id != MSG_PIECE) {
+      // have and friends do not matter while a piece is in flight.
+      continue;
+    }
 
-    peer_message *message = (peer_message *)piece_buffer;
-    if (message->id != MSG_PIECE) {
+    piece_response response;
+    if (m.size < sizeof(response)) {
       return -1;
-    };
+    }
+    memcpy(&response, m.payload, sizeof(response));
+    unsigned long begin = ltob(response.begin);
+    unsigned long size = m.size - sizeof(response);
+    int block = begin / BLOCK_SIZE;
+
+    if (ltob(response.index) != (uint32_t)index || begin % BLOCK_SIZE != 0 ||
+        block >= requested || received[block] ||
+        size != (block == blocks - 1 ? piece_length - begin : BLOCK_SIZE)) {
+      fprintf(stderr, "unexpected block from peer\n");
+      return -1;
+    }
 
-    piece_response *response = (piece_response *)&message->payload;
-    assert(ltob(response->begin) == i);
-    assert(ltob(response->index) == index);
+    if (n == WIRE_SPLIT) {
+      // counted once the body is in.
+      wire_reader_direct(&handle->peer.in, output + begin);
+      continue;
+    }
+    if (!m.direct) {
+      memcpy(output + begin, m.payload + sizeof(response), size);
+    }
+    received[block] = 1;
+    completed++;
 
-    memcpy(output + i, &response->data, chunk_length);
+    while (hashed < blocks && received[hashed]) {
+      hashed++;
+    }
+    unsigned long end = (unsigned long)hashed * BLOCK_SIZE;
+    piece_hash_update(hash, output, end < piece_length ? end : piece_length);
   }
 
-  unsigned char recieved_data_hash[SHA_DIGEST_LENGTH];
-  SHA1((const unsigned char *)output, piece_length, recieved_data_hash);
-
-  if (memcmp(info.pieces[index], recieved_data_hash, SHA_DIGEST_LENGTH) != 0) {
+  if (!piece_hash_check(hash, output, piece_length, info->pieces[index])) {
     fprintf(stderr, "piece hash does not match\n");
     return -1;
   }
 
   return piece_length;
-};
-
-int torrent_download(THandle handle, unsigned char *output,
-                     unsigned long output_size) {
-  TInfo info = {0};
-  torrent_get_info(handle, &info);
-
-  if (info.length > output_size) {
-    fprintf(stderr, "not enough space in the output buffer\n");
-    return -1;
-  }
-
-  TPeers peers = NULL;
-  int n = torrent_get_peers(handle, &peers);
-  if (n <= 0) {
-    fprintf(stderr, "no peers to download from or an error\n");
-    return -1;
-  }
+}
 
-  uint8_t peer_id[20];
-  assert(torrent_do_handshake(handle, peers[0], info.info_hash, &peer_id) !=
-         -1);
+void torrent_set_queue_depth(THandle handle, int depth) {
+  handle->queue_depth = depth > 0 ? depth : REQUEST_QUEUE_DEPTH;
+}
 
-  assert(torrent_declare_interest(handle) != -1);
+void torrent_set_endgame(THandle handle, int enabled) {
+  handle->endgame = enabled;
+}
 
-  for (int i = 0; i < info.no_of_piece_hashes; i++) {
-    fprintf(stderr, "downloading piece %d\n", i);
-    int n = torrent_download_piece(handle, peers[0], i,
-                                   output + (i * info.piece_length),
-                                   output_size - (i * info.piece_length));
-    if (n < 0) {
-      fprintf(stderr, "error downloading piece %d\n", i);
-      return -1;
-    }
-  }
+void torrent_set_piece_buffers(THandle handle, int count) {
+  handle->piece_buffers = count > 0 ? count : PIECE_BUFFERS;
+}
 
-  return info.length;
+void torrent_set_backend(THandle handle, TBackend backend) {
+  handle->backend = backend;
 }
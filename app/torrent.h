@@ -4,27 +4,145 @@
 #define LARGE_BUFFER_SIZE 0x500
 #define SMALL_BUFFER_SIZE 0x200
 #define PIECE_BUFFER_SIZE 1 << 15
+#define REQUEST_QUEUE_DEPTH 32
+#define PIECE_BUFFERS 16
 
 #include <openssl/sha.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+typedef struct {
+  // path is relative to where the torrent is stored, components are joined
+  // by '/'. For a single file torrent it is the torrent name.
+  const char *path;
+  unsigned long length;
+  // offset is where the file starts in the concatenated torrent data.
+  unsigned long offset;
+} TFile;
 
 typedef struct {
   char tracker[SMALL_BUFFER_SIZE];
+  char name[SMALL_BUFFER_SIZE];
+  // length is the total length of all the files.
   unsigned long length;
   unsigned char info_hash[SHA_DIGEST_LENGTH];
   unsigned long piece_length;
   int no_of_piece_hashes;
-  unsigned char (*pieces)[SHA_DIGEST_LENGTH];
+  const unsigned char (*pieces)[SHA_DIGEST_LENGTH];
+  int no_of_files;
+  const TFile *files;
 } TInfo;
 
 #ifndef TORRENT_INTERNAL_H__
 typedef void *THandle;
+typedef void *TIndex;
 #endif
 
+/*
+ * torrent_open reads and parses a torrent file. The metainfo is parsed only
+ * here, everything else reads the parsed copy kept on the handle.
+ *
+ * In case of any error, it will return NULL.
+ */
 THandle torrent_open(const char *torrent_file_path);
 void torrent_close(THandle);
 
+/*
+ * torrent_get_info copies the metainfo parsed by torrent_open to result.
+ * result->pieces and result->files are shared with the handle: they must
+ * not be freed and are valid until torrent_close.
+ */
 int torrent_get_info(THandle handle, TInfo *result);
 
+typedef struct {
+  int file;
+  // offset is relative to the start of the file.
+  unsigned long offset;
+  unsigned long length;
+} TExtent;
+
+/*
+ * torrent_map_extents resolves length bytes at begin within piece to the
+ * file segments they cover, in order. Empty files never show up.
+ *
+ * It returns the number of extents written, or -1 if the range is outside
+ * the torrent or needs more than max_extents.
+ */
+int torrent_map_extents(THandle handle, int piece, unsigned long begin,
+                        unsigned long length, TExtent *extents,
+                        int max_extents);
+
+/*
+ * torrent_storage_open creates or opens the files of the torrent for
+ * reading and writing. For a single file torrent path is the file itself,
+ * otherwise it is the directory the files are created below.
+ *
+ * In case of any error, it will return -1.
+ */
+int torrent_storage_open(THandle handle, const char *path);
+
+/*
+ * torrent_storage_writev and torrent_storage_readv move the bytes at begin
+ * within piece between the files and iov, with one vectored call per file
+ * the range touches. They return the number of bytes moved or -1.
+ */
+long torrent_storage_writev(THandle handle, int piece, unsigned long begin,
+                            const struct iovec *iov, int iovcnt);
+long torrent_storage_readv(THandle handle, int piece, unsigned long begin,
+                           const struct iovec *iov, int iovcnt);
+
+/*
+ * torrent_verify checks the payload stored at path, laid out as
+ * torrent_storage_open does, against the piece hashes on worker threads
+ * (0 uses one per CPU). The files are mapped and read front to back; a
+ * missing or short file only fails the pieces it holds. The files must not
+ * shrink while it runs: reading a mapped page past the new end of a file
+ * raises SIGBUS, which is not caught.
+ *
+ * bitfield takes (no_of_piece_hashes + 7) / 8 bytes with the bit of every
+ * good piece set, in the layout of the bitfield message. Progress and
+ * throughput are reported on stderr.
+ *
+ * It returns the number of good pieces, or -1 if no worker could start.
+ */
+int torrent_verify(THandle handle, const char *path, int workers,
+                   uint8_t *bitfield);
+
+typedef struct {
+  unsigned char info_hash[SHA_DIGEST_LENGTH];
+  unsigned long length;
+  unsigned long piece_length;
+  int no_of_piece_hashes;
+  const char *path;
+  const char *tracker;
+} TIndexEntry;
+
+/*
+ * torrent_index_build opens every .torrent file below dir on a pool of
+ * worker threads (0 uses one per CPU) and indexes their metadata by info
+ * hash. Files that fail to parse are left out.
+ */
+TIndex torrent_index_build(const char *dir, int workers);
+
+/*
+ * torrent_index_save writes the index to a compact binary file that
+ * torrent_index_load reads back without touching the torrent files.
+ *
+ * In case of any error, they return -1 and NULL.
+ */
+int torrent_index_save(TIndex index, const char *path);
+TIndex torrent_index_load(const char *path);
+
+/*
+ * torrent_index_find returns the entry for info_hash or NULL if it is not
+ * in the index.
+ */
+const TIndexEntry *torrent_index_find(TIndex index,
+                                      const uint8_t info_hash[20]);
+int torrent_index_count(TIndex index);
+const TIndexEntry *torrent_index_entry(TIndex index, int i);
+void torrent_index_free(TIndex index);
+
 typedef struct {
   uint32_t ip;
   uint16_t port;
@@ -59,6 +177,45 @@ int torrent_do_handshake(THandle handle, TPeer peer,
  */
 int torrent_declare_interest(THandle handle);
 
+/*
+ * torrent_set_queue_depth sets how many block requests are pipelined to a
+ * peer at once, depth <= 0 restores the default of REQUEST_QUEUE_DEPTH.
+ */
+void torrent_set_queue_depth(THandle handle, int depth);
+
+/*
+ * torrent_set_endgame turns the endgame of torrent_download on or off. Once
+ * every missing block is requested, the endgame requests them from other
+ * peers as well and cancels the duplicates when a copy arrives. It is on by
+ * default.
+ */
+void torrent_set_endgame(THandle handle, int enabled);
+
+/*
+ * torrent_set_piece_buffers sets how many pieces torrent_download keeps in
+ * memory at once when it streams to the storage, count <= 0 restores the
+ * default of PIECE_BUFFERS.
+ */
+void torrent_set_piece_buffers(THandle handle, int count);
+
+/*
+ * TBackend is the I/O backend torrent_download drives its connections with.
+ */
+typedef enum {
+  TORRENT_BACKEND_EPOLL = 0,
+  TORRENT_BACKEND_URING,
+} TBackend;
+
+/*
+ * torrent_set_backend picks the I/O backend of torrent_download. With
+ * TORRENT_BACKEND_URING, socket reads, writes and connects are batched
+ * through an io_uring, and so are the writes of verified pieces to the
+ * storage, from registered buffers when they are downloaded into the
+ * engine's own. Where the kernel does not offer an io_uring it falls back
+ * to epoll. The default is TORRENT_BACKEND_EPOLL.
+ */
+void torrent_set_backend(THandle handle, TBackend backend);
+
 /*
  * torrent_download_piece downloads a piece in a torrent file and
  * returns the number of bytes download. It internally verifies the
@@ -73,13 +230,53 @@ int torrent_download_piece(THandle handle, TPeer peer, int index,
 
 /*
  * torrent_download downloads a torrent file and returns the number of
- * bytes download. It internally verifies the hash of the downloaded data.
+ * bytes downloaded, which is the length of the torrent. It internally
+ * verifies the hash of the downloaded data, off the network thread, and
+ * writes every verified piece to the storage if torrent_storage_open was
+ * called before.
+ *
+ * With a NULL output the storage has to be open: pieces are downloaded
+ * into a few buffers of their own and written out as they verify, so the
+ * memory used does not grow with the torrent.
  *
  * this function has to be called after a handshake and interest declaration.
  *
- * In case of any error, it will return -1.
+ * In case of any error, it will return -1. That includes the peers left
+ * giving no new block for a minute, e.g. because none of them has the
+ * pieces still missing.
+ */
+long torrent_download(THandle handle, unsigned char *output,
+                      unsigned long output_size);
+
+typedef enum {
+  TORRENT_SHA1_AUTO = 0,
+  TORRENT_SHA1_OPENSSL,
+  TORRENT_SHA1_NI,
+  TORRENT_SHA1_AVX2,
+} TSha1Kernel;
+
+/*
+ * torrent_sha1_supported tells if kernel can run on this CPU.
+ */
+int torrent_sha1_supported(TSha1Kernel kernel);
+
+/*
+ * torrent_sha1_many hashes count messages of length bytes each into out.
+ * TORRENT_SHA1_NI hashes them one after the other with the SHA extensions,
+ * TORRENT_SHA1_AVX2 eight at a time in the lanes of AVX2 registers.
+ * TORRENT_SHA1_AUTO uses whichever kernel was fastest when timed once at
+ * startup, for full batches of eight and for the messages left over.
+ * Unsupported kernels fall back to OpenSSL.
+ */
+void torrent_sha1_many(TSha1Kernel kernel, const unsigned char *const *data,
+                       int count, unsigned long length,
+                       uint8_t (*out)[SHA_DIGEST_LENGTH]);
+
+/*
+ * torrent_sha1 hashes a single message with the kernel TORRENT_SHA1_AUTO
+ * picked for messages left over from a batch.
  */
-int torrent_download(THandle handle, unsigned char *output,
-                     unsigned long output_size);
+void torrent_sha1(const unsigned char *data, unsigned long length,
+                  uint8_t out[SHA_DIGEST_LENGTH]);
 
 #endif /* TORRENT_H__ */
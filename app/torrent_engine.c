@@ -0,0 +1,1442 @@
+#include "debug.h"
+#include "torrent_internal.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ENGINE_MAX_PEERS 50
+#define ENGINE_MAX_EVENTS 64
+#define PEER_TIMEOUT 10
+// ENGINE_STALL_TIMEOUT is how long the download goes on without a new
+// block. Peers that are connected but have none of the pieces left, or
+// never unchoke us, are not waited on by PEER_TIMEOUT and would keep it
+// going forever.
+#define ENGINE_STALL_TIMEOUT 60
+// ENGINE_MAX_BAD_PIECES is how many pieces failing their hash a peer gets
+// away with. A peer serving bad data would keep taking the same pieces
+// back, and with them the piece buffers.
+#define ENGINE_MAX_BAD_PIECES 2
+#define HANDSHAKE_SIZE 68
+#define ENGINE_URING_ENTRIES 256
+// ENGINE_WAKE tags the hash pool's eventfd among the peers in epoll.
+#define ENGINE_WAKE UINT32_MAX
+#define ENGINE_MAX_HASHED 64
+
+// the operations the io_uring backend has in flight, user_data carries the
+// operation in its low byte and the peer above.
+enum engine_op {
+  OP_CONNECT = 1,
+  OP_READ = 2,
+  OP_SEND = 4,
+  OP_TICK = 8,
+  OP_CANCEL = 16,
+  OP_WAKE = 32,
+  // a storage write of the piece in place of the peer.
+  OP_WRITE = 64,
+};
+
+static uint64_t op_data(int p, enum engine_op op) {
+  return (uint64_t)p << 8 | op;
+}
+
+static long engine_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+static int peer_has(const torrent_peer *peer, int index) {
+  return peer->bitfield[index / 8] & (0x80 >> (index % 8));
+}
+
+static int peer_requested(const torrent_peer *peer, int index, int block) {
+  for (int i = 0; i < peer->in_flight; i++) {
+    if (peer->requests[i].piece == index && peer->requests[i].block == block) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static double engine_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// orphan_stale tells if an entry of the orphans was taken over or
+// finished since it was added.
+static int orphan_stale(const torrent_engine *e, int index) {
+  const torrent_piece *piece = &e->pieces[index];
+  return piece->state != PIECE_ACTIVE || piece->owner != -1;
+}
+
+// engine_orphan notes that nobody works through active piece index any
+// more, a peer without a buffer of its own can take it over. Stale entries
+// go on the way, so the orphans stay as few as the pieces in flight.
+static void engine_orphan(torrent_engine *e, int index) {
+  int n = 0;
+  for (int i = 0; i < e->no_of_orphans; i++) {
+    int orphan = e->orphans[i];
+    if (orphan != index && !orphan_stale(e, orphan)) {
+      e->orphans[n++] = orphan;
+    }
+  }
+  e->orphans[n++] = index;
+  e->no_of_orphans = n;
+}
+
+// engine_interest adds delta to the wanted count of every peer that has
+// piece index, as it joins or leaves the candidates.
+static void engine_interest(torrent_engine *e, int index, int delta) {
+  for (int p = 0; p < e->no_of_peers; p++) {
+    if (peer_has(&e->peers[p], index)) {
+      e->peers[p].wanted += delta;
+    }
+  }
+}
+
+// engine_take and engine_put are picker_take and picker_put keeping the
+// wanted counts in step.
+static void engine_take(torrent_engine *e, int index) {
+  if (picker_candidate(&e->picker, index)) {
+    picker_take(&e->picker, index);
+    engine_interest(e, index, -1);
+  }
+}
+
+static void engine_put(torrent_engine *e, int index) {
+  if (!picker_candidate(&e->picker, index)) {
+    picker_put(&e->picker, index);
+    engine_interest(e, index, 1);
+  }
+}
+
+// engine_deactivate takes piece index off the active pieces once it is
+// complete or thrown away.
+static void engine_deactivate(torrent_engine *e, int index) {
+  for (int i = 0; i < e->no_of_active; i++) {
+    if (e->active[i] == index) {
+      e->active[i] = e->active[--e->no_of_active];
+      return;
+    }
+  }
+}
+
+// engine_unrequest drops one request of block r. A block nobody else
+// requested goes back to the blocks still to be requested.
+static void engine_unrequest(torrent_engine *e, block_request r) {
+  torrent_piece *piece = &e->pieces[r.piece];
+  if (piece->state != PIECE_ACTIVE || piece->block[r.block] == BLOCK_RECEIVED) {
+    return;
+  }
+  if (--piece->block[r.block] == 0) {
+    e->pending++;
+    if (r.block < piece->next) {
+      piece->next = r.block;
+    }
+    // unless its owner is still working through the piece, someone else
+    // has to pick the block up.
+    if (piece->owner == -1 || e->peers[piece->owner].piece != r.piece) {
+      piece->owner = -1;
+      engine_orphan(e, r.piece);
+      engine_put(e, r.piece);
+      e->refill = 1;
+    }
+  }
+}
+
+// peer_forget drops request i of a peer.
+static void peer_forget(torrent_engine *e, int p, int i) {
+  torrent_peer *peer = &e->peers[p];
+  block_request r = peer->requests[i];
+  peer->requests[i] = peer->requests[--peer->in_flight];
+  engine_unrequest(e, r);
+}
+
+// engine_release forgets the requests of a peer and gives the pieces it
+// was working through back to the picker. Blocks that arrived are kept.
+static void engine_release(torrent_engine *e, int p) {
+  torrent_peer *peer = &e->peers[p];
+  while (peer->in_flight > 0) {
+    peer_forget(e, p, 0);
+  }
+
+  for (int i = 0; i < e->no_of_active; i++) {
+    int index = e->active[i];
+    if (e->pieces[index].owner == p) {
+      e->pieces[index].owner = -1;
+      engine_orphan(e, index);
+      engine_put(e, index);
+    }
+  }
+
+  peer->piece = -1;
+  e->refill = 1;
+}
+
+static void peer_close(torrent_engine *e, int p) {
+  torrent_peer *peer = &e->peers[p];
+  if (peer->state == PEER_CLOSED) {
+    return;
+  }
+
+  // a read in flight on the ring may still land a block in its piece
+  // until the read completed. The block stays requested until then, so
+  // nobody else receives it there and the piece keeps its buffer.
+  int reading = 0;
+  if (e->ring != NULL && (peer->ops & OP_READ) && peer->arriving.piece != -1) {
+    int i = peer_requested(peer, peer->arriving.piece, peer->arriving.block);
+    if (i != -1) {
+      peer->requests[i] = peer->requests[--peer->in_flight];
+      reading = 1;
+    }
+  }
+  engine_release(e, p);
+
+  // whatever the peer had is no longer available.
+  int bytes = (e->handle->info.no_of_piece_hashes + 7) / 8;
+  for (int i = 0; i < bytes; i++) {
+    for (int bit = 0; peer->bitfield[i] != 0 && bit < 8; bit++) {
+      if (peer->bitfield[i] & (0x80 >> bit)) {
+        picker_remove(&e->picker, i * 8 + bit);
+      }
+    }
+  }
+  memset(peer->bitfield, 0, bytes);
+  peer->wanted = 0;
+
+  // operations in flight still point into the peer's buffers, they are
+  // cancelled and the buffers kept until the last one completed.
+  for (int op = OP_CONNECT; e->ring != NULL && op <= OP_SEND; op <<= 1) {
+    if (peer->ops & op) {
+      uring_cancel(e->ring, op_data(p, op), 0, op_data(p, OP_CANCEL));
+    }
+  }
+
+  close(peer->fd);
+  peer->fd = -1;
+  if (!reading) {
+    peer->arriving.piece = -1;
+  }
+  peer->state = PEER_CLOSED;
+  e->live_peers--;
+}
+
+static void peer_watch(torrent_engine *e, int p, uint32_t events) {
+  if (e->peers[p].events == events) {
+    return;
+  }
+  struct epoll_event ev = {.events = events, .data.u32 = p};
+  epoll_ctl(e->epfd, EPOLL_CTL_MOD, e->peers[p].fd, &ev);
+  e->peers[p].events = events;
+}
+
+// peer_queue appends data to the bytes waiting to be sent to a peer.
+static void peer_queue(torrent_peer *peer, const void *data, size_t size) {
+  if (peer->out_length + size > peer->out_capacity) {
+    size_t capacity = peer->out_capacity ? peer->out_capacity : 1 << 10;
+    while (capacity < peer->out_length + size) {
+      capacity *= 2;
+    }
+    peer->out = realloc(peer->out, capacity);
+    assert(peer->out);
+    peer->out_capacity = capacity;
+  }
+
+  memcpy(peer->out + peer->out_length, data, size);
+  peer->out_length += size;
+}
+
+// uring_flush sends what is queued for a peer through the ring. While a
+// send is in flight its bytes sit in sending and new ones queue up in out.
+static int uring_flush(torrent_engine *e, int p) {
+  torrent_peer *peer = &e->peers[p];
+  if ((peer->ops & OP_SEND) ||
+      (peer->sending_length == 0 && peer->out_length == 0)) {
+    return 0;
+  }
+
+  if (peer->sending_length == 0) {
+    unsigned char *out = peer->out;
+    size_t capacity = peer->out_capacity;
+    peer->out = peer->sending;
+    peer->out_capacity = peer->sending_capacity;
+    peer->sending = out;
+    peer->sending_capacity = capacity;
+    peer->sending_length = peer->out_length;
+    peer->out_length = 0;
+    peer->sent = 0;
+  }
+
+  if (uring_send(e->ring, peer->fd, peer->sending + peer->sent,
+                 peer->sending_length - peer->sent,
+                 op_data(p, OP_SEND)) == -1) {
+    return -1;
+  }
+  peer->ops |= OP_SEND;
+  return 0;
+}
+
+static int peer_flush(torrent_engine *e, int p) {
+  torrent_peer *peer = &e->peers[p];
+  if (e->ring != NULL) {
+    return uring_flush(e, p);
+  }
+
+  size_t sent = 0;
+  while (sent < peer->out_length) {
+    ssize_t n = send(peer->fd, peer->out + sent, peer->out_length - sent,
+                     MSG_NOSIGNAL);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1 && errno == EAGAIN) {
+      break;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    sent += n;
+  }
+
+  memmove(peer->out, peer->out + sent, peer->out_length - sent);
+  peer->out_length -= sent;
+  // only ask for writability while something is left over.
+  peer_watch(e, p, peer->out_length > 0 ? EPOLLIN | EPOLLOUT : EPOLLIN);
+  return 0;
+}
+
+static void peer_queue_message(torrent_peer *peer, uint8_t id,
+                               const void *payload, uint32_t size) {
+  uint32_t length = ltob(1 + size);
+  peer_queue(peer, &length, 4);
+  peer_queue(peer, &id, 1);
+  if (size > 0) {
+    peer_queue(peer, payload, size);
+  }
+}
+
+static unsigned long block_length(const TInfo *info, int index, int block) {
+  unsigned long begin = (unsigned long)block * BLOCK_SIZE;
+  unsigned long length = torrent_piece_length(info, index) - begin;
+  return length > BLOCK_SIZE ? BLOCK_SIZE : length;
+}
+
+static void peer_request(torrent_engine *e, int p, int index, int block) {
+  torrent_peer *peer = &e->peers[p];
+  piece_request request = {
+      .index = ltob(index),
+      .begin = ltob(block * BLOCK_SIZE),
+      .length = ltob(block_length(&e->handle->info, index, block)),
+  };
+  peer_queue_message(peer, MSG_REQUEST, &request, sizeof(request));
+  // a peer that sat idle is waited on from its first request on.
+  if (peer->in_flight == 0) {
+    peer->last_active = engine_now();
+  }
+  peer->requests[peer->in_flight++] = (block_request){index, block};
+
+  if (e->pieces[index].block[block]++ == 0 && --e->pending == 0 &&
+      e->tail == 0) {
+    e->tail = engine_clock();
+    // idle peers can start duplicating requests now.
+    e->refill = 1;
+  }
+}
+
+// piece_next_block returns a block of the peer's piece that nobody
+// requested yet, or -1.
+static int piece_next_block(torrent_engine *e, int p) {
+  int index = e->peers[p].piece;
+  if (index < 0) {
+    return -1;
+  }
+
+  torrent_piece *piece = &e->pieces[index];
+  if (piece->state != PIECE_ACTIVE || piece->owner != p) {
+    return -1;
+  }
+  for (; piece->next < piece->blocks; piece->next++) {
+    if (piece->block[piece->next] == 0) {
+      return piece->next++;
+    }
+  }
+  return -1;
+}
+
+// peer_fill_endgame requests blocks that are already in flight elsewhere,
+// whichever copy arrives first wins.
+static void peer_fill_endgame(torrent_engine *e, int p) {
+  torrent_peer *peer = &e->peers[p];
+  int depth = e->handle->queue_depth;
+
+  for (int a = 0; a < e->no_of_active && peer->in_flight < depth; a++) {
+    int i = e->active[a];
+    torrent_piece *piece = &e->pieces[i];
+    if (!peer_has(peer, i)) {
+      continue;
+    }
+    for (int b = 0; b < piece->blocks && peer->in_flight < depth; b++) {
+      if (piece->block[b] != BLOCK_RECEIVED &&
+          peer_requested(peer, i, b) == -1) {
+        peer_request(e, p, i, b);
+      }
+    }
+  }
+}
+
+// engine_buffer_get returns where piece index is downloaded to, NULL if
+// every piece buffer is in use.
+static unsigned char *engine_buffer_get(torrent_engine *e, int index) {
+  const TInfo *info = &e->handle->info;
+  if (e->output != NULL) {
+    return e->output + (unsigned long)index * info->piece_length;
+  }
+  if (e->no_of_spare > 0) {
+    return e->spare[--e->no_of_spare];
+  }
+  if (e->no_of_buffers == e->max_buffers) {
+    return NULL;
+  }
+
+  unsigned char *buffer = malloc(info->piece_length);
+  assert(buffer);
+  e->no_of_buffers++;
+  return buffer;
+}
+
+// engine_buffer_put takes back the buffer of a piece once it is stored or
+// thrown away, and lets the peers claim new pieces with it.
+static void engine_buffer_put(torrent_engine *e, torrent_piece *piece) {
+  if (e->output == NULL && piece->data != NULL) {
+    e->spare[e->no_of_spare++] = piece->data;
+    e->refill = 1;
+  }
+  piece->data = NULL;
+}
+
+// engine_buffer_index returns the registered buffer holding data, or -1.
+static int engine_buffer_index(const torrent_engine *e,
+                               const unsigned char *data) {
+  for (int i = 0; i < e->no_of_registered; i++) {
+    if (e->registered[i].iov_base == data) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// engine_register_buffers allocates every piece buffer up front and pins
+// them on the ring, so writing a piece out does not pin its pages each
+// time. Writes fall back to plain ones if the kernel refuses.
+static void engine_register_buffers(torrent_engine *e) {
+  unsigned long size = e->handle->info.piece_length;
+  e->registered = malloc(e->max_buffers * sizeof(struct iovec));
+  assert(e->registered);
+  while (e->no_of_buffers < e->max_buffers) {
+    unsigned char *buffer = malloc(size);
+    assert(buffer);
+    e->registered[e->no_of_buffers++] = (struct iovec){buffer, size};
+    e->spare[e->no_of_spare++] = buffer;
+  }
+
+  if (uring_register_buffers(e->ring, e->registered, e->no_of_buffers) ==
+      -1) {
+    perror("io_uring buffers not registered");
+    return;
+  }
+  e->no_of_registered = e->no_of_buffers;
+}
+
+// engine_adopt takes an orphaned piece peer p has off the orphans, or
+// returns -1. Stale entries go on the way as well.
+static int engine_adopt(torrent_engine *e, int p) {
+  int index = -1;
+  int n = 0;
+  for (int i = 0; i < e->no_of_orphans; i++) {
+    int orphan = e->orphans[i];
+    if (orphan_stale(e, orphan)) {
+      continue;
+    }
+    if (index == -1 && peer_has(&e->peers[p], orphan)) {
+      index = orphan;
+      continue;
+    }
+    e->orphans[n++] = orphan;
+  }
+  e->no_of_orphans = n;
+  return index;
+}
+
+// engine_reading tells if a closed peer's read may still land in piece
+// index.
+static int engine_reading(const torrent_engine *e, int index) {
+  for (int p = 0; p < e->no_of_peers; p++) {
+    if (e->peers[p].state == PEER_CLOSED &&
+        e->peers[p].arriving.piece == index) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// engine_reclaim frees an orphaned piece no peer left has and returns its
+// buffer, or NULL if there is none. Such a piece can not move on, holding
+// its buffer would stall the pieces the peers do have.
+static unsigned char *engine_reclaim(torrent_engine *e) {
+  for (int i = 0; i < e->no_of_orphans; i++) {
+    int orphan = e->orphans[i];
+    torrent_piece *piece = &e->pieces[orphan];
+    if (orphan_stale(e, orphan) || e->picker.availability[orphan] > 0 ||
+        engine_reading(e, orphan)) {
+      continue;
+    }
+
+    // the piece stays a candidate, its blocks are downloaded again.
+    unsigned char *data = piece->data;
+    e->pending += piece->received;
+    free(piece->block);
+    piece_hash_free(&piece->hash);
+    memset(piece, 0, sizeof(*piece));
+    piece->owner = -1;
+    e->orphans[i] = e->orphans[--e->no_of_orphans];
+    engine_deactivate(e, orphan);
+    return data;
+  }
+  return NULL;
+}
+
+// peer_fill_requests tops the requests in flight to a peer up to the queue
+// depth, claiming new pieces as the current one runs out of blocks.
+static void peer_fill_requests(torrent_engine *e, int p) {
+  torrent_peer *peer = &e->peers[p];
+  const TInfo *info = &e->handle->info;
+
+  while (!peer->choked && peer->in_flight < e->handle->queue_depth) {
+    int block = piece_next_block(e, p);
+    if (block >= 0) {
+      peer_request(e, p, peer->piece, block);
+      continue;
+    }
+
+    // a new piece needs a buffer. Without one the peer helps with a piece
+    // that was started, those hold on to theirs until they are done or
+    // nobody has them any more. A peer with no candidates is not worth a
+    // walk through the picker.
+    int index = peer->wanted > 0 ? picker_pick(&e->picker, peer->bitfield)
+                                 : -1;
+    if (index != -1 && e->pieces[index].state == PIECE_FREE) {
+      e->pieces[index].data = engine_buffer_get(e, index);
+      if (e->pieces[index].data == NULL) {
+        int orphan = engine_adopt(e, p);
+        if (orphan == -1) {
+          e->pieces[index].data = engine_reclaim(e);
+        }
+        if (e->pieces[index].data == NULL) {
+          index = orphan;
+        }
+      }
+    }
+    if (index == -1) {
+      peer->piece = -1;
+      break;
+    }
+
+    torrent_piece *piece = &e->pieces[index];
+    engine_take(e, index);
+    if (piece->state == PIECE_FREE) {
+      unsigned long length = torrent_piece_length(info, index);
+      piece->state = PIECE_ACTIVE;
+      e->active[e->no_of_active++] = index;
+      piece->blocks = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+      piece->block = calloc(piece->blocks, 1);
+      assert(piece->block);
+      piece_hash_init(&piece->hash);
+    }
+    piece->owner = p;
+    peer->piece = index;
+  }
+
+  if (!peer->choked && e->pending == 0 && e->handle->endgame) {
+    peer_fill_endgame(e, p);
+  }
+}
+
+// engine_cancel withdraws the requests other peers still have out for a
+// block that just arrived.
+static void engine_cancel(torrent_engine *e, int p, int index, int block) {
+  piece_request cancel = {
+      .index = ltob(index),
+      .begin = ltob(block * BLOCK_SIZE),
+      .length = ltob(block_length(&e->handle->info, index, block)),
+  };
+
+  for (int q = 0; q < e->no_of_peers; q++) {
+    torrent_peer *peer = &e->peers[q];
+    int i;
+    if (q == p || peer->state != PEER_ACTIVE ||
+        (i = peer_requested(peer, index, block)) == -1) {
+      continue;
+    }
+    peer_queue_message(peer, MSG_CANCEL, &cancel, sizeof(cancel));
+    peer->requests[i] = peer->requests[--peer->in_flight];
+    e->refill = 1;
+  }
+}
+
+// engine_arriving tells if another peer is receiving a block in place.
+static int engine_arriving(const torrent_engine *e, int p, int index,
+                           int block) {
+  for (int q = 0; q < e->no_of_peers; q++) {
+    const torrent_peer *peer = &e->peers[q];
+    if (q != p && peer->arriving.piece == index &&
+        peer->arriving.block == block) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// engine_on_piece_header picks where the body of a block goes while it
+// is still on the wire. Only a block nobody else was asked for is read in
+// place into the piece, a read in flight can not be taken back if another
+// copy wins. Everything else is put together in the receive buffer.
+static int engine_on_piece_header(torrent_engine *e, int p,
+                                  const wire_message *m) {
+  torrent_peer *peer = &e->peers[p];
+  const TInfo *info = &e->handle->info;
+
+  piece_response response;
+  memcpy(&response, m->payload, sizeof(response));
+  int index = ltob(response.index);
+  unsigned long begin = ltob(response.begin);
+  int block = begin / BLOCK_SIZE;
+  unsigned long size = m->size - sizeof(response);
+
+  unsigned char *dest = NULL;
+  if (begin % BLOCK_SIZE == 0 && peer_requested(peer, index, block) != -1 &&
+      e->pieces[index].block[block] == 1) {
+    if (size != block_length(info, index, block)) {
+      return -1;
+    }
+    dest = e->pieces[index].data + begin;
+    peer->arriving = (block_request){index, block};
+  }
+
+  wire_reader_direct(&peer->in, dest);
+  return 0;
+}
+
+// engine_on_stored finishes a piece that is verified and stored, and
+// announces it to the peers.
+static void engine_on_stored(torrent_engine *e, int index) {
+  const TInfo *info = &e->handle->info;
+  torrent_piece *piece = &e->pieces[index];
+  engine_buffer_put(e, piece);
+  piece->owner = -1;
+  piece->state = PIECE_DONE;
+  e->completed++;
+  e->progress = engine_now();
+  fprintf(stderr, "downloaded piece %d (%d/%d)\n", index, e->completed,
+          info->no_of_piece_hashes);
+
+  uint32_t have = ltob(index);
+  for (int p = 0; p < e->no_of_peers; p++) {
+    if (e->peers[p].state == PEER_ACTIVE) {
+      peer_queue_message(&e->peers[p], MSG_HAVE, &have, sizeof(have));
+    }
+  }
+  e->refill = 1;
+}
+
+// engine_store queues the writes of a verified piece on the ring, one per
+// file it touches. The piece keeps its buffer until they completed.
+static int engine_store(torrent_engine *e, const hash_job *job) {
+  torrent_piece *piece = &e->pieces[job->piece];
+  int n = torrent_map_extents(e->handle, job->piece, 0, job->length,
+                              e->extents, e->handle->info.no_of_files + 1);
+  if (n == -1) {
+    return -1;
+  }
+
+  int buffer = engine_buffer_index(e, job->data);
+  piece->state = PIECE_WRITING;
+  piece->written = 0;
+  unsigned long begin = 0;
+  for (int i = 0; i < n; i++) {
+    const TExtent *extent = &e->extents[i];
+    if (uring_write(e->ring, e->handle->fds[extent->file], job->data + begin,
+                    extent->length, extent->offset, buffer,
+                    op_data(job->piece, OP_WRITE)) == -1) {
+      perror("io_uring");
+      return -1;
+    }
+    if (piece->writes++ == 0) {
+      e->writing++;
+    }
+    begin += extent->length;
+  }
+  return 0;
+}
+
+// engine_on_written takes in a completed storage write of piece index.
+static void engine_on_written(torrent_engine *e, int index, int res) {
+  torrent_piece *piece = &e->pieces[index];
+  if (res < 0) {
+    fprintf(stderr, "writing piece %d: %s\n", index, strerror(-res));
+    e->failed = 1;
+  } else {
+    piece->written += res;
+  }
+  if (--piece->writes > 0) {
+    return;
+  }
+  e->writing--;
+  if (e->failed) {
+    return;
+  }
+
+  // writes to a file may come back short, the piece is then written again
+  // the blocking way.
+  unsigned long length = torrent_piece_length(&e->handle->info, index);
+  if (piece->written < length) {
+    struct iovec iov = {piece->data, length};
+    if (torrent_storage_writev(e->handle, index, 0, &iov, 1) == -1) {
+      e->failed = 1;
+      return;
+    }
+  }
+  engine_on_stored(e, index);
+}
+
+// engine_on_verified finishes a piece once its hash is checked. Good ones
+// are stored and announced to the peers, bad ones downloaded again.
+static void engine_on_verified(torrent_engine *e, const hash_job *job) {
+  int index = job->piece;
+  torrent_piece *piece = &e->pieces[index];
+  e->hashing--;
+
+  if (!job->ok) {
+    fprintf(stderr, "piece %d hash does not match, retrying\n", index);
+    if (piece->owner >= 0) {
+      e->peers[piece->owner].bad_pieces++;
+    }
+    e->pending += piece->blocks;
+    engine_buffer_put(e, piece);
+    memset(piece, 0, sizeof(*piece));
+    piece->owner = -1;
+    engine_put(e, index);
+    e->refill = 1;
+    return;
+  }
+
+  // on the ring the loop goes on while the piece is written.
+  if (e->handle->fds != NULL && e->ring != NULL) {
+    if (engine_store(e, job) == -1) {
+      e->failed = 1;
+    }
+    return;
+  }
+  if (e->handle->fds != NULL) {
+    struct iovec iov = {(void *)job->data, job->length};
+    if (torrent_storage_writev(e->handle, index, 0, &iov, 1) == -1) {
+      e->failed = 1;
+      return;
+    }
+  }
+
+  engine_on_stored(e, index);
+}
+
+static int engine_on_piece(torrent_engine *e, int p, const wire_message *m) {
+  torrent_peer *peer = &e->peers[p];
+  const TInfo *info = &e->handle->info;
+
+  piece_response response;
+  if (m->size < sizeof(response)) {
+    return -1;
+  }
+  memcpy(&response, m->payload, sizeof(response));
+  int index = ltob(response.index);
+  unsigned long begin = ltob(response.begin);
+  int block = begin / BLOCK_SIZE;
+  unsigned long size = m->size - sizeof(response);
+
+  if (m->direct) {
+    peer->arriving.piece = -1;
+  }
+
+  // blocks we did not ask this peer for (any more) are dropped unread,
+  // usually late copies of blocks cancelled in the endgame.
+  int i = begin % BLOCK_SIZE == 0 ? peer_requested(peer, index, block) : -1;
+  if (i == -1) {
+    e->duplicates++;
+    return 0;
+  }
+  if (size != block_length(info, index, block)) {
+    return -1;
+  }
+
+  torrent_piece *piece = &e->pieces[index];
+  // a copy being read in place elsewhere is going to land there anyway.
+  if (!m->direct && piece->block[block] != BLOCK_RECEIVED &&
+      piece->block[block] > 1 && engine_arriving(e, p, index, block)) {
+    peer_forget(e, p, i);
+    e->duplicates++;
+    return 0;
+  }
+
+  peer->requests[i] = peer->requests[--peer->in_flight];
+  if (piece->block[block] == BLOCK_RECEIVED) {
+    e->duplicates++;
+    return 0;
+  }
+
+  unsigned char *output = piece->data;
+  if (!m->direct) {
+    memcpy(output + begin, m->payload + sizeof(response), size);
+  }
+  if (piece->block[block] > 1) {
+    engine_cancel(e, p, index, block);
+  }
+  piece->block[block] = BLOCK_RECEIVED;
+  piece->received++;
+  e->progress = engine_now();
+
+  // the hash moves on while the block is still in cache, over any blocks
+  // that came early and waited for this one.
+  unsigned long length = torrent_piece_length(info, index);
+  if ((unsigned long)block == piece->hash.hashed / BLOCK_SIZE) {
+    int next = block;
+    while (next < piece->blocks && piece->block[next] == BLOCK_RECEIVED) {
+      next++;
+    }
+    unsigned long end = (unsigned long)next * BLOCK_SIZE;
+    piece_hash_update(&piece->hash, output, end < length ? end : length);
+  }
+
+  if (piece->received < piece->blocks) {
+    return 0;
+  }
+
+  // the owner stays on record in case the piece turns out bad.
+  free(piece->block);
+  piece->block = NULL;
+  piece->state = PIECE_HASHING;
+  engine_deactivate(e, index);
+  e->hashing++;
+  hash_job job = {
+      .piece = index,
+      .data = output,
+      .length = length,
+      .expected = info->pieces[index],
+      .hash = piece->hash,
+  };
+  piece->hash = (piece_hash){0};
+
+  // blocks in order leave nothing to hash, otherwise the network keeps
+  // going while the pool hashes the rest.
+  if (job.hash.hashed == length) {
+    job.ok = piece_hash_check(&job.hash, output, length, job.expected);
+    piece_hash_free(&job.hash);
+    engine_on_verified(e, &job);
+    return 0;
+  }
+  hash_pool_submit(&e->hasher, &job);
+  return 0;
+}
+
+// engine_on_hashed takes in the pieces the hash pool is done with.
+static void engine_on_hashed(torrent_engine *e) {
+  hash_job jobs[ENGINE_MAX_HASHED];
+  int n;
+  while ((n = hash_pool_collect(&e->hasher, jobs, ENGINE_MAX_HASHED)) > 0) {
+    for (int i = 0; i < n && !e->failed; i++) {
+      engine_on_verified(e, &jobs[i]);
+    }
+  }
+}
+
+static int engine_on_message(torrent_engine *e, int p, const wire_message *m) {
+  torrent_peer *peer = &e->peers[p];
+  int n = e->handle->info.no_of_piece_hashes;
+  const unsigned char *payload = m->payload;
+  uint32_t size = m->size;
+
+  switch (m->id) {
+  case MSG_CHOKE:
+    // a choking peer drops our requests, ask someone else.
+    peer->choked = 1;
+    engine_release(e, p);
+    return 0;
+  case MSG_UNCHOCK:
+    peer->choked = 0;
+    return 0;
+  case MSG_HAVE: {
+    uint32_t index;
+    if (size != 4) {
+      return -1;
+    }
+    memcpy(&index, payload, 4);
+    index = ltob(index);
+    if (index < (uint32_t)n && !peer_has(peer, index)) {
+      peer->bitfield[index / 8] |= 0x80 >> (index % 8);
+      picker_add(&e->picker, index);
+      peer->wanted += picker_candidate(&e->picker, index);
+    }
+    return 0;
+  }
+  case MSG_BITFIELD:
+    if (size != (uint32_t)(n + 7) / 8) {
+      return -1;
+    }
+    // only count the pieces the peer did not announce with HAVE already.
+    for (int i = 0; i < n; i++) {
+      if ((payload[i / 8] & (0x80 >> (i % 8))) && !peer_has(peer, i)) {
+        peer->bitfield[i / 8] |= 0x80 >> (i % 8);
+        picker_add(&e->picker, i);
+        peer->wanted += picker_candidate(&e->picker, i);
+      }
+    }
+    return 0;
+  case MSG_PIECE:
+    return engine_on_piece(e, p, m);
+  default:
+    return 0;
+  }
+}
+
+// peer_parse handles every whole message in the receive ring, a trailing
+// partial one stays buffered for the next read.
+static int peer_parse(torrent_engine *e, int p) {
+  torrent_peer *peer = &e->peers[p];
+  const TInfo *info = &e->handle->info;
+
+  if (peer->state == PEER_HANDSHAKE) {
+    unsigned char handshake[HANDSHAKE_SIZE];
+    if (wire_reader_read(&peer->in, handshake, HANDSHAKE_SIZE) == -1) {
+      return 0;
+    }
+    if (handshake[0] != 19 || memcmp(handshake + 1, "BitTorrent protocol", 19) ||
+        memcmp(handshake + 28, info->info_hash, SHA_DIGEST_LENGTH) != 0) {
+      return -1;
+    }
+    peer->state = PEER_ACTIVE;
+    // block bodies are read straight into the output from now on.
+    wire_reader_split(&peer->in, MSG_PIECE, sizeof(piece_response));
+  }
+
+  wire_message m;
+  int n;
+  while ((n = wire_reader_next(&peer->in, &m)) > 0) {
+    int err = n == WIRE_SPLIT ? engine_on_piece_header(e, p, &m)
+                              : engine_on_message(e, p, &m);
+    if (err == -1) {
+      return -1;
+    }
+  }
+  return n;
+}
+
+static int peer_read(torrent_engine *e, int p) {
+  torrent_peer *peer = &e->peers[p];
+  for (;;) {
+    ssize_t n = wire_reader_fill(&peer->in, peer->fd);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1 && errno == EAGAIN) {
+      return 0;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+
+    peer->last_active = engine_now();
+    if (peer_parse(e, p) == -1) {
+      return -1;
+    }
+  }
+}
+
+// uring_read keeps a read in flight on a peer's socket.
+static int uring_read(torrent_engine *e, int p) {
+  torrent_peer *peer = &e->peers[p];
+  if (peer->ops & OP_READ) {
+    return 0;
+  }
+
+  int count = wire_reader_prepare(&peer->in, peer->iov);
+  if (count == 0 || uring_readv(e->ring, peer->fd, peer->iov, count,
+                                op_data(p, OP_READ)) == -1) {
+    return -1;
+  }
+  peer->ops |= OP_READ;
+  return 0;
+}
+
+// peer_connected sends the handshake and our interest once the non-blocking
+// connect finished.
+static int peer_connected(torrent_engine *e, int p) {
+  torrent_peer *peer = &e->peers[p];
+  int err = 0;
+  socklen_t len = sizeof(err);
+  if (getsockopt(peer->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 ||
+      err != 0) {
+    return -1;
+  }
+
+  unsigned char handshake[HANDSHAKE_SIZE] = {19};
+  memcpy(handshake + 1, "BitTorrent protocol", 19);
+  memcpy(handshake + 28, e->handle->info.info_hash, SHA_DIGEST_LENGTH);
+  memcpy(handshake + 48, "00112233445566778899", 20);
+  peer_queue(peer, handshake, sizeof(handshake));
+  peer_queue_message(peer, MSG_INTERESTED, NULL, 0);
+
+  peer->state = PEER_HANDSHAKE;
+  peer->last_active = engine_now();
+  return 0;
+}
+
+static int peer_connect(torrent_engine *e, int p, TPeer addr) {
+  torrent_peer *peer = &e->peers[p];
+  memset(peer, 0, sizeof(*peer));
+  peer->addr = addr;
+  peer->choked = 1;
+  peer->piece = -1;
+  peer->arriving.piece = -1;
+  peer->state = PEER_CLOSED;
+  peer->bitfield = calloc((e->handle->info.no_of_piece_hashes + 7) / 8 + 1, 1);
+  peer->requests = malloc(e->handle->queue_depth * sizeof(block_request));
+  assert(peer->bitfield && peer->requests);
+  wire_reader_init(&peer->in, torrent_max_message(&e->handle->info));
+
+  // the ring waits on blocking sockets itself.
+  int fd = socket(AF_INET, SOCK_STREAM | (e->ring ? 0 : SOCK_NONBLOCK), 0);
+  if (fd == -1) {
+    perror("socket");
+    return -1;
+  }
+  int nodelay = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+  peer->sockaddr = (struct sockaddr_in){
+      .sin_family = AF_INET,
+      .sin_port = addr.port,
+      .sin_addr.s_addr = addr.ip,
+  };
+  if (e->ring != NULL) {
+    if (uring_connect(e->ring, fd, &peer->sockaddr,
+                      op_data(p, OP_CONNECT)) == -1) {
+      close(fd);
+      return -1;
+    }
+    peer->ops |= OP_CONNECT;
+  } else {
+    if (connect(fd, (struct sockaddr *)&peer->sockaddr,
+                sizeof(peer->sockaddr)) == -1 &&
+        errno != EINPROGRESS) {
+      close(fd);
+      return -1;
+    }
+
+    struct epoll_event ev = {.events = EPOLLOUT, .data.u32 = p};
+    if (epoll_ctl(e->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+      close(fd);
+      return -1;
+    }
+    peer->events = EPOLLOUT;
+  }
+
+  peer->fd = fd;
+  peer->state = PEER_CONNECTING;
+  peer->last_active = engine_now();
+  e->live_peers++;
+  return 0;
+}
+
+static void engine_on_event(torrent_engine *e, int p, uint32_t events) {
+  torrent_peer *peer = &e->peers[p];
+  int err = 0;
+
+  if (peer->state == PEER_CLOSED) {
+    return;
+  }
+  if (peer->state == PEER_CONNECTING) {
+    err = peer_connected(e, p);
+  } else if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+    err = peer_read(e, p);
+  }
+
+  if (err == 0 && peer->state == PEER_ACTIVE) {
+    peer_fill_requests(e, p);
+  }
+  if (err == 0) {
+    err = peer_flush(e, p);
+  }
+  if (err == -1) {
+    peer_close(e, p);
+  }
+}
+
+// uring_wait keeps a read of the hash pool's eventfd in flight.
+static void uring_wait(torrent_engine *e) {
+  if (e->waiting) {
+    return;
+  }
+  e->wake_iov = (struct iovec){&e->wake, sizeof(e->wake)};
+  if (uring_readv(e->ring, e->hasher.wake, &e->wake_iov, 1,
+                  op_data(0, OP_WAKE)) == 0) {
+    e->waiting = 1;
+  }
+}
+
+static void engine_on_completion(torrent_engine *e, uint64_t data, int res) {
+  int p = data >> 8;
+  enum engine_op op = data & 0xff;
+  if (op == OP_TICK) {
+    e->ticking = 0;
+    return;
+  }
+  if (op == OP_WAKE) {
+    e->waiting = 0;
+    if (res > 0) {
+      engine_on_hashed(e);
+    }
+    return;
+  }
+  if (op == OP_CANCEL) {
+    return;
+  }
+  if (op == OP_WRITE) {
+    engine_on_written(e, p, res);
+    return;
+  }
+
+  torrent_peer *peer = &e->peers[p];
+  peer->ops &= ~op;
+  if (peer->state == PEER_CLOSED) {
+    // whatever the read landed is thrown away, the block can go to others.
+    if (op == OP_READ && peer->arriving.piece != -1) {
+      engine_unrequest(e, peer->arriving);
+      peer->arriving.piece = -1;
+    }
+    return;
+  }
+
+  int err = res < 0 ? -1 : 0;
+  if (err == 0 && op == OP_CONNECT) {
+    err = peer_connected(e, p);
+  } else if (err == 0 && op == OP_READ) {
+    if (res == 0) {
+      err = -1;
+    } else {
+      wire_reader_commit(&peer->in, res);
+      peer->last_active = engine_now();
+      err = peer_parse(e, p);
+    }
+  } else if (err == 0 && op == OP_SEND) {
+    peer->sent += res;
+    if (peer->sent == peer->sending_length) {
+      peer->sending_length = 0;
+    }
+  }
+
+  if (err == 0 && peer->state == PEER_ACTIVE) {
+    peer_fill_requests(e, p);
+  }
+  if (err == 0) {
+    err = uring_flush(e, p);
+  }
+  if (err == 0) {
+    err = uring_read(e, p);
+  }
+  if (err == -1) {
+    peer_close(e, p);
+  }
+}
+
+// engine_reap handles every completion the ring has to offer.
+static void engine_reap(torrent_engine *e) {
+  uint64_t data;
+  int res;
+  while (uring_complete(e->ring, &data, &res)) {
+    engine_on_completion(e, data, res);
+  }
+}
+
+// engine_busy tells if the ring still has operations of the engine in
+// flight.
+static int engine_busy(const torrent_engine *e) {
+  if (e->ticking || e->waiting || e->writing > 0) {
+    return 1;
+  }
+  for (int i = 0; i < e->no_of_peers; i++) {
+    if (e->peers[i].ops != 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// engine_housekeeping serves peers that can take more requests and drops
+// the ones that stopped answering, once per turn of the loop.
+static void engine_housekeeping(torrent_engine *e) {
+  while (e->refill) {
+    e->refill = 0;
+    for (int i = 0; i < e->no_of_peers; i++) {
+      torrent_peer *peer = &e->peers[i];
+      if (peer->state == PEER_ACTIVE &&
+          (peer->out_length > 0 ||
+           peer->in_flight < e->handle->queue_depth)) {
+        engine_on_event(e, i, 0);
+      }
+    }
+  }
+
+  // drop peers that stopped answering while we wait on them, or that
+  // keep sending bad data.
+  long now = engine_now();
+  for (int i = 0; i < e->no_of_peers; i++) {
+    torrent_peer *peer = &e->peers[i];
+    if (peer->state == PEER_CLOSED) {
+      continue;
+    }
+    if (peer->bad_pieces >= ENGINE_MAX_BAD_PIECES) {
+      fprintf(stderr, "peer %d sent %d bad pieces, dropping it\n", i,
+              peer->bad_pieces);
+      peer_close(e, i);
+    } else if ((peer->state != PEER_ACTIVE || peer->in_flight > 0) &&
+               now - peer->last_active > PEER_TIMEOUT) {
+      peer_close(e, i);
+    }
+  }
+
+  if (e->hashing == 0 && e->writing == 0 &&
+      now - e->progress > ENGINE_STALL_TIMEOUT) {
+    fprintf(stderr, "no new block in %d s, giving up\n",
+            ENGINE_STALL_TIMEOUT);
+    e->failed = 1;
+  }
+}
+
+// engine_running tells if the download is still going. Pieces being hashed
+// or written may complete it even after the last peer left.
+static int engine_running(const torrent_engine *e) {
+  return !e->failed &&
+         e->completed < e->handle->info.no_of_piece_hashes &&
+         (e->live_peers > 0 || e->hashing > 0 || e->writing > 0);
+}
+
+static void engine_run_epoll(torrent_engine *e) {
+  struct epoll_event events[ENGINE_MAX_EVENTS];
+  struct epoll_event ev = {.events = EPOLLIN, .data.u32 = ENGINE_WAKE};
+  if (epoll_ctl(e->epfd, EPOLL_CTL_ADD, e->hasher.wake, &ev) == -1) {
+    perror("epoll_ctl");
+    return;
+  }
+
+  while (engine_running(e)) {
+    int count = epoll_wait(e->epfd, events, ENGINE_MAX_EVENTS, 1000);
+    if (count == -1 && errno != EINTR) {
+      perror("epoll_wait");
+      break;
+    }
+
+    for (int i = 0; i < count; i++) {
+      if (events[i].data.u32 == ENGINE_WAKE) {
+        uint64_t wake;
+        if (read(e->hasher.wake, &wake, sizeof(wake)) == sizeof(wake)) {
+          engine_on_hashed(e);
+        }
+      } else {
+        engine_on_event(e, events[i].data.u32, events[i].events);
+      }
+    }
+    engine_housekeeping(e);
+  }
+}
+
+// engine_run_uring is the loop of engine_run_epoll on the ring: every
+// turn hands over all reads, sends, connects and storage writes queued up
+// and handles what completed, with a timeout to wake up for housekeeping.
+static void engine_run_uring(torrent_engine *e) {
+  while (engine_running(e)) {
+    uring_wait(e);
+    if (!e->ticking &&
+        uring_timeout(e->ring, 1, op_data(0, OP_TICK)) == 0) {
+      e->ticking = 1;
+    }
+
+    if (uring_submit(e->ring, 1) == -1) {
+      perror("io_uring_enter");
+      break;
+    }
+    engine_reap(e);
+    engine_housekeeping(e);
+  }
+}
+
+long torrent_download(THandle handle, unsigned char *output,
+                      unsigned long output_size) {
+  TInfo *info = &handle->info;
+
+  if (output == NULL && handle->fds == NULL) {
+    fprintf(stderr, "storage is not open\n");
+    return -1;
+  }
+  if (output != NULL && info->length > output_size) {
+    fprintf(stderr, "not enough space in the output buffer\n");
+    return -1;
+  }
+
+  TPeers peers = NULL;
+  int n = torrent_get_peers(handle, &peers);
+  if (n <= 0) {
+    fprintf(stderr, "no peers to download from or an error\n");
+    free(peers);
+    return -1;
+  }
+  if (n > ENGINE_MAX_PEERS) {
+    n = ENGINE_MAX_PEERS;
+  }
+
+  torrent_uring ring;
+  torrent_engine e = {
+      .handle = handle,
+      .output = output,
+      .epfd = -1,
+      .peers = calloc(n, sizeof(torrent_peer)),
+      .pieces = calloc(info->no_of_piece_hashes + 1, sizeof(torrent_piece)),
+      .orphans = malloc((info->no_of_piece_hashes + 1) * sizeof(int)),
+      .active = malloc((info->no_of_piece_hashes + 1) * sizeof(int)),
+      .max_buffers = handle->piece_buffers,
+      .spare = calloc(handle->piece_buffers, sizeof(unsigned char *)),
+      // a piece can not touch more files than the torrent has.
+      .extents = malloc((info->no_of_files + 1) * sizeof(TExtent)),
+  };
+  assert(e.peers && e.pieces && e.orphans && e.active && e.spare &&
+         e.extents);
+  // a piece is hashed out of its buffer, so no more pieces than buffers
+  // can wait for the pool. Into the output any number of them may.
+  int hashed = output == NULL && e.max_buffers < info->no_of_piece_hashes
+                   ? e.max_buffers
+                   : info->no_of_piece_hashes;
+  if (hash_pool_init(&e.hasher, 0, hashed) == -1) {
+    free(peers);
+    free(e.peers);
+    free(e.pieces);
+    free(e.orphans);
+    free(e.active);
+    free(e.spare);
+    free(e.extents);
+    return -1;
+  }
+  if (handle->backend == TORRENT_BACKEND_URING) {
+    if (uring_init(&ring, ENGINE_URING_ENTRIES) == 0) {
+      e.ring = &ring;
+      if (output == NULL) {
+        engine_register_buffers(&e);
+      }
+    } else {
+      perror("io_uring unavailable, using epoll");
+    }
+  }
+  if (e.ring == NULL) {
+    e.epfd = epoll_create1(0);
+    assert(e.epfd != -1);
+  }
+  picker_init(&e.picker, info->no_of_piece_hashes, n);
+  for (int i = 0; i < info->no_of_piece_hashes; i++) {
+    e.pieces[i].owner = -1;
+    e.pending += (torrent_piece_length(info, i) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  }
+  e.started = engine_clock();
+  e.progress = engine_now();
+
+  for (int i = 0; i < n; i++) {
+    peer_connect(&e, i, peers[i]);
+  }
+  e.no_of_peers = n;
+  free(peers);
+
+  if (e.ring != NULL) {
+    engine_run_uring(&e);
+  } else {
+    engine_run_epoll(&e);
+  }
+
+  long result = info->length;
+  if (e.completed < info->no_of_piece_hashes) {
+    fprintf(stderr, "download failed, %d of %d pieces\n", e.completed,
+            info->no_of_piece_hashes);
+    result = -1;
+  } else {
+    // the tail is the time from the last block being requested to the
+    // last piece being verified, the part the endgame shortens.
+    double now = engine_clock();
+    fprintf(stderr,
+            "downloaded in %.3f s, tail %.1f ms, %d duplicate blocks\n",
+            now - e.started, e.tail > 0 ? (now - e.tail) * 1e3 : 0.0,
+            e.duplicates);
+  }
+
+  for (int i = 0; i < e.no_of_peers; i++) {
+    peer_close(&e, i);
+  }
+  if (e.ring != NULL) {
+    if (e.ticking) {
+      uring_cancel(e.ring, op_data(0, OP_TICK), 1, op_data(0, OP_CANCEL));
+    }
+    if (e.waiting) {
+      uring_cancel(e.ring, op_data(0, OP_WAKE), 0, op_data(0, OP_CANCEL));
+    }
+    // the kernel may still write into the buffers freed below.
+    while (engine_busy(&e) && uring_submit(e.ring, 1) != -1) {
+      engine_reap(&e);
+    }
+    uring_free(e.ring);
+  }
+  // the workers may still be reading the output.
+  hash_pool_free(&e.hasher);
+
+  for (int i = 0; i < e.no_of_peers; i++) {
+    free(e.peers[i].bitfield);
+    free(e.peers[i].requests);
+    wire_reader_free(&e.peers[i].in);
+    free(e.peers[i].out);
+    free(e.peers[i].sending);
+  }
+  for (int i = 0; i < info->no_of_piece_hashes; i++) {
+    free(e.pieces[i].block);
+    piece_hash_free(&e.pieces[i].hash);
+    engine_buffer_put(&e, &e.pieces[i]);
+  }
+  for (int i = 0; i < e.no_of_spare; i++) {
+    free(e.spare[i]);
+  }
+  free(e.spare);
+  free(e.registered);
+  free(e.extents);
+  free(e.peers);
+  free(e.pieces);
+  free(e.orphans);
+  free(e.active);
+  picker_free(&e.picker);
+  if (e.epfd != -1) {
+    close(e.epfd);
+  }
+
+  return result;
+}
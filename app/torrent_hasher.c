@@ -0,0 +1,159 @@
+#include "debug.h"
+#include "torrent_internal.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+void piece_hash_init(piece_hash *h) {
+  if (h->ctx == NULL) {
+    h->ctx = EVP_MD_CTX_new();
+    assert(h->ctx);
+  }
+  int ok = EVP_DigestInit_ex(h->ctx, EVP_sha1(), NULL);
+  assert(ok);
+  h->hashed = 0;
+}
+
+void piece_hash_update(piece_hash *h, const unsigned char *data,
+                       unsigned long end) {
+  if (end > h->hashed) {
+    EVP_DigestUpdate(h->ctx, data + h->hashed, end - h->hashed);
+    h->hashed = end;
+  }
+}
+
+int piece_hash_check(piece_hash *h, const unsigned char *data,
+                     unsigned long length, const uint8_t *expected) {
+  unsigned char hash[SHA_DIGEST_LENGTH];
+  int ok = 1;
+  // nothing hashed yet leaves the whole piece to a one-shot hash.
+  if (h->hashed == 0) {
+    torrent_sha1(data, length, hash);
+  } else {
+    piece_hash_update(h, data, length);
+    ok = EVP_DigestFinal_ex(h->ctx, hash, NULL);
+  }
+  return ok && memcmp(hash, expected, SHA_DIGEST_LENGTH) == 0;
+}
+
+void piece_hash_free(piece_hash *h) {
+  EVP_MD_CTX_free(h->ctx);
+  h->ctx = NULL;
+  h->hashed = 0;
+}
+
+static void *hash_worker(void *arg) {
+  hash_pool *pool = arg;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->stop && pool->queued == 0) {
+      pthread_cond_wait(&pool->more, &pool->lock);
+    }
+    if (pool->stop) {
+      break;
+    }
+
+    hash_job job = pool->queue[pool->head];
+    pool->head = (pool->head + 1) % pool->capacity;
+    pool->queued--;
+    pthread_mutex_unlock(&pool->lock);
+
+    job.ok = piece_hash_check(&job.hash, job.data, job.length, job.expected);
+    piece_hash_free(&job.hash);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->done[pool->no_of_done++] = job;
+    // one count per job, whoever waits on wake gets to collect them.
+    uint64_t one = 1;
+    if (write(pool->wake, &one, sizeof(one)) != sizeof(one)) {
+      perror("eventfd");
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return NULL;
+}
+
+int hash_pool_init(hash_pool *pool, int workers, int capacity) {
+  memset(pool, 0, sizeof(*pool));
+  if (workers <= 0) {
+    workers = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (workers <= 0) {
+    workers = 1;
+  }
+
+  pool->wake = eventfd(0, EFD_CLOEXEC);
+  if (pool->wake == -1) {
+    perror("eventfd");
+    return -1;
+  }
+
+  pool->capacity = capacity > 0 ? capacity : 1;
+  pool->queue = malloc(pool->capacity * sizeof(hash_job));
+  pool->done = malloc(pool->capacity * sizeof(hash_job));
+  pool->threads = malloc(workers * sizeof(pthread_t));
+  assert(pool->queue && pool->done && pool->threads);
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->more, NULL);
+
+  for (int i = 0; i < workers; i++) {
+    if (pthread_create(&pool->threads[i], NULL, hash_worker, pool) != 0) {
+      perror("pthread_create");
+      pool->workers = i;
+      hash_pool_free(pool);
+      return -1;
+    }
+  }
+  pool->workers = workers;
+  return 0;
+}
+
+void hash_pool_submit(hash_pool *pool, const hash_job *job) {
+  pthread_mutex_lock(&pool->lock);
+  assert(pool->outstanding < pool->capacity);
+  pool->queue[(pool->head + pool->queued) % pool->capacity] = *job;
+  pool->queued++;
+  pool->outstanding++;
+  pthread_cond_signal(&pool->more);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+int hash_pool_collect(hash_pool *pool, hash_job *jobs, int max) {
+  pthread_mutex_lock(&pool->lock);
+  int n = pool->no_of_done < max ? pool->no_of_done : max;
+  memcpy(jobs, pool->done, n * sizeof(hash_job));
+  memmove(pool->done, pool->done + n,
+          (pool->no_of_done - n) * sizeof(hash_job));
+  pool->no_of_done -= n;
+  pool->outstanding -= n;
+  pthread_mutex_unlock(&pool->lock);
+  return n;
+}
+
+void hash_pool_free(hash_pool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->more);
+  pthread_mutex_unlock(&pool->lock);
+
+  // workers finish the piece at hand, queued ones are dropped.
+  for (int i = 0; i < pool->workers; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  for (int i = 0; i < pool->queued; i++) {
+    piece_hash_free(&pool->queue[(pool->head + i) % pool->capacity].hash);
+  }
+
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->more);
+  close(pool->wake);
+  free(pool->threads);
+  free(pool->queue);
+  free(pool->done);
+  memset(pool, 0, sizeof(*pool));
+}
@@ -0,0 +1,388 @@
+#include "debug.h"
+#include "torrent_internal.h"
+#include <assert.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define INDEX_MAGIC "BTIX"
+#define INDEX_VERSION 1
+
+// the index file is a header, count fixed size records and a table of NUL
+// terminated strings the records point into, all in host byte order.
+typedef struct __attribute__((packed)) {
+  char magic[4];
+  uint32_t version;
+  uint32_t count;
+  uint32_t strings_size;
+} index_header;
+
+typedef struct __attribute__((packed)) {
+  uint8_t info_hash[SHA_DIGEST_LENGTH];
+  uint32_t no_of_piece_hashes;
+  uint64_t length;
+  uint64_t piece_length;
+  uint32_t path;
+  uint32_t tracker;
+} index_record;
+
+typedef struct {
+  char **paths;
+  int count;
+  int capacity;
+} path_list;
+
+typedef struct {
+  char **paths;
+  int count;
+  int next;
+  TIndexEntry *entries;
+  char *ok;
+} index_job;
+
+static int has_suffix(const char *s, const char *suffix) {
+  size_t n = strlen(s);
+  size_t m = strlen(suffix);
+  return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+// collect_torrents appends the path of every .torrent file below dir.
+static void collect_torrents(const char *dir, path_list *list) {
+  DIR *d = opendir(dir);
+  if (d == NULL) {
+    return;
+  }
+
+  struct dirent *e;
+  while ((e = readdir(d)) != NULL) {
+    if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) {
+      continue;
+    }
+
+    size_t size = strlen(dir) + strlen(e->d_name) + 2;
+    char *path = malloc(size);
+    assert(path);
+    snprintf(path, size, "%s/%s", dir, e->d_name);
+
+    // some filesystems leave d_type unset, lstat then tells like d_type
+    // would, without following symlinks.
+    int is_dir = e->d_type == DT_DIR;
+    if (e->d_type == DT_UNKNOWN) {
+      struct stat st;
+      is_dir = lstat(path, &st) == 0 && S_ISDIR(st.st_mode);
+    }
+    if (is_dir) {
+      collect_torrents(path, list);
+      free(path);
+      continue;
+    }
+
+    if (!has_suffix(e->d_name, ".torrent")) {
+      free(path);
+      continue;
+    }
+
+    if (list->count == list->capacity) {
+      list->capacity = list->capacity ? list->capacity * 2 : 64;
+      list->paths = realloc(list->paths, list->capacity * sizeof(char *));
+      assert(list->paths);
+    }
+    list->paths[list->count++] = path;
+  }
+
+  closedir(d);
+}
+
+static void *index_worker(void *arg) {
+  index_job *job = arg;
+
+  for (;;) {
+    int i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+    if (i >= job->count) {
+      break;
+    }
+
+    THandle h = torrent_open(job->paths[i]);
+    if (h == NULL) {
+      continue;
+    }
+
+    TIndexEntry *entry = &job->entries[i];
+    memcpy(entry->info_hash, h->info.info_hash, SHA_DIGEST_LENGTH);
+    entry->length = h->info.length;
+    entry->piece_length = h->info.piece_length;
+    entry->no_of_piece_hashes = h->info.no_of_piece_hashes;
+    entry->tracker = strdup(h->info.tracker);
+    assert(entry->tracker);
+    job->ok[i] = 1;
+
+    torrent_close(h);
+  }
+
+  return NULL;
+}
+
+// index_pack_strings moves the strings of every entry into one table owned
+// by the index, the layout the index file uses.
+static void index_pack_strings(TIndex index) {
+  size_t strings_size = 0;
+  for (int i = 0; i < index->count; i++) {
+    strings_size += strlen(index->entries[i].path) + 1;
+    strings_size += strlen(index->entries[i].tracker) + 1;
+  }
+
+  char *strings = malloc(strings_size > 0 ? strings_size : 1);
+  assert(strings);
+
+  size_t n = 0;
+  for (int i = 0; i < index->count; i++) {
+    TIndexEntry *entry = &index->entries[i];
+    const char *fields[2] = {entry->path, entry->tracker};
+    for (int j = 0; j < 2; j++) {
+      size_t size = strlen(fields[j]) + 1;
+      memcpy(strings + n, fields[j], size);
+      fields[j] = strings + n;
+      n += size;
+    }
+    entry->path = fields[0];
+    entry->tracker = fields[1];
+  }
+
+  index->strings = strings;
+  index->strings_size = strings_size;
+}
+
+static void index_build_table(TIndex index) {
+  // open addressing on the info hash itself, it is already uniform.
+  unsigned int capacity = 16;
+  while (capacity < (unsigned int)index->count * 2) {
+    capacity *= 2;
+  }
+  index->slots = calloc(capacity, sizeof(*index->slots));
+  assert(index->slots);
+  index->mask = capacity - 1;
+
+  for (int i = 0; i < index->count; i++) {
+    uint32_t h;
+    memcpy(&h, index->entries[i].info_hash, sizeof(h));
+    unsigned int slot = h & index->mask;
+    while (index->slots[slot] != 0) {
+      if (memcmp(index->entries[index->slots[slot] - 1].info_hash,
+                 index->entries[i].info_hash, SHA_DIGEST_LENGTH) == 0) {
+        // the same torrent twice, the first copy wins.
+        break;
+      }
+      slot = (slot + 1) & index->mask;
+    }
+    if (index->slots[slot] == 0) {
+      index->slots[slot] = i + 1;
+    }
+  }
+}
+
+static TIndex index_create(int count) {
+  TIndex index = malloc(sizeof(*index));
+  assert(index);
+  memset(index, 0, sizeof(*index));
+
+  index->entries = calloc(count > 0 ? count : 1, sizeof(*index->entries));
+  assert(index->entries);
+  return index;
+}
+
+TIndex torrent_index_build(const char *dir, int workers) {
+  path_list list = {0};
+  collect_torrents(dir, &list);
+
+  if (workers <= 0) {
+    workers = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (workers > list.count) {
+    workers = list.count > 0 ? list.count : 1;
+  }
+
+  index_job job = {
+      .paths = list.paths,
+      .count = list.count,
+      .entries = calloc(list.count > 0 ? list.count : 1, sizeof(TIndexEntry)),
+      .ok = calloc(list.count > 0 ? list.count : 1, 1),
+  };
+  assert(job.entries && job.ok);
+
+  pthread_t threads[workers];
+  for (int i = 0; i < workers; i++) {
+    if (pthread_create(&threads[i], NULL, index_worker, &job) != 0) {
+      perror("pthread_create");
+      exit(1);
+    }
+  }
+  for (int i = 0; i < workers; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  TIndex index = index_create(list.count);
+  for (int i = 0; i < list.count; i++) {
+    if (job.ok[i]) {
+      index->entries[index->count] = job.entries[i];
+      index->entries[index->count].path = list.paths[i];
+      index->count++;
+    }
+  }
+
+  index_pack_strings(index);
+  index_build_table(index);
+
+  for (int i = 0; i < list.count; i++) {
+    if (job.ok[i]) {
+      free((void *)job.entries[i].tracker);
+    }
+    free(list.paths[i]);
+  }
+  free(list.paths);
+  free(job.entries);
+  free(job.ok);
+
+  return index;
+}
+
+int torrent_index_save(TIndex index, const char *path) {
+  FILE *file = fopen(path, "wb");
+  if (file == NULL) {
+    perror("error opening index file");
+    return -1;
+  }
+
+  index_header header = {
+      .magic = INDEX_MAGIC,
+      .version = INDEX_VERSION,
+      .count = index->count,
+      .strings_size = index->strings_size,
+  };
+
+  index_record *records = calloc(index->count > 0 ? index->count : 1,
+                                 sizeof(*records));
+  assert(records);
+  for (int i = 0; i < index->count; i++) {
+    const TIndexEntry *entry = &index->entries[i];
+    memcpy(records[i].info_hash, entry->info_hash, SHA_DIGEST_LENGTH);
+    records[i].no_of_piece_hashes = entry->no_of_piece_hashes;
+    records[i].length = entry->length;
+    records[i].piece_length = entry->piece_length;
+    records[i].path = entry->path - index->strings;
+    records[i].tracker = entry->tracker - index->strings;
+  }
+
+  int ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+           fwrite(records, sizeof(*records), index->count, file) ==
+               (size_t)index->count &&
+           fwrite(index->strings, 1, index->strings_size, file) ==
+               index->strings_size;
+  free(records);
+
+  if (fclose(file) != 0 || !ok) {
+    fprintf(stderr, "error writing index file\n");
+    return -1;
+  }
+  return 0;
+}
+
+TIndex torrent_index_load(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    perror("error opening index file");
+    return NULL;
+  }
+
+  index_header header;
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      memcmp(header.magic, INDEX_MAGIC, 4) != 0 ||
+      header.version != INDEX_VERSION) {
+    fprintf(stderr, "not an index file\n");
+    fclose(file);
+    return NULL;
+  }
+
+  TIndex index = index_create(header.count);
+  index_record *records = calloc(header.count > 0 ? header.count : 1,
+                                 sizeof(*records));
+  char *strings = malloc(header.strings_size > 0 ? header.strings_size : 1);
+  assert(records && strings);
+
+  int ok = fread(records, sizeof(*records), header.count, file) ==
+               header.count &&
+           fread(strings, 1, header.strings_size, file) ==
+               header.strings_size &&
+           (header.strings_size == 0 ||
+            strings[header.strings_size - 1] == '\0');
+  fclose(file);
+
+  for (uint32_t i = 0; ok && i < header.count; i++) {
+    if (records[i].path >= header.strings_size ||
+        records[i].tracker >= header.strings_size) {
+      ok = 0;
+      break;
+    }
+
+    TIndexEntry *entry = &index->entries[i];
+    memcpy(entry->info_hash, records[i].info_hash, SHA_DIGEST_LENGTH);
+    entry->no_of_piece_hashes = records[i].no_of_piece_hashes;
+    entry->length = records[i].length;
+    entry->piece_length = records[i].piece_length;
+    entry->path = strings + records[i].path;
+    entry->tracker = strings + records[i].tracker;
+  }
+  free(records);
+
+  if (!ok) {
+    fprintf(stderr, "corrupt index file\n");
+    free(strings);
+    free(index->entries);
+    free(index);
+    return NULL;
+  }
+
+  // the entries already point into the string table as it was read.
+  index->count = header.count;
+  index->strings = strings;
+  index->strings_size = header.strings_size;
+  index_build_table(index);
+
+  return index;
+}
+
+const TIndexEntry *torrent_index_find(TIndex index,
+                                      const uint8_t info_hash[20]) {
+  uint32_t h;
+  memcpy(&h, info_hash, sizeof(h));
+
+  unsigned int slot = h & index->mask;
+  while (index->slots[slot] != 0) {
+    const TIndexEntry *entry = &index->entries[index->slots[slot] - 1];
+    if (memcmp(entry->info_hash, info_hash, SHA_DIGEST_LENGTH) == 0) {
+      return entry;
+    }
+    slot = (slot + 1) & index->mask;
+  }
+
+  return NULL;
+}
+
+int torrent_index_count(TIndex index) { return index->count; }
+
+const TIndexEntry *torrent_index_entry(TIndex index, int i) {
+  if (i < 0 || i >= index->count) {
+    return NULL;
+  }
+  return &index->entries[i];
+}
+
+void torrent_index_free(TIndex index) {
+  free(index->slots);
+  free(index->strings);
+  free(index->entries);
+  free(index);
+}
@@ -1,20 +1,240 @@
 #ifndef TORRENT_INTERNAL_H__
 #define TORRENT_INTERNAL_H__
 
+#include "bencode.h"
+#include <netinet/in.h>
+#include <openssl/evp.h>
 #include <openssl/sha.h>
+#include <pthread.h>
 #include <stdint.h>
+#include <sys/types.h>
 
+typedef struct torrent_handle *THandle;
+typedef struct torrent_index *TIndex;
+
+#include "torrent.h"
+
+typedef struct {
+  unsigned long offset;
+  unsigned long length;
+  int file;
+} torrent_extent;
+
+enum peer_state {
+  PEER_CONNECTING = 0,
+  PEER_HANDSHAKE,
+  PEER_ACTIVE,
+  PEER_CLOSED,
+};
+
+// WIRE_HEADER_MAX is the longest payload header a split message may have.
+#define WIRE_HEADER_MAX 16
+
+// wire_message is a message handed out by wire_reader_next. payload is
+// valid until the next wire_reader_fill. For a message whose body was
+// received straight into the caller's buffer, direct is set and payload
+// only holds its header.
+typedef struct {
+  uint8_t id;
+  int direct;
+  uint32_t size;
+  const unsigned char *payload;
+} wire_message;
+
+// wire_reader buffers the bytes received from a peer in a ring and splits
+// them into messages, so one read can serve many messages. head and tail
+// only grow and are masked into data.
+typedef struct {
+  unsigned char *data;
+  size_t size;
+  size_t head;
+  size_t tail;
+  size_t max_length;
+  // scratch holds a message that wraps around the end of the ring, or a
+  // split message that is put together outside of it.
+  unsigned char *scratch;
+
+  // messages with split_id are handed out as soon as their header is in,
+  // the part of their body not buffered yet then goes to direct without
+  // passing through the ring.
+  int split_id;
+  size_t split_header;
+  unsigned char *direct;
+  size_t direct_left;
+  int direct_done;
+  wire_message split;
+  unsigned char header[WIRE_HEADER_MAX];
+} wire_reader;
+
+// wire_reader_next returns WIRE_SPLIT for the header of a split message.
+#define WIRE_SPLIT 2
+
+// torrent_max_message is the longest message a peer may send for info.
+size_t torrent_max_message(const TInfo *info);
+
+void wire_reader_init(wire_reader *r, size_t max_length);
+void wire_reader_free(wire_reader *r);
+size_t wire_reader_buffered(const wire_reader *r);
+// wire_reader_split makes the reader hand out messages with id after the
+// first header bytes of their payload, see wire_reader_direct. Messages
+// that are buffered whole by then are handed out as usual.
+void wire_reader_split(wire_reader *r, int id, size_t header);
+// wire_reader_prepare points iov at where the next read should go and
+// returns how many iovecs it used, 0 if there is no room. Nothing but
+// wire_reader_commit may touch the reader until the read is done.
+int wire_reader_prepare(wire_reader *r, struct iovec iov[3]);
+// wire_reader_commit takes in n bytes read into the iovecs of the last
+// wire_reader_prepare.
+void wire_reader_commit(wire_reader *r, size_t n);
+// wire_reader_fill reads whatever the socket has room for with one readv,
+// and returns like readv.
+ssize_t wire_reader_fill(wire_reader *r, int fd);
+// wire_reader_read takes size raw bytes, as for the handshake. It returns
+// -1 while fewer are buffered.
+int wire_reader_read(wire_reader *r, void *out, size_t size);
+// wire_reader_next returns 1 with the next message, 0 if no whole message
+// is buffered yet or -1 if the peer sent one longer than max_length.
+// Keep-alives are skipped. A split message is returned as WIRE_SPLIT
+// with only its header in payload and size the size of the whole payload;
+// the caller has to pass wire_reader_direct where its body goes. Once the
+// body is in, the message is returned again with direct set.
+int wire_reader_next(wire_reader *r, wire_message *m);
+// wire_reader_direct receives the body of the split message just handed
+// out to dest. With dest NULL the message is returned whole like any other
+// once it is in.
+void wire_reader_direct(wire_reader *r, void *dest);
+
+// block_request is a block requested from a peer and not received yet.
+typedef struct {
+  int piece;
+  int block;
+} block_request;
+
+// torrent_peer is the state of one connection to a peer.
 typedef struct {
-  int socketfd;
-  char *torrent_file;
-} *THandle;
+  int fd;
+  enum peer_state state;
+  TPeer addr;
+  // events is what epoll currently watches the socket for.
+  uint32_t events;
+  // choked is set until the peer unchokes us.
+  int choked;
+  // bitfield has a bit per piece the peer announced, high bit first.
+  // wanted counts the ones among them that are candidates of the picker.
+  unsigned char *bitfield;
+  int wanted;
+
+  // in frames the received bytes, out holds the bytes queued for the
+  // socket.
+  wire_reader in;
+  unsigned char *out;
+  size_t out_length;
+  size_t out_capacity;
+
+  // piece is the piece blocks are requested from next, -1 if none.
+  int piece;
+  // arriving is the block whose body is being received in place, piece is
+  // -1 when there is none.
+  block_request arriving;
+  // bad_pieces counts the pieces that failed their hash while the peer
+  // owned them.
+  int bad_pieces;
+  // requests holds the in_flight requests, up to the queue depth.
+  block_request *requests;
+  int in_flight;
+  long last_active;
+
+  // the io_uring backend keeps what its operations in flight point at
+  // here: ops has a bit per kind of operation in flight, a send goes out
+  // of sending while new messages queue up in out.
+  int ops;
+  struct sockaddr_in sockaddr;
+  struct iovec iov[3];
+  unsigned char *sending;
+  size_t sending_length;
+  size_t sending_capacity;
+  size_t sent;
+} torrent_peer;
+
+// piece_hash is a SHA1 running over a piece from its start as the blocks
+// come in, hashed is how far it got.
+typedef struct {
+  EVP_MD_CTX *ctx;
+  unsigned long hashed;
+} piece_hash;
+
+// piece_hash_init starts a new hash, a context h still holds from an
+// earlier piece is reused.
+void piece_hash_init(piece_hash *h);
+// piece_hash_update hashes data up to end, from where the last call left.
+void piece_hash_update(piece_hash *h, const unsigned char *data,
+                       unsigned long end);
+// piece_hash_check hashes what is left of the length bytes of data and
+// tells if the result is expected. The context is kept for the next
+// piece_hash_init.
+int piece_hash_check(piece_hash *h, const unsigned char *data,
+                     unsigned long length, const uint8_t *expected);
+void piece_hash_free(piece_hash *h);
+
+struct torrent_handle {
+  // peer is the connection used by the single peer commands. received and
+  // hash track the piece torrent_download_piece is on, they are allocated
+  // by its first call and reset for every piece after that.
+  torrent_peer peer;
+  char *received;
+  piece_hash hash;
+  // queue_depth is how many block requests are kept in flight per peer.
+  int queue_depth;
+  // endgame allows requesting the last blocks from several peers at once.
+  int endgame;
+  int piece_buffers;
+  TBackend backend;
+  // torrent_file is the read-only mapping of the metainfo file.
+  const char *torrent_file;
+  size_t torrent_file_size;
+
+  // info is parsed once by torrent_open and read by every getter.
+  TInfo info;
+
+  // files backs info.files, the paths are owned by the handle too.
+  TFile *files;
+  int multi_file;
+
+  // extents lists the non-empty files in torrent order, so the file that
+  // holds an offset of the torrent data is found with a binary search.
+  torrent_extent *extents;
+  int no_of_extents;
+
+  // fds holds a descriptor per file once torrent_storage_open succeeded.
+  int *fds;
+};
+
+struct torrent_index {
+  TIndexEntry *entries;
+  int count;
+
+  // entries point into strings, the index owns it.
+  char *strings;
+  size_t strings_size;
+
+  // slots maps an info hash to entry index + 1, 0 marks a free slot.
+  int *slots;
+  unsigned int mask;
+};
+
+// BLOCK_SIZE is the size of a block request, the unit pieces are
+// transferred in.
+#define BLOCK_SIZE (1 << 14)
 
 enum message_ids {
+  MSG_CHOKE = 0,
   MSG_UNCHOCK = 1,
   MSG_INTERESTED = 2,
+  MSG_HAVE = 4,
   MSG_BITFIELD = 5,
   MSG_REQUEST = 6,
   MSG_PIECE = 7,
+  MSG_CANCEL = 8,
 };
 
 typedef struct __attribute__((packed)) {
@@ -35,6 +255,257 @@ typedef struct {
   uint32_t data[];
 } piece_response;
 
+enum piece_state {
+  PIECE_FREE = 0,
+  PIECE_ACTIVE,
+  // every block arrived and the piece waits for the hash pool.
+  PIECE_HASHING,
+  // verified and being written to storage through the ring.
+  PIECE_WRITING,
+  PIECE_DONE,
+};
+
+// a block that arrived, other values count the requests out for a block.
+#define BLOCK_RECEIVED 0xff
+
+typedef struct {
+  enum piece_state state;
+  // owner is the peer the blocks of an active piece are requested from, -1
+  // while nobody is working through it.
+  int owner;
+  int blocks;
+  int received;
+  // next is where to look for a block nobody requested yet.
+  int next;
+  // block has an entry per block, only while the piece is active.
+  uint8_t *block;
+  // data is where the piece is downloaded to, until it is verified.
+  unsigned char *data;
+  // hash covers the blocks received in a row from the start.
+  piece_hash hash;
+  // writes counts the ring writes in flight, written the bytes they wrote.
+  int writes;
+  unsigned long written;
+} torrent_piece;
+
+// hash_job is a piece handed to the hash pool, ok is filled in by it. The
+// pool carries on from where hash is.
+typedef struct {
+  int piece;
+  const unsigned char *data;
+  unsigned long length;
+  const uint8_t *expected;
+  piece_hash hash;
+  int ok;
+} hash_job;
+
+// hash_pool checks pieces against their hashes on worker threads. Jobs
+// wait in the circular queue and come back through done; wake is an
+// eventfd counting the jobs finished, for an event loop to wait on.
+typedef struct {
+  pthread_t *threads;
+  int workers;
+  pthread_mutex_t lock;
+  pthread_cond_t more;
+  int stop;
+
+  hash_job *queue;
+  int head;
+  int queued;
+  hash_job *done;
+  int no_of_done;
+  // outstanding counts the jobs submitted and not collected yet, at most
+  // capacity.
+  int outstanding;
+  int capacity;
+
+  int wake;
+} hash_pool;
+
+// hash_pool_init starts workers threads, one per CPU if workers <= 0, for
+// up to capacity jobs at a time.
+int hash_pool_init(hash_pool *pool, int workers, int capacity);
+void hash_pool_submit(hash_pool *pool, const hash_job *job);
+// hash_pool_collect moves up to max finished jobs to jobs and returns how
+// many. It does not read wake, the caller drains it.
+int hash_pool_collect(hash_pool *pool, hash_job *jobs, int max);
+// hash_pool_free stops the workers once their current job is done.
+void hash_pool_free(hash_pool *pool);
+
+// torrent_picker orders the pieces still to be requested by how many peers
+// have them. order is grouped into runs of equal availability, bucket[a] is
+// where the run of availability a starts and bucket[max + 1] is the number
+// of pieces in order. Moving a piece to a neighbouring run is a swap with
+// the run's edge, so availability changes are O(1) and the rarest pieces
+// are always at the front.
+typedef struct {
+  int *order;
+  int *position;
+  int *availability;
+  int *bucket;
+  int max;
+} torrent_picker;
+
+void picker_init(torrent_picker *picker, int pieces, int max_availability);
+void picker_free(torrent_picker *picker);
+// picker_add and picker_remove count a peer that gained or lost a piece.
+void picker_add(torrent_picker *picker, int piece);
+void picker_remove(torrent_picker *picker, int piece);
+// picker_candidate tells if piece is among the candidates.
+int picker_candidate(const torrent_picker *picker, int piece);
+// picker_take and picker_put take a piece out of the candidates while it is
+// being downloaded or done, and put it back if that failed.
+void picker_take(torrent_picker *picker, int piece);
+void picker_put(torrent_picker *picker, int piece);
+// picker_pick returns the rarest candidate piece set in bitfield, or -1.
+// It walks the candidates from the rarest on, so it costs up to one step
+// per candidate for a peer that has few of them; the engine only calls it
+// for peers with at least one.
+int picker_pick(const torrent_picker *picker, const unsigned char *bitfield);
+
+// torrent_uring is an io_uring set up by hand, without liburing. tail is
+// the submission queue tail including entries not handed over yet.
+typedef struct {
+  int fd;
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_array;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned tail;
+
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  // backlog keeps completions taken off a full completion queue to make
+  // room for submissions, uring_complete hands them out first.
+  struct {
+    uint64_t data;
+    int res;
+  } *backlog;
+  int backlog_head;
+  int backlog_length;
+  int backlog_capacity;
+
+  // timeout is the struct __kernel_timespec of uring_timeout.
+  long long timeout[2];
+} torrent_uring;
+
+// uring_init sets up a ring with room for entries submissions, it returns
+// -1 with errno set if the kernel has no io_uring to offer.
+int uring_init(torrent_uring *ring, unsigned entries);
+void uring_free(torrent_uring *ring);
+// uring_register_buffers pins count buffers for fixed writes, they stay
+// registered until uring_free.
+int uring_register_buffers(torrent_uring *ring, const struct iovec *iov,
+                           int count);
+// the functions below queue an operation whose completion carries data.
+// What they point at has to stay valid until it completed. They fail only
+// if the queue is full and the kernel takes none of it after a few tries.
+int uring_readv(torrent_uring *ring, int fd, const struct iovec *iov,
+                int count, uint64_t data);
+int uring_send(torrent_uring *ring, int fd, const void *buffer, size_t size,
+               uint64_t data);
+int uring_connect(torrent_uring *ring, int fd,
+                  const struct sockaddr_in *addr, uint64_t data);
+// uring_write writes size bytes at offset of a file. With buffer_index not
+// -1 the bytes lie in that buffer of uring_register_buffers.
+int uring_write(torrent_uring *ring, int fd, const void *buffer, size_t size,
+                unsigned long offset, int buffer_index, uint64_t data);
+// uring_timeout completes after seconds, uring_cancel cancels the
+// operation carrying target, a timeout as well.
+int uring_timeout(torrent_uring *ring, unsigned seconds, uint64_t data);
+int uring_cancel(torrent_uring *ring, uint64_t target, int timeout,
+                 uint64_t data);
+// uring_submit hands the queued operations to the kernel and waits for at
+// least wait completions.
+int uring_submit(torrent_uring *ring, unsigned wait);
+// uring_complete takes the oldest completion, it returns 0 if there is
+// none.
+int uring_complete(torrent_uring *ring, uint64_t *data, int *res);
+
+// torrent_engine drives the connections of a download on one epoll loop,
+// or on an io_uring if ring is set.
+typedef struct {
+  THandle handle;
+  unsigned char *output;
+  int epfd;
+  torrent_uring *ring;
+  // ticking is set while the timeout that wakes the ring up is pending.
+  int ticking;
+
+  // hasher verifies complete pieces, hashing counts the ones it has. The
+  // ring reads its eventfd into wake while waiting is set.
+  hash_pool hasher;
+  int hashing;
+  int waiting;
+  uint64_t wake;
+  struct iovec wake_iov;
+  // failed stops the download, the pieces can not be stored.
+  int failed;
+  // writing counts the pieces with ring writes in flight, extents is room
+  // for where one piece goes.
+  int writing;
+  TExtent *extents;
+
+  // without an output, pieces are downloaded into at most max_buffers
+  // buffers allocated as needed; spare holds the ones not in use.
+  unsigned char **spare;
+  int no_of_spare;
+  int no_of_buffers;
+  int max_buffers;
+  // registered lists the buffers pinned for fixed writes on the ring.
+  struct iovec *registered;
+  int no_of_registered;
+
+  torrent_peer *peers;
+  int no_of_peers;
+  int live_peers;
+
+  torrent_piece *pieces;
+  torrent_picker picker;
+  // active lists the pieces whose blocks are being downloaded, in no
+  // particular order.
+  int *active;
+  int no_of_active;
+  // orphans lists the active pieces nobody is working through, each at
+  // most once. Entries taken over or finished since are dropped lazily.
+  int *orphans;
+  int no_of_orphans;
+  int completed;
+  // pending counts the blocks that are neither received nor requested,
+  // once it drops to 0 the download is in its endgame.
+  long pending;
+  // refill is set when blocks went back to the pool or requests were
+  // cancelled, idle peers may want to request more.
+  int refill;
+  // progress is when the last new block arrived or piece completed.
+  long progress;
+
+  // started and tail are when the download started and when every block
+  // was first requested, duplicates counts blocks received twice.
+  double started;
+  double tail;
+  int duplicates;
+} torrent_engine;
+
+// torrent_storage_path returns the path file of the torrent is stored at
+// below path, to be freed by the caller.
+char *torrent_storage_path(THandle handle, const char *path, int file);
+
+// torrent_piece_length returns the length of piece index, only the last
+// piece may be shorter than info->piece_length.
+unsigned long torrent_piece_length(const TInfo *info, int index);
+
 // ltob converts a number presented in little endian to
 // its big endian representation.
 uint32_t ltob(uint32_t n);
@@ -43,6 +514,22 @@ uint32_t ltob(uint32_t n);
 int url_encode(char *output, int output_size,
                const unsigned char hash_info[SHA_DIGEST_LENGTH]);
 
-#include "torrent.h"
+enum tracker_field {
+  TRACKER_FIELD_NONE = 0,
+  TRACKER_FIELD_PEERS,
+  TRACKER_FIELD_FAILURE,
+};
+
+// tracker_response collects the fields we need from a tracker response
+// while curl is still receiving it.
+typedef struct {
+  bencode_stream *stream;
+  enum tracker_field field;
+  // has_peers is set once the peers string arrived, it may be empty.
+  int has_peers;
+  unsigned char *peers;
+  size_t peers_size;
+  char failure[SMALL_BUFFER_SIZE];
+} tracker_response;
 
 #endif /* TORRENT_INTERNAL_H__ */
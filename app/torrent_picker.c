@@ -0,0 +1,121 @@
+#include "debug.h"
+#include "torrent_internal.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static void picker_swap(torrent_picker *picker, int a, int b) {
+  int piece_a = picker->order[a];
+  int piece_b = picker->order[b];
+  picker->order[a] = piece_b;
+  picker->order[b] = piece_a;
+  picker->position[piece_a] = b;
+  picker->position[piece_b] = a;
+}
+
+void picker_init(torrent_picker *picker, int pieces, int max_availability) {
+  picker->max = max_availability;
+  picker->order = malloc((pieces + 1) * sizeof(int));
+  picker->position = malloc((pieces + 1) * sizeof(int));
+  picker->availability = calloc(pieces + 1, sizeof(int));
+  picker->bucket = calloc(max_availability + 2, sizeof(int));
+  assert(picker->order && picker->position && picker->availability &&
+         picker->bucket);
+
+  // a random starting order is what breaks ties between equally rare
+  // pieces, the swaps below keep it shuffled.
+  unsigned int seed = time(NULL) ^ getpid();
+  for (int i = 0; i < pieces; i++) {
+    int j = rand_r(&seed) % (i + 1);
+    picker->order[i] = picker->order[j];
+    picker->order[j] = i;
+  }
+  for (int i = 0; i < pieces; i++) {
+    picker->position[picker->order[i]] = i;
+  }
+
+  // every piece starts in the run of availability 0.
+  for (int a = 1; a <= max_availability + 1; a++) {
+    picker->bucket[a] = pieces;
+  }
+}
+
+void picker_free(torrent_picker *picker) {
+  free(picker->order);
+  free(picker->position);
+  free(picker->availability);
+  free(picker->bucket);
+  memset(picker, 0, sizeof(*picker));
+}
+
+// picker_up moves a candidate to the front of the next run.
+static void picker_up(torrent_picker *picker, int piece, int a) {
+  int last = picker->bucket[a + 1] - 1;
+  picker_swap(picker, picker->position[piece], last);
+  picker->bucket[a + 1]--;
+}
+
+// picker_down moves a candidate to the end of the previous run.
+static void picker_down(torrent_picker *picker, int piece, int a) {
+  int first = picker->bucket[a];
+  picker_swap(picker, picker->position[piece], first);
+  picker->bucket[a]++;
+}
+
+// pieces taken out of the candidates are kept past the end of the runs.
+int picker_candidate(const torrent_picker *picker, int piece) {
+  return picker->position[piece] < picker->bucket[picker->max + 1];
+}
+
+void picker_add(torrent_picker *picker, int piece) {
+  int a = picker->availability[piece]++;
+  assert(a < picker->max);
+  if (picker_candidate(picker, piece)) {
+    picker_up(picker, piece, a);
+  }
+}
+
+void picker_remove(torrent_picker *picker, int piece) {
+  int a = picker->availability[piece]--;
+  assert(a > 0);
+  if (picker_candidate(picker, piece)) {
+    picker_down(picker, piece, a);
+  }
+}
+
+void picker_take(torrent_picker *picker, int piece) {
+  if (!picker_candidate(picker, piece)) {
+    return;
+  }
+  for (int a = picker->availability[piece]; a <= picker->max; a++) {
+    picker_up(picker, piece, a);
+  }
+}
+
+void picker_put(torrent_picker *picker, int piece) {
+  if (picker_candidate(picker, piece)) {
+    return;
+  }
+
+  // append it to the most available run, then walk it down to its own.
+  picker_swap(picker, picker->position[piece],
+              picker->bucket[picker->max + 1]);
+  picker->bucket[picker->max + 1]++;
+  for (int a = picker->max; a > picker->availability[piece]; a--) {
+    picker_down(picker, piece, a);
+  }
+}
+
+int picker_pick(const torrent_picker *picker, const unsigned char *bitfield) {
+  int end = picker->bucket[picker->max + 1];
+  // pieces nobody has are skipped right away.
+  for (int i = picker->bucket[1]; i < end; i++) {
+    int piece = picker->order[i];
+    if (bitfield[piece / 8] & (0x80 >> (piece % 8))) {
+      return piece;
+    }
+  }
+  return -1;
+}
@@ -0,0 +1,407 @@
+#include "debug.h"
+#include "torrent_internal.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA1_X86 1
+#endif
+
+#define SHA1_BLOCK 64
+#define SHA1_LANES 8
+
+static const uint32_t sha1_init[5] = {0x67452301, 0xefcdab89, 0x98badcfe,
+                                      0x10325476, 0xc3d2e1f0};
+
+// sha1_tail pads the last length % 64 bytes of a message of length bytes
+// into one or two blocks at tail and returns how many.
+static int sha1_tail(unsigned char tail[2 * SHA1_BLOCK],
+                     const unsigned char *data, unsigned long length) {
+  unsigned long rest = length % SHA1_BLOCK;
+  int blocks = rest + 9 > SHA1_BLOCK ? 2 : 1;
+  memset(tail, 0, blocks * SHA1_BLOCK);
+  memcpy(tail, data + length - rest, rest);
+  tail[rest] = 0x80;
+
+  uint64_t bits = (uint64_t)length * 8;
+  for (int i = 0; i < 8; i++) {
+    tail[blocks * SHA1_BLOCK - 1 - i] = bits >> (i * 8);
+  }
+  return blocks;
+}
+
+static void sha1_output(const uint32_t state[5],
+                        uint8_t out[SHA_DIGEST_LENGTH]) {
+  for (int i = 0; i < 5; i++) {
+    out[i * 4] = state[i] >> 24;
+    out[i * 4 + 1] = state[i] >> 16;
+    out[i * 4 + 2] = state[i] >> 8;
+    out[i * 4 + 3] = state[i];
+  }
+}
+
+#ifdef SHA1_X86
+
+// sha1_ni_group runs rounds 4*i to 4*i+3 and schedules the message words
+// further ahead. The message lives in m[0..3], ein takes the next words
+// and eout saves abcd for the group after.
+#define sha1_ni_group(i, ein, eout)                                           \
+  do {                                                                        \
+    __m128i w = m[(i) % 4];                                                   \
+    if ((i) == 0) {                                                           \
+      ein = _mm_add_epi32(ein, w);                                            \
+    } else {                                                                  \
+      ein = _mm_sha1nexte_epu32(ein, w);                                      \
+    }                                                                         \
+    eout = abcd;                                                              \
+    if ((i) >= 3 && (i) <= 18) {                                              \
+      m[((i) + 1) % 4] = _mm_sha1msg2_epu32(m[((i) + 1) % 4], w);             \
+    }                                                                         \
+    abcd = _mm_sha1rnds4_epu32(abcd, ein, (i) / 5);                           \
+    if ((i) >= 1 && (i) <= 16) {                                              \
+      m[((i) + 3) % 4] = _mm_sha1msg1_epu32(m[((i) + 3) % 4], w);             \
+    }                                                                         \
+    if ((i) >= 2 && (i) <= 17) {                                              \
+      m[((i) + 2) % 4] = _mm_xor_si128(m[((i) + 2) % 4], w);                  \
+    }                                                                         \
+  } while (0)
+
+__attribute__((target("sha,sse4.1"), optimize("O2"))) static void
+sha1_ni_blocks(uint32_t state[5], const unsigned char *data,
+               unsigned long blocks) {
+  const __m128i swap =
+      _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+  __m128i abcd = _mm_loadu_si128((const __m128i *)state);
+  abcd = _mm_shuffle_epi32(abcd, 0x1b);
+  __m128i e0 = _mm_set_epi32(state[4], 0, 0, 0);
+  __m128i e1;
+  __m128i m[4];
+
+  for (; blocks > 0; blocks--, data += SHA1_BLOCK) {
+    __m128i abcd_saved = abcd;
+    __m128i e0_saved = e0;
+    for (int i = 0; i < 4; i++) {
+      m[i] = _mm_shuffle_epi8(
+          _mm_loadu_si128((const __m128i *)(data + i * 16)), swap);
+    }
+
+    sha1_ni_group(0, e0, e1);
+    sha1_ni_group(1, e1, e0);
+    sha1_ni_group(2, e0, e1);
+    sha1_ni_group(3, e1, e0);
+    sha1_ni_group(4, e0, e1);
+    sha1_ni_group(5, e1, e0);
+    sha1_ni_group(6, e0, e1);
+    sha1_ni_group(7, e1, e0);
+    sha1_ni_group(8, e0, e1);
+    sha1_ni_group(9, e1, e0);
+    sha1_ni_group(10, e0, e1);
+    sha1_ni_group(11, e1, e0);
+    sha1_ni_group(12, e0, e1);
+    sha1_ni_group(13, e1, e0);
+    sha1_ni_group(14, e0, e1);
+    sha1_ni_group(15, e1, e0);
+    sha1_ni_group(16, e0, e1);
+    sha1_ni_group(17, e1, e0);
+    sha1_ni_group(18, e0, e1);
+    sha1_ni_group(19, e1, e0);
+
+    e0 = _mm_sha1nexte_epu32(e0, e0_saved);
+    abcd = _mm_add_epi32(abcd, abcd_saved);
+  }
+
+  abcd = _mm_shuffle_epi32(abcd, 0x1b);
+  _mm_storeu_si128((__m128i *)state, abcd);
+  state[4] = _mm_extract_epi32(e0, 3);
+}
+
+static void sha1_ni(const unsigned char *data, unsigned long length,
+                    uint8_t out[SHA_DIGEST_LENGTH]) {
+  uint32_t state[5];
+  memcpy(state, sha1_init, sizeof(state));
+  sha1_ni_blocks(state, data, length / SHA1_BLOCK);
+
+  unsigned char tail[2 * SHA1_BLOCK];
+  sha1_ni_blocks(state, tail, sha1_tail(tail, data, length));
+  sha1_output(state, out);
+}
+
+#define rotl8(x, n)                                                           \
+  _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+
+// sha1_x8_load transposes 32 bytes of each lane into one vector per word.
+__attribute__((target("avx2"), optimize("O2"))) static void
+sha1_x8_load(__m256i w[8], const unsigned char *const data[SHA1_LANES],
+             unsigned long offset) {
+  const __m256i swap = _mm256_set_epi8(
+      12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3, 12, 13, 14, 15,
+      8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+  __m256i r[8], t[8], u[8];
+  for (int l = 0; l < 8; l++) {
+    r[l] = _mm256_loadu_si256((const __m256i *)(data[l] + offset));
+  }
+  for (int l = 0; l < 8; l += 2) {
+    t[l] = _mm256_unpacklo_epi32(r[l], r[l + 1]);
+    t[l + 1] = _mm256_unpackhi_epi32(r[l], r[l + 1]);
+  }
+  for (int l = 0; l < 8; l += 4) {
+    u[l] = _mm256_unpacklo_epi64(t[l], t[l + 2]);
+    u[l + 1] = _mm256_unpackhi_epi64(t[l], t[l + 2]);
+    u[l + 2] = _mm256_unpacklo_epi64(t[l + 1], t[l + 3]);
+    u[l + 3] = _mm256_unpackhi_epi64(t[l + 1], t[l + 3]);
+  }
+  for (int i = 0; i < 4; i++) {
+    w[i] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u[i], u[i + 4], 0x20),
+                               swap);
+    w[i + 4] = _mm256_shuffle_epi8(
+        _mm256_permute2x128_si256(u[i], u[i + 4], 0x31), swap);
+  }
+}
+
+// sha1_x8_blocks runs blocks blocks of eight messages at once, one per
+// 32 bit lane. state holds a, b, c, d and e for all lanes.
+__attribute__((target("avx2"), optimize("O2"))) static void
+sha1_x8_blocks(__m256i state[5], const unsigned char *const data[SHA1_LANES],
+               unsigned long blocks) {
+  const __m256i k[4] = {
+      _mm256_set1_epi32(0x5a827999), _mm256_set1_epi32(0x6ed9eba1),
+      _mm256_set1_epi32(0x8f1bbcdc), _mm256_set1_epi32(0xca62c1d6)};
+
+  for (unsigned long n = 0; n < blocks; n++) {
+    __m256i w[16];
+    sha1_x8_load(w, data, n * SHA1_BLOCK);
+    sha1_x8_load(w + 8, data, n * SHA1_BLOCK + 32);
+
+    __m256i a = state[0], b = state[1], c = state[2], d = state[3],
+            e = state[4];
+    for (int i = 0; i < 80; i++) {
+      if (i >= 16) {
+        __m256i x = _mm256_xor_si256(
+            _mm256_xor_si256(w[(i - 3) & 15], w[(i - 8) & 15]),
+            _mm256_xor_si256(w[(i - 14) & 15], w[i & 15]));
+        w[i & 15] = rotl8(x, 1);
+      }
+
+      __m256i f;
+      if (i < 20) {
+        f = _mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d)));
+      } else if (i < 40 || i >= 60) {
+        f = _mm256_xor_si256(b, _mm256_xor_si256(c, d));
+      } else {
+        f = _mm256_or_si256(_mm256_and_si256(b, c),
+                            _mm256_and_si256(d, _mm256_or_si256(b, c)));
+      }
+
+      __m256i temp = _mm256_add_epi32(
+          _mm256_add_epi32(rotl8(a, 5), f),
+          _mm256_add_epi32(_mm256_add_epi32(e, k[i / 20]), w[i & 15]));
+      e = d;
+      d = c;
+      c = rotl8(b, 30);
+      b = a;
+      a = temp;
+    }
+
+    state[0] = _mm256_add_epi32(state[0], a);
+    state[1] = _mm256_add_epi32(state[1], b);
+    state[2] = _mm256_add_epi32(state[2], c);
+    state[3] = _mm256_add_epi32(state[3], d);
+    state[4] = _mm256_add_epi32(state[4], e);
+  }
+}
+
+__attribute__((target("avx2"), optimize("O2"))) static void
+sha1_x8(const unsigned char *const data[SHA1_LANES], unsigned long length,
+        uint8_t out[SHA1_LANES][SHA_DIGEST_LENGTH]) {
+  __m256i state[5];
+  for (int i = 0; i < 5; i++) {
+    state[i] = _mm256_set1_epi32(sha1_init[i]);
+  }
+  sha1_x8_blocks(state, data, length / SHA1_BLOCK);
+
+  // every lane has the same length, so the same number of tail blocks.
+  unsigned char tails[SHA1_LANES][2 * SHA1_BLOCK];
+  const unsigned char *tail[SHA1_LANES];
+  int blocks = 0;
+  for (int l = 0; l < SHA1_LANES; l++) {
+    blocks = sha1_tail(tails[l], data[l], length);
+    tail[l] = tails[l];
+  }
+  sha1_x8_blocks(state, tail, blocks);
+
+  uint32_t words[5][SHA1_LANES];
+  for (int i = 0; i < 5; i++) {
+    _mm256_storeu_si256((__m256i *)words[i], state[i]);
+  }
+  for (int l = 0; l < SHA1_LANES; l++) {
+    uint32_t lane[5];
+    for (int i = 0; i < 5; i++) {
+      lane[i] = words[i][l];
+    }
+    sha1_output(lane, out[l]);
+  }
+}
+
+#endif
+
+static int sha1_has_ni;
+static int sha1_has_avx2;
+static pthread_once_t sha1_once = PTHREAD_ONCE_INIT;
+
+// the kernels TORRENT_SHA1_AUTO runs, picked by sha1_calibrate: one for
+// full batches of eight messages and one for the messages left over.
+static TSha1Kernel sha1_batch = TORRENT_SHA1_OPENSSL;
+static TSha1Kernel sha1_single = TORRENT_SHA1_OPENSSL;
+
+static void sha1_many(TSha1Kernel kernel, const unsigned char *const *data,
+                      int count, unsigned long length,
+                      uint8_t (*out)[SHA_DIGEST_LENGTH]) {
+#ifdef SHA1_X86
+  if (kernel == TORRENT_SHA1_NI && sha1_has_ni) {
+    for (int i = 0; i < count; i++) {
+      sha1_ni(data[i], length, out[i]);
+    }
+    return;
+  }
+
+  // a batch with fewer than eight messages repeats the first one in the
+  // lanes left, their hashes are thrown away.
+  if (kernel == TORRENT_SHA1_AVX2 && sha1_has_avx2) {
+    for (int i = 0; i < count; i += SHA1_LANES) {
+      const unsigned char *lanes[SHA1_LANES];
+      uint8_t hashes[SHA1_LANES][SHA_DIGEST_LENGTH];
+      int n = count - i < SHA1_LANES ? count - i : SHA1_LANES;
+      for (int l = 0; l < SHA1_LANES; l++) {
+        lanes[l] = data[i + (l < n ? l : 0)];
+      }
+      sha1_x8(lanes, length, hashes);
+      memcpy(out[i], hashes, n * SHA_DIGEST_LENGTH);
+    }
+    return;
+  }
+#endif
+
+  for (int i = 0; i < count; i++) {
+    SHA1(data[i], length, out[i]);
+  }
+}
+
+#define SHA1_SAMPLE (16 * 1024)
+#define SHA1_ROUNDS 3
+
+static double sha1_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// sha1_calibrate times every kernel the CPU has on a batch of eight
+// messages and keeps the fastest. Which one wins depends on the CPU and on
+// how the kernels were compiled, OpenSSL and sha1_ni are close everywhere
+// they were measured. The rounds are interleaved and the best of each
+// kept, so a burst of noise does not decide it.
+static void sha1_calibrate(void) {
+  unsigned char *sample = calloc(SHA1_LANES, SHA1_SAMPLE);
+  if (sample == NULL) {
+    return;
+  }
+  const unsigned char *data[SHA1_LANES];
+  for (int l = 0; l < SHA1_LANES; l++) {
+    data[l] = sample + l * SHA1_SAMPLE;
+  }
+
+  const TSha1Kernel kernels[] = {TORRENT_SHA1_OPENSSL, TORRENT_SHA1_NI,
+                                 TORRENT_SHA1_AVX2};
+  const int supported[] = {1, sha1_has_ni, sha1_has_avx2};
+  double best[3] = {0, 0, 0};
+  for (int round = 0; round < SHA1_ROUNDS; round++) {
+    for (int k = 0; k < 3; k++) {
+      if (!supported[k]) {
+        continue;
+      }
+      uint8_t out[SHA1_LANES][SHA_DIGEST_LENGTH];
+      double begin = sha1_seconds();
+      sha1_many(kernels[k], data, SHA1_LANES, SHA1_SAMPLE, out);
+      double s = sha1_seconds() - begin;
+      if (round == 0 || s < best[k]) {
+        best[k] = s;
+      }
+    }
+  }
+  free(sample);
+
+  // messages left over from the batches do not fill the lanes, so only
+  // the one at a time kernels are candidates for them.
+  double single = best[0];
+  if (sha1_has_ni && best[1] < single) {
+    sha1_single = TORRENT_SHA1_NI;
+    single = best[1];
+  }
+  sha1_batch = sha1_has_avx2 && best[2] < single ? TORRENT_SHA1_AVX2
+                                                 : sha1_single;
+}
+
+static void sha1_detect(void) {
+#ifdef SHA1_X86
+  unsigned int a, b, c, d;
+  if (!__get_cpuid(1, &a, &b, &c, &d)) {
+    return;
+  }
+  int sse41 = (c & bit_SSE4_1) && (c & bit_SSSE3);
+  int osxsave = c & bit_OSXSAVE;
+  if (!__get_cpuid_count(7, 0, &a, &b, &c, &d)) {
+    return;
+  }
+  sha1_has_ni = sse41 && (b & bit_SHA);
+
+  // the ymm registers also need to be saved by the kernel.
+  if (osxsave && (b & bit_AVX2)) {
+    unsigned int lo, hi;
+    __asm__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    sha1_has_avx2 = (lo & 6) == 6;
+  }
+#endif
+  if (sha1_has_ni || sha1_has_avx2) {
+    sha1_calibrate();
+  }
+}
+
+int torrent_sha1_supported(TSha1Kernel kernel) {
+  pthread_once(&sha1_once, sha1_detect);
+  switch (kernel) {
+  case TORRENT_SHA1_AUTO:
+  case TORRENT_SHA1_OPENSSL:
+    return 1;
+  case TORRENT_SHA1_NI:
+    return sha1_has_ni;
+  case TORRENT_SHA1_AVX2:
+    return sha1_has_avx2;
+  }
+  return 0;
+}
+
+void torrent_sha1_many(TSha1Kernel kernel, const unsigned char *const *data,
+                       int count, unsigned long length,
+                       uint8_t (*out)[SHA_DIGEST_LENGTH]) {
+  pthread_once(&sha1_once, sha1_detect);
+  if (kernel == TORRENT_SHA1_AUTO) {
+    int batched = count / SHA1_LANES * SHA1_LANES;
+    sha1_many(sha1_batch, data, batched, length, out);
+    data += batched;
+    out += batched;
+    count -= batched;
+    kernel = sha1_single;
+  }
+  sha1_many(kernel, data, count, length, out);
+}
+
+void torrent_sha1(const unsigned char *data, unsigned long length,
+                  uint8_t out[SHA_DIGEST_LENGTH]) {
+  // a single message gets no help from the lanes.
+  pthread_once(&sha1_once, sha1_detect);
+  sha1_many(sha1_single, &data, 1, length, (uint8_t(*)[SHA_DIGEST_LENGTH])out);
+}
@@ -0,0 +1,258 @@
+#include "debug.h"
+#include "torrent_internal.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// STORAGE_IOV_MAX is the most iovecs Linux takes in one call (UIO_MAXIOV).
+#define STORAGE_IOV_MAX 1024
+
+// storage_find_extent returns the extent holding offset of the torrent
+// data. offset has to be less than the total length.
+static int storage_find_extent(THandle handle, unsigned long offset) {
+  int lo = 0;
+  int hi = handle->no_of_extents - 1;
+  while (lo < hi) {
+    int mid = lo + (hi - lo + 1) / 2;
+    if (handle->extents[mid].offset <= offset) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return lo;
+}
+
+// storage_position turns a (piece, begin, length) range into an offset of
+// the torrent data, or returns -1 when it does not lie within the torrent.
+static int storage_position(THandle handle, int piece, unsigned long begin,
+                            unsigned long length, unsigned long *offset) {
+  const TInfo *info = &handle->info;
+  if (piece < 0 || piece >= info->no_of_piece_hashes ||
+      begin > info->length) {
+    return -1;
+  }
+
+  unsigned long start = (unsigned long)piece * info->piece_length;
+  if (start > info->length - begin || length > info->length - start - begin) {
+    return -1;
+  }
+
+  *offset = start + begin;
+  return 0;
+}
+
+int torrent_map_extents(THandle handle, int piece, unsigned long begin,
+                        unsigned long length, TExtent *extents,
+                        int max_extents) {
+  unsigned long offset;
+  if (storage_position(handle, piece, begin, length, &offset) == -1) {
+    return -1;
+  }
+
+  if (length == 0) {
+    return 0;
+  }
+
+  int n = 0;
+  for (int i = storage_find_extent(handle, offset); length > 0; i++) {
+    if (n == max_extents) {
+      return -1;
+    }
+
+    const torrent_extent *e = &handle->extents[i];
+    unsigned long skip = offset - e->offset;
+    unsigned long size = e->length - skip;
+    if (size > length) {
+      size = length;
+    }
+
+    extents[n].file = e->file;
+    extents[n].offset = skip;
+    extents[n].length = size;
+    n++;
+
+    offset += size;
+    length -= size;
+  }
+
+  return n;
+}
+
+// storage_mkdirs creates the parent directories of path.
+static int storage_mkdirs(char *path) {
+  for (char *p = strchr(path + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+    *p = '\0';
+    int err = mkdir(path, 0755);
+    *p = '/';
+    if (err == -1 && errno != EEXIST) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+char *torrent_storage_path(THandle handle, const char *path, int file) {
+  const TInfo *info = &handle->info;
+  size_t size = strlen(path) + strlen(info->files[file].path) + 2;
+  char *file_path = malloc(size);
+  assert(file_path);
+  // a single file torrent is stored at path, otherwise path is the
+  // directory that stands in for the torrent name.
+  if (handle->multi_file) {
+    snprintf(file_path, size, "%s/%s", path, info->files[file].path);
+  } else {
+    snprintf(file_path, size, "%s", path);
+  }
+  return file_path;
+}
+
+int torrent_storage_open(THandle handle, const char *path) {
+  const TInfo *info = &handle->info;
+  if (handle->fds != NULL) {
+    fprintf(stderr, "storage already open\n");
+    return -1;
+  }
+
+  int *fds = malloc(info->no_of_files * sizeof(int));
+  assert(fds);
+
+  for (int i = 0; i < info->no_of_files; i++) {
+    char *file_path = torrent_storage_path(handle, path, i);
+    int fd = -1;
+    if (storage_mkdirs(file_path) == 0) {
+      fd = open(file_path, O_RDWR | O_CREAT, 0644);
+    }
+    // files are sized up front so reads of missing pieces see zeroes and
+    // writes never have to extend them.
+    if (fd >= 0 && ftruncate(fd, info->files[i].length) == -1) {
+      close(fd);
+      fd = -1;
+    }
+    if (fd < 0) {
+      perror(file_path);
+      free(file_path);
+      for (int j = 0; j < i; j++) {
+        close(fds[j]);
+      }
+      free(fds);
+      return -1;
+    }
+
+    free(file_path);
+    fds[i] = fd;
+  }
+
+  handle->fds = fds;
+  return 0;
+}
+
+// storage_transfer runs preadv or pwritev until all of iov was moved, the
+// kernel is allowed to move less than asked for.
+static int storage_transfer(int fd, struct iovec *iov, int iovcnt,
+                            off_t offset, int writing) {
+  while (iovcnt > 0) {
+    int count = iovcnt < STORAGE_IOV_MAX ? iovcnt : STORAGE_IOV_MAX;
+    ssize_t n = writing ? pwritev(fd, iov, count, offset)
+                      : preadv(fd, iov, count, offset);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+
+    offset += n;
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+static long storage_rw(THandle handle, int piece, unsigned long begin,
+                       const struct iovec *iov, int iovcnt, int writing) {
+  if (handle->fds == NULL) {
+    fprintf(stderr, "storage is not open\n");
+    return -1;
+  }
+
+  unsigned long length = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    length += iov[i].iov_len;
+  }
+
+  unsigned long offset;
+  if (storage_position(handle, piece, begin, length, &offset) == -1) {
+    fprintf(stderr, "range outside of the torrent\n");
+    return -1;
+  }
+
+  // the slice of iov that falls into one file, rebuilt for every file.
+  struct iovec *slice = malloc((iovcnt > 0 ? iovcnt : 1) * sizeof(*slice));
+  assert(slice);
+
+  int v = 0;
+  size_t v_offset = 0;
+  unsigned long left = length;
+  for (int i = length > 0 ? storage_find_extent(handle, offset) : 0;
+       left > 0; i++) {
+    const torrent_extent *e = &handle->extents[i];
+    unsigned long file_offset = offset - e->offset;
+    unsigned long size = e->length - file_offset;
+    if (size > left) {
+      size = left;
+    }
+
+    int n = 0;
+    for (unsigned long taken = 0; taken < size; n++) {
+      size_t chunk = iov[v].iov_len - v_offset;
+      if (chunk > size - taken) {
+        chunk = size - taken;
+      }
+      slice[n].iov_base = (char *)iov[v].iov_base + v_offset;
+      slice[n].iov_len = chunk;
+      taken += chunk;
+      v_offset += chunk;
+      if (v_offset == iov[v].iov_len) {
+        v++;
+        v_offset = 0;
+      }
+    }
+
+    if (storage_transfer(handle->fds[e->file], slice, n, file_offset,
+                         writing) == -1) {
+      perror(writing ? "pwritev" : "preadv");
+      free(slice);
+      return -1;
+    }
+
+    offset += size;
+    left -= size;
+  }
+
+  free(slice);
+  return length;
+}
+
+long torrent_storage_writev(THandle handle, int piece, unsigned long begin,
+                            const struct iovec *iov, int iovcnt) {
+  return storage_rw(handle, piece, begin, iov, iovcnt, 1);
+}
+
+long torrent_storage_readv(THandle handle, int piece, unsigned long begin,
+                           const struct iovec *iov, int iovcnt) {
+  return storage_rw(handle, piece, begin, iov, iovcnt, 0);
+}
@@ -0,0 +1,307 @@
+#include "debug.h"
+#include "torrent_internal.h"
+#include <assert.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// liburing is not around everywhere, the few calls needed are made by hand.
+
+// URING_SUBMIT_TRIES is how often a full submission queue is handed to the
+// kernel before giving up on a new entry.
+#define URING_SUBMIT_TRIES 8
+
+static int uring_setup(unsigned entries, struct io_uring_params *params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                       unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                 NULL, 0);
+}
+
+int uring_register_buffers(torrent_uring *ring, const struct iovec *iov,
+                           int count) {
+  return syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS,
+                 iov, count);
+}
+
+int uring_init(torrent_uring *ring, unsigned entries) {
+  memset(ring, 0, sizeof(*ring));
+
+  struct io_uring_params params = {0};
+  int fd = uring_setup(entries, &params);
+  if (fd == -1) {
+    return -1;
+  }
+
+  ring->fd = fd;
+  ring->sq_ring_size =
+      params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  // newer kernels map both rings with one mmap.
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_size > ring->sq_ring_size) {
+      ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) {
+    ring->sq_ring = NULL;
+    uring_free(ring);
+    return -1;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_ring = ring->sq_ring;
+  } else {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) {
+      ring->cq_ring = NULL;
+      uring_free(ring);
+      return -1;
+    }
+  }
+
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    uring_free(ring);
+    return -1;
+  }
+
+  unsigned char *sq = ring->sq_ring;
+  unsigned char *cq = ring->cq_ring;
+  ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_entries = params.sq_entries;
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  ring->tail = *ring->sq_tail;
+  return 0;
+}
+
+void uring_free(torrent_uring *ring) {
+  if (ring->sqes != NULL) {
+    munmap(ring->sqes, ring->sqes_size);
+  }
+  if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) {
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  }
+  if (ring->sq_ring != NULL) {
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  }
+  if (ring->fd > 0) {
+    close(ring->fd);
+  }
+  free(ring->backlog);
+  memset(ring, 0, sizeof(*ring));
+}
+
+// uring_stash moves every completion waiting in the completion queue to
+// the backlog, the kernel refuses submissions while it has no room.
+static void uring_stash(torrent_uring *ring) {
+  unsigned head = *ring->cq_head;
+  unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    if (ring->backlog_head + ring->backlog_length ==
+        ring->backlog_capacity) {
+      // the backlog is drained from its head, slide it down first.
+      memmove(ring->backlog, ring->backlog + ring->backlog_head,
+              ring->backlog_length * sizeof(*ring->backlog));
+      ring->backlog_head = 0;
+    }
+    if (ring->backlog_length == ring->backlog_capacity) {
+      ring->backlog_capacity =
+          ring->backlog_capacity > 0 ? ring->backlog_capacity * 2 : 64;
+      ring->backlog = realloc(ring->backlog,
+                              ring->backlog_capacity * sizeof(*ring->backlog));
+      assert(ring->backlog);
+    }
+
+    const struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+    int i = ring->backlog_head + ring->backlog_length++;
+    ring->backlog[i].data = cqe->user_data;
+    ring->backlog[i].res = cqe->res;
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static struct io_uring_sqe *uring_get_sqe(torrent_uring *ring) {
+  // a full queue is handed to the kernel right away to make room, with
+  // the completions it may be blocked on moved out of its way.
+  for (int tries = 0;
+       ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) ==
+       ring->sq_entries;
+       tries++) {
+    if (tries == URING_SUBMIT_TRIES) {
+      errno = EBUSY;
+      return NULL;
+    }
+    uring_stash(ring);
+    if (uring_submit(ring, 0) == -1) {
+      return NULL;
+    }
+  }
+
+  unsigned index = ring->tail & ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[index] = index;
+  ring->tail++;
+  return sqe;
+}
+
+int uring_submit(torrent_uring *ring, unsigned wait) {
+  // completions in the backlog are there to be handled already.
+  if (ring->backlog_length > 0) {
+    wait = 0;
+  }
+  __atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+  unsigned to_submit =
+      ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+  for (;;) {
+    int n = uring_enter(ring->fd, to_submit, wait,
+                        wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+    if (n >= 0) {
+      return n;
+    }
+    // EBUSY means completions have to be reaped before more go in.
+    if (errno == EBUSY) {
+      return 0;
+    }
+    if (errno != EINTR) {
+      return -1;
+    }
+    if (wait > 0 && *ring->cq_head != __atomic_load_n(ring->cq_tail,
+                                                       __ATOMIC_ACQUIRE)) {
+      return 0;
+    }
+  }
+}
+
+int uring_complete(torrent_uring *ring, uint64_t *data, int *res) {
+  if (ring->backlog_length > 0) {
+    *data = ring->backlog[ring->backlog_head].data;
+    *res = ring->backlog[ring->backlog_head].res;
+    ring->backlog_length--;
+    ring->backlog_head = ring->backlog_length > 0 ? ring->backlog_head + 1 : 0;
+    return 1;
+  }
+
+  unsigned head = *ring->cq_head;
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
+  const struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+  *data = cqe->user_data;
+  *res = cqe->res;
+  __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+int uring_readv(torrent_uring *ring, int fd, const struct iovec *iov,
+                int count, uint64_t data) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  if (sqe == NULL) {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_READV;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t)iov;
+  sqe->len = count;
+  sqe->user_data = data;
+  return 0;
+}
+
+int uring_send(torrent_uring *ring, int fd, const void *buffer, size_t size,
+               uint64_t data) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  if (sqe == NULL) {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t)buffer;
+  sqe->len = size;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = data;
+  return 0;
+}
+
+int uring_connect(torrent_uring *ring, int fd,
+                  const struct sockaddr_in *addr, uint64_t data) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  if (sqe == NULL) {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_CONNECT;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t)addr;
+  // the address length goes where file operations keep their offset.
+  sqe->off = sizeof(*addr);
+  sqe->user_data = data;
+  return 0;
+}
+
+int uring_write(torrent_uring *ring, int fd, const void *buffer, size_t size,
+                unsigned long offset, int buffer_index, uint64_t data) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  if (sqe == NULL) {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_WRITE;
+  if (buffer_index != -1) {
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->buf_index = buffer_index;
+  }
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t)buffer;
+  sqe->len = size;
+  sqe->off = offset;
+  sqe->user_data = data;
+  return 0;
+}
+
+int uring_timeout(torrent_uring *ring, unsigned seconds, uint64_t data) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  if (sqe == NULL) {
+    return -1;
+  }
+  ring->timeout[0] = seconds;
+  ring->timeout[1] = 0;
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->addr = (uintptr_t)ring->timeout;
+  sqe->len = 1;
+  sqe->user_data = data;
+  return 0;
+}
+
+int uring_cancel(torrent_uring *ring, uint64_t target, int timeout,
+                 uint64_t data) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  if (sqe == NULL) {
+    return -1;
+  }
+  sqe->opcode = timeout ? IORING_OP_TIMEOUT_REMOVE : IORING_OP_ASYNC_CANCEL;
+  sqe->addr = target;
+  sqe->user_data = data;
+  return 0;
+}
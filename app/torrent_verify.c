@@ -0,0 +1,291 @@
+#include "debug.h"
+#include "torrent_internal.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// VERIFY_BATCH pieces are taken at a time, one byte of the bitfield, so
+// workers never share a byte and the hash kernels get full batches.
+#define VERIFY_BATCH 8
+// VERIFY_READAHEAD is how far ahead of the pieces being hashed the kernel
+// is asked to read.
+#define VERIFY_READAHEAD (64UL << 20)
+
+typedef struct {
+  // data maps the first size bytes of the file, NULL if it is missing.
+  unsigned char *data;
+  unsigned long size;
+} verify_file;
+
+typedef struct {
+  THandle handle;
+  verify_file *files;
+  uint8_t *bitfield;
+  int next;
+  int checked;
+  int good;
+  unsigned long hashed;
+  // finished counts the workers out of pieces, signalling done.
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  int finished;
+} verify_job;
+
+static double verify_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// verify_extents resolves a piece to its extents. It returns how many or
+// -1 if some of its bytes are not on disk.
+static int verify_extents(const verify_job *job, int piece, TExtent *extents,
+                          int max_extents) {
+  const TInfo *info = &job->handle->info;
+  int n = torrent_map_extents(job->handle, piece, 0,
+                              torrent_piece_length(info, piece), extents,
+                              max_extents);
+  for (int i = 0; i < n; i++) {
+    const verify_file *f = &job->files[extents[i].file];
+    if (f->data == NULL || extents[i].offset + extents[i].length > f->size) {
+      return -1;
+    }
+  }
+  return n;
+}
+
+// verify_advise asks the kernel to start reading the pieces from first on.
+static void verify_advise(const verify_job *job, int first, TExtent *extents,
+                          int max_extents) {
+  long page = sysconf(_SC_PAGESIZE);
+  int last = first + VERIFY_BATCH;
+  if (last > job->handle->info.no_of_piece_hashes) {
+    last = job->handle->info.no_of_piece_hashes;
+  }
+
+  for (int piece = first; piece < last; piece++) {
+    int n = verify_extents(job, piece, extents, max_extents);
+    for (int i = 0; i < n; i++) {
+      unsigned long start = extents[i].offset / page * page;
+      unsigned long end = extents[i].offset + extents[i].length;
+      madvise(job->files[extents[i].file].data + start, end - start,
+              MADV_WILLNEED);
+    }
+  }
+}
+
+// verify_spanning hashes a piece that is split over several files.
+static void verify_spanning(const verify_job *job, const TExtent *extents,
+                            int n, uint8_t hash[SHA_DIGEST_LENGTH]) {
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+  assert(ctx);
+  EVP_DigestInit_ex(ctx, EVP_sha1(), NULL);
+  for (int i = 0; i < n; i++) {
+    EVP_DigestUpdate(ctx, job->files[extents[i].file].data + extents[i].offset,
+                     extents[i].length);
+  }
+  EVP_DigestFinal_ex(ctx, hash, NULL);
+  EVP_MD_CTX_free(ctx);
+}
+
+static void *verify_worker(void *arg) {
+  verify_job *job = arg;
+  const TInfo *info = &job->handle->info;
+  int pieces = info->no_of_piece_hashes;
+  int ahead = (VERIFY_READAHEAD + info->piece_length - 1) / info->piece_length;
+  ahead = (ahead + VERIFY_BATCH - 1) / VERIFY_BATCH * VERIFY_BATCH;
+
+  // a piece can not touch more files than the torrent has.
+  int max_extents = info->no_of_files + 1;
+  TExtent *extents = malloc(max_extents * sizeof(TExtent));
+  assert(extents);
+
+  for (;;) {
+    int first = __atomic_fetch_add(&job->next, VERIFY_BATCH, __ATOMIC_RELAXED);
+    if (first >= pieces) {
+      break;
+    }
+    int last = first + VERIFY_BATCH < pieces ? first + VERIFY_BATCH : pieces;
+    if (first + ahead < pieces) {
+      verify_advise(job, first + ahead, extents, max_extents);
+    }
+
+    // whole pieces inside one file go through the kernels together, the
+    // rest one at a time.
+    const unsigned char *data[VERIFY_BATCH];
+    int batch[VERIFY_BATCH];
+    uint8_t hashes[VERIFY_BATCH][SHA_DIGEST_LENGTH];
+    int n = 0;
+    uint8_t bits = 0;
+    unsigned long hashed = 0;
+    for (int piece = first; piece < last; piece++) {
+      unsigned long length = torrent_piece_length(info, piece);
+      int count = verify_extents(job, piece, extents, max_extents);
+      if (count == -1) {
+        continue;
+      }
+      hashed += length;
+
+      const unsigned char *start =
+          count > 0 ? job->files[extents[0].file].data + extents[0].offset
+                    : NULL;
+      uint8_t hash[SHA_DIGEST_LENGTH];
+      if (count == 1 && length == info->piece_length) {
+        data[n] = start;
+        batch[n++] = piece;
+        continue;
+      } else if (count == 1) {
+        torrent_sha1(start, length, hash);
+      } else {
+        verify_spanning(job, extents, count, hash);
+      }
+      if (memcmp(hash, info->pieces[piece], SHA_DIGEST_LENGTH) == 0) {
+        bits |= 0x80 >> (piece % 8);
+      }
+    }
+
+    torrent_sha1_many(TORRENT_SHA1_AUTO, data, n, info->piece_length, hashes);
+    for (int i = 0; i < n; i++) {
+      if (memcmp(hashes[i], info->pieces[batch[i]], SHA_DIGEST_LENGTH) == 0) {
+        bits |= 0x80 >> (batch[i] % 8);
+      }
+    }
+
+    job->bitfield[first / 8] = bits;
+    __atomic_fetch_add(&job->good, __builtin_popcount(bits),
+                       __ATOMIC_RELAXED);
+    __atomic_fetch_add(&job->checked, last - first, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&job->hashed, hashed, __ATOMIC_RELAXED);
+  }
+
+  free(extents);
+  pthread_mutex_lock(&job->lock);
+  job->finished++;
+  pthread_cond_signal(&job->done);
+  pthread_mutex_unlock(&job->lock);
+  return NULL;
+}
+
+// verify_map maps the files found below path, missing ones are left out.
+// The sizes are taken once, a file truncated afterwards faults the workers
+// with SIGBUS.
+static void verify_map(THandle handle, const char *path, verify_file *files) {
+  const TInfo *info = &handle->info;
+  for (int i = 0; i < info->no_of_files; i++) {
+    char *file_path = torrent_storage_path(handle, path, i);
+    int fd = open(file_path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+      perror(file_path);
+      if (fd != -1) {
+        close(fd);
+      }
+      free(file_path);
+      continue;
+    }
+
+    unsigned long size = st.st_size;
+    if (size > info->files[i].length) {
+      size = info->files[i].length;
+    }
+    if (size > 0) {
+      void *data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+      if (data == MAP_FAILED) {
+        perror(file_path);
+      } else {
+        // pieces are claimed in order, the whole file is read front to
+        // back.
+        madvise(data, size, MADV_SEQUENTIAL);
+        files[i].data = data;
+        files[i].size = size;
+      }
+    }
+    close(fd);
+    free(file_path);
+  }
+}
+
+int torrent_verify(THandle handle, const char *path, int workers,
+                   uint8_t *bitfield) {
+  const TInfo *info = &handle->info;
+  int pieces = info->no_of_piece_hashes;
+  memset(bitfield, 0, (pieces + 7) / 8);
+
+  if (workers <= 0) {
+    workers = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  int batches = (pieces + VERIFY_BATCH - 1) / VERIFY_BATCH;
+  if (workers > batches) {
+    workers = batches > 0 ? batches : 1;
+  }
+
+  verify_job job = {
+      .handle = handle,
+      .files = calloc(info->no_of_files > 0 ? info->no_of_files : 1,
+                      sizeof(verify_file)),
+      .bitfield = bitfield,
+  };
+  assert(job.files);
+  pthread_mutex_init(&job.lock, NULL);
+  pthread_cond_init(&job.done, NULL);
+  verify_map(handle, path, job.files);
+
+  double started = verify_now();
+  pthread_t threads[workers];
+  int started_workers = 0;
+  for (; started_workers < workers; started_workers++) {
+    if (pthread_create(&threads[started_workers], NULL, verify_worker, &job) !=
+        0) {
+      perror("pthread_create");
+      break;
+    }
+  }
+
+  // progress once a second until every worker is out of pieces.
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec++;
+  pthread_mutex_lock(&job.lock);
+  while (job.finished < started_workers) {
+    if (pthread_cond_timedwait(&job.done, &job.lock, &deadline) != ETIMEDOUT) {
+      continue;
+    }
+    deadline.tv_sec++;
+    unsigned long hashed = __atomic_load_n(&job.hashed, __ATOMIC_RELAXED);
+    fprintf(stderr, "checked %d/%d pieces, %.1f MB/s\n",
+            __atomic_load_n(&job.checked, __ATOMIC_RELAXED), pieces,
+            hashed / (verify_now() - started) / 1e6);
+  }
+  pthread_mutex_unlock(&job.lock);
+  for (int i = 0; i < started_workers; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  double elapsed = verify_now() - started;
+  fprintf(stderr, "checked %d pieces, %.1f MB in %.2f s, %.1f MB/s\n", pieces,
+          job.hashed / 1e6, elapsed,
+          elapsed > 0 ? job.hashed / elapsed / 1e6 : 0);
+
+  for (int i = 0; i < info->no_of_files; i++) {
+    if (job.files[i].data != NULL) {
+      munmap(job.files[i].data, job.files[i].size);
+    }
+  }
+  free(job.files);
+  pthread_mutex_destroy(&job.lock);
+  pthread_cond_destroy(&job.done);
+
+  // the workers that did start took every batch between them.
+  if (started_workers == 0 && pieces > 0) {
+    return -1;
+  }
+  return job.good;
+}
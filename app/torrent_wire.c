@@ -0,0 +1,209 @@
+#include "debug.h"
+#include "torrent_internal.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#define WIRE_READER_SIZE (1 << 16)
+
+size_t torrent_max_message(const TInfo *info) {
+  size_t piece = 1 + sizeof(piece_response) + BLOCK_SIZE;
+  size_t bitfield = 1 + (info->no_of_piece_hashes + 7) / 8;
+  return piece > bitfield ? piece : bitfield;
+}
+
+void wire_reader_init(wire_reader *r, size_t max_length) {
+  memset(r, 0, sizeof(*r));
+  r->max_length = max_length;
+  r->split_id = -1;
+
+  // a whole message plus its length prefix always fits.
+  r->size = WIRE_READER_SIZE;
+  while (r->size < max_length + 4) {
+    r->size *= 2;
+  }
+  r->data = malloc(r->size);
+  r->scratch = malloc(max_length + 4);
+  assert(r->data && r->scratch);
+}
+
+void wire_reader_free(wire_reader *r) {
+  free(r->data);
+  free(r->scratch);
+  memset(r, 0, sizeof(*r));
+}
+
+size_t wire_reader_buffered(const wire_reader *r) { return r->tail - r->head; }
+
+void wire_reader_split(wire_reader *r, int id, size_t header) {
+  assert(header <= WIRE_HEADER_MAX);
+  r->split_id = id;
+  r->split_header = header;
+}
+
+// wire_reader_peek returns size bytes at offset from the head, contiguous.
+// Bytes that wrap around the end of the ring are copied to scratch.
+static const unsigned char *wire_reader_peek(wire_reader *r, size_t offset,
+                                             size_t size) {
+  size_t start = (r->head + offset) & (r->size - 1);
+  if (start + size <= r->size) {
+    return r->data + start;
+  }
+
+  size_t first = r->size - start;
+  memcpy(r->scratch, r->data + start, first);
+  memcpy(r->scratch + first, r->data, size - first);
+  return r->scratch;
+}
+
+// wire_reader_take moves size buffered bytes to out.
+static void wire_reader_take(wire_reader *r, void *out, size_t size) {
+  size_t start = r->head & (r->size - 1);
+  size_t first = r->size - start;
+  if (first > size) {
+    first = size;
+  }
+  memcpy(out, r->data + start, first);
+  memcpy((unsigned char *)out + first, r->data, size - first);
+  r->head += size;
+}
+
+int wire_reader_prepare(wire_reader *r, struct iovec iov[3]) {
+  size_t free_space = r->size - (r->tail - r->head);
+
+  // the rest of a split message's body goes first, then the free space of
+  // the ring, which wraps around its end at most once. One readv fills all,
+  // so reads stay large and only the body bytes still missing when its
+  // header was handed out skip the ring.
+  int count = 0;
+  if (r->direct_left > 0) {
+    iov[count++] = (struct iovec){r->direct, r->direct_left};
+  }
+  size_t start = r->tail & (r->size - 1);
+  size_t first = r->size - start;
+  if (first > free_space) {
+    first = free_space;
+  }
+  if (first > 0) {
+    iov[count++] = (struct iovec){r->data + start, first};
+  }
+  if (free_space > first) {
+    iov[count++] = (struct iovec){r->data, free_space - first};
+  }
+
+  return count;
+}
+
+void wire_reader_commit(wire_reader *r, size_t n) {
+  size_t body = n < r->direct_left ? n : r->direct_left;
+  r->direct += body;
+  r->direct_left -= body;
+  if (body > 0 && r->direct_left == 0) {
+    r->direct_done = 1;
+  }
+  r->tail += n - body;
+}
+
+ssize_t wire_reader_fill(wire_reader *r, int fd) {
+  struct iovec iov[3];
+  int count = wire_reader_prepare(r, iov);
+  if (count == 0) {
+    errno = ENOBUFS;
+    return -1;
+  }
+
+  ssize_t n = readv(fd, iov, count);
+  if (n > 0) {
+    wire_reader_commit(r, n);
+  }
+  return n;
+}
+
+int wire_reader_read(wire_reader *r, void *out, size_t size) {
+  if (wire_reader_buffered(r) < size) {
+    return -1;
+  }
+  wire_reader_take(r, out, size);
+  return 0;
+}
+
+int wire_reader_next(wire_reader *r, wire_message *m) {
+  if (r->direct_left > 0) {
+    return 0;
+  }
+  if (r->direct_done) {
+    r->direct_done = 0;
+    *m = r->split;
+    return 1;
+  }
+
+  for (;;) {
+    if (wire_reader_buffered(r) < 4) {
+      return 0;
+    }
+
+    uint32_t length;
+    memcpy(&length, wire_reader_peek(r, 0, 4), 4);
+    length = ltob(length);
+    if (length > r->max_length) {
+      return -1;
+    }
+    size_t buffered = wire_reader_buffered(r);
+    if (buffered < 4 + (size_t)length) {
+      // a split message is handed out once its header is in.
+      if (r->split_id < 0 || length < 1 + r->split_header ||
+          buffered < 5 + r->split_header ||
+          wire_reader_peek(r, 4, 1)[0] != r->split_id) {
+        return 0;
+      }
+      r->head += 5;
+      wire_reader_take(r, r->header, r->split_header);
+      r->split = (wire_message){
+          .id = r->split_id, .size = length - 1, .payload = r->header};
+      *m = r->split;
+      return WIRE_SPLIT;
+    }
+
+    // keep-alives have no id and are consumed right here.
+    if (length == 0) {
+      r->head += 4;
+      continue;
+    }
+
+    const unsigned char *message = wire_reader_peek(r, 4, length);
+    m->id = message[0];
+    m->direct = 0;
+    m->payload = message + 1;
+    m->size = length - 1;
+    r->head += 4 + length;
+    return 1;
+  }
+}
+
+void wire_reader_direct(wire_reader *r, void *dest) {
+  size_t header = r->split_header;
+  size_t body = r->split.size - header;
+  unsigned char *to = dest;
+  r->split.direct = dest != NULL;
+
+  // without a destination the message is put together in scratch and
+  // handed out like any other.
+  if (dest == NULL) {
+    memcpy(r->scratch, r->header, header);
+    to = r->scratch + header;
+    r->split.payload = r->scratch;
+  }
+
+  // whatever part of the body came with the header is already buffered.
+  size_t buffered = wire_reader_buffered(r);
+  if (buffered > body) {
+    buffered = body;
+  }
+  wire_reader_take(r, to, buffered);
+
+  r->direct = to + buffered;
+  r->direct_left = body - buffered;
+  r->direct_done = r->direct_left == 0;
+}
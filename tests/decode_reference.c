@@ -0,0 +1,314 @@
+// decode_reference times the recursive decoder bencode.c had before
+// decode_bencode_n, kept here as it was so decode_bench has something to
+// compare against. It decodes a file written by decode_bench's output
+// argument:
+//
+//   ./your_bittorrent.sh decode_bench 150000 20000 10 /tmp/bench.torrent
+//   gcc tests/decode_reference.c -o /tmp/decode_reference
+//   /tmp/decode_reference /tmp/bench.torrent 1
+//
+// The old decoder needs a NUL terminated input and calls strlen on it for
+// every list and dict entry, so keep rounds low for large files.
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+enum ref_type {
+  REF_INVALID = 0,
+  REF_STRING = 1,
+  REF_INTEGER = 2,
+  REF_LIST = 3,
+  REF_DICT = 4
+};
+
+typedef struct {
+  enum ref_type type;
+  int flags;
+  int raw_size;
+} ref_bencode;
+
+typedef struct {
+  enum ref_type type;
+  int flags;
+  int raw_size;
+  int length;
+  const char *value;
+} ref_string;
+
+typedef struct {
+  enum ref_type type;
+  int flags;
+  int raw_size;
+  long int value;
+} ref_integer;
+
+typedef struct {
+  enum ref_type type;
+  int flags;
+  int raw_size;
+  int length;
+  ref_bencode **values;
+} ref_list;
+
+typedef struct {
+  enum ref_type type;
+  int flags;
+  int raw_size;
+  int length;
+  ref_string *keys;
+  ref_bencode **values;
+} ref_dict;
+
+static ref_bencode *ref_decode(const char *bencoded_value);
+
+static int ref_is_digit(char c) { return c >= '0' && c <= '9'; }
+
+static enum ref_type ref_get_type(const char *bencoded_value) {
+  char c = bencoded_value[0];
+  if (ref_is_digit(c))
+    return REF_STRING;
+  if (c == 'i')
+    return REF_INTEGER;
+  if (c == 'l')
+    return REF_LIST;
+  if (c == 'd')
+    return REF_DICT;
+
+  return REF_INVALID;
+}
+
+static void ref_free(ref_bencode *b) {
+  switch (b->type) {
+  case REF_STRING:
+    free((void *)((ref_string *)b)->value);
+    break;
+  case REF_LIST: {
+    ref_list *list = (ref_list *)b;
+    for (int i = 0; i < list->length; i++) {
+      ref_free(list->values[i]);
+    }
+    free(list->values);
+    break;
+  }
+  case REF_DICT: {
+    ref_dict *dict = (ref_dict *)b;
+    for (int i = 0; i < dict->length; i++) {
+      free((void *)dict->keys[i].value);
+      ref_free(dict->values[i]);
+    }
+    free(dict->keys);
+    free(dict->values);
+    break;
+  }
+  default:
+    break;
+  }
+
+  free(b);
+}
+
+static ref_bencode *ref_invalid(void) {
+  fprintf(stderr, "invalid bencode");
+  ref_bencode *result = malloc(sizeof(ref_bencode));
+  assert(result != NULL);
+  result->type = REF_INVALID;
+  result->flags = 0;
+  return result;
+}
+
+static int ref_string_into(ref_string *result, const char *bencoded_value) {
+  int len = atoi(bencoded_value);
+  const char *colon_index = strchr(bencoded_value, ':');
+  if (colon_index == NULL) {
+    return -1;
+  }
+
+  const char *start = colon_index + 1;
+  char *decoded_str = (char *)malloc(len + 1);
+  assert(decoded_str != NULL);
+  memcpy(decoded_str, start, len);
+  decoded_str[len] = '\0';
+  result->value = decoded_str;
+
+  result->type = REF_STRING;
+  result->flags = 0;
+  result->length = len;
+  result->raw_size = (colon_index - bencoded_value + len + 1);
+  return 0;
+}
+
+static ref_bencode *ref_decode_string(const char *bencoded_value) {
+  ref_string *result = malloc(sizeof(*result));
+  assert(result != NULL);
+
+  if (ref_string_into(result, bencoded_value) == -1) {
+    free(result);
+    return ref_invalid();
+  }
+
+  return (ref_bencode *)result;
+}
+
+static ref_bencode *ref_decode_integer(const char *bencoded_value) {
+  const char *e_index = strchr(bencoded_value, 'e');
+  int len = e_index - bencoded_value - 1;
+  if (len <= 0 || bencoded_value[len + 1] != 'e') {
+    return ref_invalid();
+  }
+
+  ref_integer *result = malloc(sizeof(*result));
+  assert(result != NULL);
+
+  result->type = REF_INTEGER;
+  result->flags = 0;
+  result->value = atol(bencoded_value + 1);
+  result->raw_size = (e_index - bencoded_value + 1);
+  return (ref_bencode *)result;
+}
+
+static ref_bencode *ref_decode_list(const char *bencoded_value) {
+  const char *e_index = strchr(bencoded_value, 'e');
+  if (!e_index) {
+    return ref_invalid();
+  }
+
+  ref_list *result = malloc(sizeof(*result));
+  assert(result != NULL);
+
+  result->type = REF_LIST;
+  result->flags = 0;
+  result->length = 0;
+  result->values = NULL;
+  result->raw_size = 2;
+
+  const char *cur = bencoded_value + 1;
+  while ((size_t)(cur - bencoded_value) < strlen(bencoded_value) - 1) {
+    if (cur[0] == 'e') {
+      return (ref_bencode *)result;
+    }
+
+    ref_bencode *b = ref_decode(cur);
+    result->length++;
+    result->values =
+        realloc(result->values, sizeof(ref_bencode *) * result->length);
+    assert(result->values != NULL);
+    result->values[result->length - 1] = b;
+    cur += b->raw_size;
+    result->raw_size += b->raw_size;
+  }
+
+  return (ref_bencode *)result;
+}
+
+static ref_bencode *ref_decode_dict(const char *bencoded_value) {
+  const char *e_index = strchr(bencoded_value, 'e');
+  if (!e_index) {
+    return ref_invalid();
+  }
+
+  ref_dict *result = malloc(sizeof *result);
+  assert(result != NULL);
+
+  result->keys = NULL;
+  result->values = NULL;
+  result->type = REF_DICT;
+  result->flags = 0;
+  result->raw_size = 2;
+  result->length = 0;
+
+  const char *cur = bencoded_value + 1;
+  while ((size_t)(cur - bencoded_value) < strlen(bencoded_value) - 1) {
+    if (cur[0] == 'e') {
+      return (ref_bencode *)result;
+    }
+
+    if (ref_get_type(cur) != REF_STRING) {
+      return ref_invalid();
+    }
+
+    result->length++;
+    result->keys =
+        realloc(result->keys, sizeof(*result->keys) * result->length);
+    assert(result->keys != NULL);
+    result->values =
+        realloc(result->values, sizeof(ref_bencode *) * result->length);
+    assert(result->values != NULL);
+
+    ref_string *key = &result->keys[result->length - 1];
+    if (ref_string_into(key, cur) == -1) {
+      result->length--;
+      ref_free((ref_bencode *)result);
+      return ref_invalid();
+    }
+    result->raw_size += key->raw_size;
+    cur += key->raw_size;
+
+    ref_bencode *value = ref_decode(cur);
+    result->raw_size += value->raw_size;
+    result->values[result->length - 1] = value;
+    cur += value->raw_size;
+  }
+
+  return (ref_bencode *)result;
+}
+
+static ref_bencode *ref_decode(const char *bencoded_value) {
+  enum ref_type t = ref_get_type(bencoded_value);
+  if (t == REF_STRING)
+    return ref_decode_string(bencoded_value);
+  if (t == REF_INTEGER)
+    return ref_decode_integer(bencoded_value);
+  if (t == REF_LIST)
+    return ref_decode_list(bencoded_value);
+  if (t == REF_DICT)
+    return ref_decode_dict(bencoded_value);
+
+  fprintf(stderr, "Not supported: %s\n", bencoded_value);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <file> [rounds]\n", argv[0]);
+    return 1;
+  }
+  int rounds = argc > 2 ? atoi(argv[2]) : 1;
+
+  FILE *file = fopen(argv[1], "rb");
+  if (file == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  char *data = malloc(size + 1);
+  assert(data);
+  if (fread(data, 1, size, file) != (size_t)size) {
+    perror(argv[1]);
+    return 1;
+  }
+  fclose(file);
+  data[size] = '\0';
+
+  struct timespec begin, end;
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  for (int i = 0; i < rounds; i++) {
+    ref_bencode *b = ref_decode(data);
+    if (b->type == REF_INVALID || b->raw_size != size) {
+      fprintf(stderr, "reference: invalid bencode\n");
+      return 1;
+    }
+    ref_free(b);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double ms = (end.tv_sec - begin.tv_sec) * 1e3 +
+              (end.tv_nsec - begin.tv_nsec) / 1e6;
+  printf("%-9s %9.3f ms per decode of %ld bytes\n", "reference", ms / rounds,
+         size);
+
+  free(data);
+  return 0;
+}
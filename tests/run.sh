@@ -0,0 +1,24 @@
+#!/bin/sh
+#
+# Builds every tests/test_*.c against the sources in app/, without main.c,
+# and runs it. Extra arguments go to gcc, e.g. -fsanitize=address.
+set -e
+cd "$(dirname "$0")/.."
+
+bin=$(mktemp -d)
+trap 'rm -rf "$bin"' EXIT
+sources=$(ls app/*.c | grep -v '^app/main\.c$')
+
+status=0
+for test in tests/test_*.c; do
+  name=$(basename "$test" .c)
+  gcc -g -Iapp "$@" $sources tests/test.c "$test" -o "$bin/$name" \
+    -lssl -lcrypto -lcurl
+  if "$bin/$name"; then
+    echo "ok   $name"
+  else
+    echo "FAIL $name"
+    status=1
+  fi
+done
+exit $status
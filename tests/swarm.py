@@ -0,0 +1,213 @@
+#!/usr/bin/env python3
+"""A loopback swarm: an HTTP tracker and seeders for a generated payload.
+
+Writes test.torrent and payload.bin to --dir, prints "ready" once the
+tracker listens on --port and serves until killed. The seeders listen on
+the ports right after it.
+"""
+import argparse
+import hashlib
+import os
+import queue
+import random
+import socket
+import struct
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+
+def bencode(x):
+    if isinstance(x, int):
+        return b'i%de' % x
+    if isinstance(x, str):
+        x = x.encode()
+    if isinstance(x, bytes):
+        return b'%d:%s' % (len(x), x)
+    if isinstance(x, list):
+        return b'l' + b''.join(bencode(i) for i in x) + b'e'
+    return b'd' + b''.join(bencode(k) + bencode(x[k]) for k in sorted(x)) + b'e'
+
+
+ap = argparse.ArgumentParser()
+ap.add_argument('--size', type=int, default=1_000_000)
+ap.add_argument('--piece', type=int, default=32768)
+ap.add_argument('--peers', type=int, default=1)
+ap.add_argument('--port', type=int, default=8000)
+ap.add_argument('--dir', default='.')
+ap.add_argument('--files', type=int, default=0,
+                help='a multi-file torrent with this many files')
+ap.add_argument('--partial', type=int, default=0,
+                help='each seeder holds this percentage of the pieces')
+ap.add_argument('--missing', type=int, default=0,
+                help='the last N pieces are held by no seeder')
+ap.add_argument('--corrupt', action='store_true',
+                help='seeder 0 flips the first byte of every piece')
+ap.add_argument('--fake', type=int, default=0,
+                help='unreachable peers added to the tracker response')
+ap.add_argument('--latency', type=float, default=0.0,
+                help='seconds every reply is delayed')
+ap.add_argument('--slow', type=float, default=0.0,
+                help='seconds every request waits before it is served')
+ap.add_argument('--slow-peers', type=int, default=0,
+                help='only the first N seeders are slow, 0 for all')
+ap.add_argument('--hang', type=int, default=0,
+                help='seeder 0 stops halfway through its Nth block')
+args = ap.parse_args()
+
+os.makedirs(args.dir, exist_ok=True)
+random.seed(7)
+data = random.randbytes(args.size)
+pieces = [data[i:i + args.piece] for i in range(0, len(data), args.piece)]
+hashes = b''.join(hashlib.sha1(p).digest() for p in pieces)
+if args.files:
+    sizes = []
+    left = args.size
+    for i in range(args.files - 1):
+        size = min(left, random.randrange(max(1, 2 * args.size // args.files)))
+        sizes.append(size)
+        left -= size
+    sizes.append(left)
+    files = [{'length': s, 'path': ['sub%d' % (i % 3), 'f%d.bin' % i]}
+             for i, s in enumerate(sizes)]
+    info = {'files': files, 'name': 'multi', 'piece length': args.piece,
+            'pieces': hashes}
+else:
+    info = {'length': args.size, 'name': 'payload.bin',
+            'piece length': args.piece, 'pieces': hashes}
+torrent = {'announce': 'http://127.0.0.1:%d/announce' % args.port,
+           'info': info}
+with open(os.path.join(args.dir, 'test.torrent'), 'wb') as f:
+    f.write(bencode(torrent))
+with open(os.path.join(args.dir, 'payload.bin'), 'wb') as f:
+    f.write(data)
+info_hash = hashlib.sha1(bencode(info)).digest()
+
+seed_ports = [args.port + 1 + i for i in range(args.peers)]
+holdings = []
+for i in range(args.peers):
+    if args.partial:
+        holdings.append({j for j in range(len(pieces))
+                         if random.randrange(100) < args.partial})
+    else:
+        holdings.append(set(range(len(pieces))))
+# every piece is somewhere unless it is meant to be missing.
+for j in range(len(pieces)):
+    if not any(j in h for h in holdings):
+        holdings[j % args.peers].add(j)
+for h in holdings:
+    h.difference_update(range(len(pieces) - args.missing, len(pieces)))
+served = [0]
+
+
+class Tracker(BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def log_message(self, *a):
+        pass
+
+    def do_GET(self):
+        peers = b''.join(socket.inet_aton('127.0.0.1') + struct.pack('>H', p)
+                         for p in seed_ports)
+        peers += b''.join(socket.inet_aton('10.255.%d.%d' % (i // 250, i % 250 + 1))
+                          + struct.pack('>H', 1) for i in range(args.fake))
+        body = bencode({'interval': 60, 'peers': peers})
+        self.send_response(200)
+        self.send_header('Transfer-Encoding', 'chunked')
+        self.end_headers()
+        # small chunks exercise the streaming response parser.
+        for i in range(0, len(body), 37):
+            chunk = body[i:i + 37]
+            self.wfile.write(b'%x\r\n%s\r\n' % (len(chunk), chunk))
+            self.wfile.flush()
+        self.wfile.write(b'0\r\n\r\n')
+
+
+def recvn(conn, n):
+    buf = b''
+    while len(buf) < n:
+        chunk = conn.recv(n - len(buf))
+        if not chunk:
+            raise EOFError
+        buf += chunk
+    return buf
+
+
+def delayed_sender(conn):
+    replies = queue.Queue()
+
+    def writer():
+        while True:
+            due, reply = replies.get()
+            if due > time.time():
+                time.sleep(due - time.time())
+            try:
+                conn.sendall(reply)
+            except OSError:
+                return
+    threading.Thread(target=writer, daemon=True).start()
+    return lambda reply: replies.put((time.time() + args.latency, reply))
+
+
+def serve_peer(conn, idx):
+    have = holdings[idx]
+    send = delayed_sender(conn) if args.latency else conn.sendall
+    slow = args.slow and (not args.slow_peers or idx < args.slow_peers)
+    try:
+        handshake = recvn(conn, 68)
+        if handshake[28:48] != info_hash:
+            return
+        conn.sendall(b'\x13BitTorrent protocol' + b'\0' * 8 + info_hash +
+                     b'-PY0001-%012d' % idx)
+        bitfield = bytearray((len(pieces) + 7) // 8)
+        for j in have:
+            bitfield[j // 8] |= 0x80 >> (j % 8)
+        conn.sendall(struct.pack('>IB', 1 + len(bitfield), 5) + bitfield)
+        while True:
+            (length,) = struct.unpack('>I', recvn(conn, 4))
+            if length == 0:
+                continue
+            msg = recvn(conn, length)
+            if msg[0] == 2:
+                send(struct.pack('>IB', 1, 1))
+            elif msg[0] == 6:
+                index, begin, size = struct.unpack('>III', msg[1:13])
+                if slow:
+                    time.sleep(args.slow)
+                # requests for pieces the seeder lacks are ignored.
+                if index not in have:
+                    continue
+                block = pieces[index][begin:begin + size]
+                if args.corrupt and idx == 0 and begin == 0:
+                    block = b'\xff' + block[1:]
+                reply = struct.pack('>IBII', 9 + len(block), 7, index,
+                                    begin) + block
+                if args.hang and idx == 0:
+                    served[0] += 1
+                    if served[0] == args.hang:
+                        send(reply[:len(reply) // 2])
+                        time.sleep(3600)
+                send(reply)
+    except (EOFError, OSError):
+        pass
+    finally:
+        conn.close()
+
+
+def seeder(idx, port):
+    srv = socket.socket()
+    srv.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    srv.bind(('127.0.0.1', port))
+    srv.listen(64)
+    while True:
+        conn, _ = srv.accept()
+        conn.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        threading.Thread(target=serve_peer, args=(conn, idx),
+                         daemon=True).start()
+
+
+for i, port in enumerate(seed_ports):
+    threading.Thread(target=seeder, args=(i, port), daemon=True).start()
+server = ThreadingHTTPServer(('127.0.0.1', args.port), Tracker)
+print('ready', info_hash.hex(), flush=True)
+server.serve_forever()
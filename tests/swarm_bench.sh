@@ -0,0 +1,48 @@
+#!/bin/sh
+#
+# Downloads from a loopback swarm with the epoll and the io_uring backend
+# and reports the time and the I/O syscalls of each run. The first argument
+# is the number of runs per backend, the rest go to tests/swarm.py, e.g.
+#
+#   tests/swarm_bench.sh 5 --size 67108864 --peers 8
+#
+# The binary is built like your_bittorrent.sh does, CFLAGS adds to that.
+set -e
+cd "$(dirname "$0")/.."
+
+runs=${1:-3}
+[ $# -gt 0 ] && shift
+
+work=$(mktemp -d)
+swarm=
+trap '[ -n "$swarm" ] && kill $swarm; rm -rf "$work"' EXIT
+gcc $CFLAGS app/*.c -o "$work/bt" -lssl -lcrypto -lcurl
+gcc -shared -fPIC tests/syscalls.c -o "$work/syscalls.so" -ldl
+
+port=$((20000 + $$ % 20000))
+python3 tests/swarm.py --dir "$work" --port $port "$@" >"$work/swarm.log" &
+swarm=$!
+while ! grep -q ready "$work/swarm.log"; do
+  kill -0 $swarm
+  sleep 0.2
+done
+
+status=0
+for io in epoll uring; do
+  for run in $(seq "$runs"); do
+    rm -rf "$work/out"
+    if ! TORRENT_IO=$io LD_PRELOAD="$work/syscalls.so" "$work/bt" download \
+      -o "$work/out" "$work/test.torrent" 2>"$work/log" >/dev/null; then
+      echo "$io run $run: download failed"
+      tail -n 3 "$work/log"
+      status=1
+      continue
+    fi
+    seconds=$(sed -n 's/^downloaded in \([0-9.]*\) s.*/\1/p' "$work/log")
+    calls=$(sed -n 's/^I\/O syscalls: //p' "$work/log")
+    pieces=$("$work/bt" verify "$work/test.torrent" "$work/out" \
+      "$work/bitfield" 2>/dev/null | sed -n 's/^Pieces: //p')
+    echo "$io run $run: $seconds s, $calls I/O syscalls, pieces $pieces"
+  done
+done
+exit $status
@@ -0,0 +1,139 @@
+#define _XOPEN_SOURCE 700
+#include "test.h"
+#include "bencode.h"
+#include <assert.h>
+#include <ftw.h>
+#include <openssl/sha.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int failures;
+static char *scratch;
+
+void test_check(int ok, const char *expr, const char *file, int line) {
+  if (!ok) {
+    fprintf(stderr, "%s:%d: check failed: %s\n", file, line, expr);
+    failures++;
+  }
+}
+
+int test_result(void) { return failures > 0; }
+
+static int remove_entry(const char *path, const struct stat *st, int flag,
+                        struct FTW *ftw) {
+  return remove(path);
+}
+
+static void remove_scratch(void) {
+  nftw(scratch, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  free(scratch);
+}
+
+char *test_path(const char *name) {
+  if (scratch == NULL) {
+    char dir[] = "/tmp/torrent-test-XXXXXX";
+    assert(mkdtemp(dir));
+    scratch = strdup(dir);
+    assert(scratch);
+    atexit(remove_scratch);
+  }
+
+  size_t size = strlen(scratch) + strlen(name) + 2;
+  char *path = malloc(size);
+  assert(path);
+  snprintf(path, size, "%s/%s", scratch, name);
+  return path;
+}
+
+int test_write_file(const char *path, const void *data, size_t size) {
+  FILE *file = fopen(path, "wb");
+  if (file == NULL) {
+    perror(path);
+    return -1;
+  }
+  int ok = size == 0 || fwrite(data, size, 1, file) == 1;
+  return fclose(file) == 0 && ok ? 0 : -1;
+}
+
+static int write_to_file(void *userdata, const char *data, size_t size) {
+  return fwrite(data, 1, size, userdata) == size ? 0 : -1;
+}
+
+// write_path writes a path as the list of its components.
+static void write_path(bencode_writer *w, const char *path) {
+  bencode_write_list(w);
+  while (*path != '\0') {
+    size_t size = strcspn(path, "/");
+    bencode_write_string(w, path, size);
+    path += size + (path[size] == '/');
+  }
+  bencode_write_end(w);
+}
+
+int test_torrent(const char *path, const char *name, const test_file *files,
+                 int no_of_files, unsigned long piece_length,
+                 const unsigned char *payload) {
+  unsigned long length = 0;
+  for (int i = 0; i < no_of_files; i++) {
+    length += files[i].length;
+  }
+
+  unsigned long count = (length + piece_length - 1) / piece_length;
+  unsigned char *pieces = malloc(count * SHA_DIGEST_LENGTH + 1);
+  assert(pieces);
+  for (unsigned long i = 0; i < count; i++) {
+    unsigned long begin = i * piece_length;
+    unsigned long size =
+        length - begin < piece_length ? length - begin : piece_length;
+    SHA1(payload + begin, size, pieces + i * SHA_DIGEST_LENGTH);
+  }
+
+  FILE *file = fopen(path, "wb");
+  if (file == NULL) {
+    perror(path);
+    free(pieces);
+    return -1;
+  }
+
+  bencode_writer w;
+  bencode_writer_init(&w, write_to_file, file);
+  bencode_write_dict(&w);
+  bencode_write_string(&w, "announce", 8);
+  bencode_write_string(&w, "http://localhost/announce", 25);
+  bencode_write_string(&w, "info", 4);
+  bencode_write_dict(&w);
+  if (no_of_files == 1 && files[0].path == NULL) {
+    bencode_write_string(&w, "length", 6);
+    bencode_write_int(&w, length);
+  } else {
+    bencode_write_string(&w, "files", 5);
+    bencode_write_list(&w);
+    for (int i = 0; i < no_of_files; i++) {
+      bencode_write_dict(&w);
+      bencode_write_string(&w, "length", 6);
+      bencode_write_int(&w, files[i].length);
+      bencode_write_string(&w, "path", 4);
+      write_path(&w, files[i].path);
+      bencode_write_end(&w);
+    }
+    bencode_write_end(&w);
+  }
+  bencode_write_string(&w, "name", 4);
+  bencode_write_string(&w, name, strlen(name));
+  bencode_write_string(&w, "piece length", 12);
+  bencode_write_int(&w, piece_length);
+  bencode_write_string(&w, "pieces", 6);
+  bencode_write_string(&w, (const char *)pieces, count * SHA_DIGEST_LENGTH);
+  bencode_write_end(&w);
+  bencode_write_end(&w);
+
+  int result = bencode_writer_flush(&w);
+  bencode_writer_free(&w);
+  free(pieces);
+  if (fclose(file) != 0) {
+    result = -1;
+  }
+  return result;
+}
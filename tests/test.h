@@ -0,0 +1,38 @@
+#ifndef TEST_H__
+#define TEST_H__
+
+#include <stddef.h>
+
+// CHECK records a failed expectation with where it is and carries on, so a
+// run reports every one of them.
+#define CHECK(cond) test_check((cond), #cond, __FILE__, __LINE__)
+
+void test_check(int ok, const char *expr, const char *file, int line);
+
+// test_result returns the exit status of the test program, 1 if any check
+// failed.
+int test_result(void);
+
+// test_path returns name joined to a scratch directory that is removed at
+// exit, to be freed by the caller.
+char *test_path(const char *name);
+
+// test_write_file creates path with the size bytes at data. It returns -1
+// on errors.
+int test_write_file(const char *path, const void *data, size_t size);
+
+// test_file describes a file of a torrent built by test_torrent, a single
+// file without a path makes a single file torrent.
+typedef struct {
+  const char *path;
+  unsigned long length;
+} test_file;
+
+// test_torrent writes a torrent for the no_of_files files laid out one
+// after the other in payload. Path components are separated by '/'.
+// It returns -1 on errors.
+int test_torrent(const char *path, const char *name, const test_file *files,
+                 int no_of_files, unsigned long piece_length,
+                 const unsigned char *payload);
+
+#endif /* TEST_H__ */
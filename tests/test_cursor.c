@@ -0,0 +1,241 @@
+#include "bencode.h"
+#include "test.h"
+#include "torrent.h"
+#include <limits.h>
+#include <openssl/sha.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void cursor_on(bencode_cursor *c, const char *input) {
+  bencode_cursor_init(c, input, strlen(input));
+}
+
+static int key_is(const char *key, size_t size, const char *expected) {
+  return size == strlen(expected) && memcmp(key, expected, size) == 0;
+}
+
+// test_walk reads a dict key by key, skipping what is not needed.
+static void test_walk(void) {
+  const char *input = "d4:name4:spam4:listli1e3:abce6:numberi-12ee";
+  bencode_cursor c;
+  cursor_on(&c, input);
+  CHECK(bencode_cursor_peek(&c) == BENCODE_EV_DICT_BEGIN);
+  CHECK(bencode_cursor_enter(&c) == 0);
+
+  const char *key, *data, *raw;
+  size_t size, raw_size;
+  long int value;
+  CHECK(bencode_cursor_next_key(&c, &key, &size) == 1);
+  CHECK(key_is(key, size, "name"));
+  CHECK(bencode_cursor_string(&c, &data, &size) == 0);
+  CHECK(size == 4 && memcmp(data, "spam", 4) == 0);
+
+  CHECK(bencode_cursor_next_key(&c, &key, &size) == 1);
+  CHECK(key_is(key, size, "list"));
+  CHECK(bencode_cursor_skip(&c, &raw, &raw_size) == 0);
+  CHECK(raw_size == 10 && memcmp(raw, "li1e3:abce", 10) == 0);
+
+  CHECK(bencode_cursor_next_key(&c, &key, &size) == 1);
+  CHECK(key_is(key, size, "number"));
+  CHECK(bencode_cursor_int(&c, &value) == 0 && value == -12);
+
+  CHECK(bencode_cursor_next_key(&c, &key, &size) == 0);
+  CHECK(c.cur == input + strlen(input));
+  CHECK(bencode_cursor_peek(&c) == 0);
+}
+
+static void test_list(void) {
+  bencode_cursor c;
+  cursor_on(&c, "li1ei2ei3ee");
+  CHECK(bencode_cursor_enter(&c) == 0);
+  long int sum = 0, value;
+  int more;
+  while ((more = bencode_cursor_next(&c)) == 1) {
+    CHECK(bencode_cursor_int(&c, &value) == 0);
+    sum += value;
+  }
+  CHECK(more == 0 && sum == 6);
+}
+
+// test_find_unsorted looks keys up in a dict whose keys are not sorted: find
+// only moves forward, a key already passed is not found again.
+static void test_find_unsorted(void) {
+  const char *input = "d3:zzzi1e3:mmmi2e3:aaai3ee";
+  bencode_cursor c;
+  long int value;
+
+  cursor_on(&c, input);
+  CHECK(bencode_cursor_enter(&c) == 0);
+  CHECK(bencode_cursor_find(&c, "mmm") == 1);
+  CHECK(bencode_cursor_int(&c, &value) == 0 && value == 2);
+  CHECK(bencode_cursor_find(&c, "aaa") == 1);
+  CHECK(bencode_cursor_int(&c, &value) == 0 && value == 3);
+  CHECK(bencode_cursor_find(&c, "zzz") == 0);
+  CHECK(c.error == 0);
+
+  cursor_on(&c, input);
+  CHECK(bencode_cursor_enter(&c) == 0);
+  CHECK(bencode_cursor_find(&c, "missing") == 0);
+  CHECK(c.cur == input + strlen(input));
+}
+
+// test_find_duplicate finds every copy of a repeated key in turn.
+static void test_find_duplicate(void) {
+  bencode_cursor c;
+  long int value;
+  cursor_on(&c, "d1:ai1e1:bi2e1:ai3ee");
+  CHECK(bencode_cursor_enter(&c) == 0);
+  CHECK(bencode_cursor_find(&c, "a") == 1);
+  CHECK(bencode_cursor_int(&c, &value) == 0 && value == 1);
+  CHECK(bencode_cursor_find(&c, "a") == 1);
+  CHECK(bencode_cursor_int(&c, &value) == 0 && value == 3);
+  CHECK(bencode_cursor_find(&c, "a") == 0);
+}
+
+static void test_errors(void) {
+  const char *bad_ints[] = {"ie",
+                            "i-e",
+                            "i12",
+                            "i1x",
+                            "i9223372036854775808e",
+                            "i-9223372036854775809e",
+                            "i99999999999999999999e"};
+  bencode_cursor c;
+  long int value;
+  for (size_t i = 0; i < sizeof(bad_ints) / sizeof(bad_ints[0]); i++) {
+    cursor_on(&c, bad_ints[i]);
+    CHECK(bencode_cursor_int(&c, &value) == -1);
+  }
+
+  cursor_on(&c, "i9223372036854775807e");
+  CHECK(bencode_cursor_int(&c, &value) == 0 && value == LONG_MAX);
+  cursor_on(&c, "i-9223372036854775808e");
+  CHECK(bencode_cursor_int(&c, &value) == 0 && value == LONG_MIN);
+
+  const char *data;
+  size_t size;
+  const char *bad_strings[] = {"5:abc", "3abc", ":abc", "", "99999999999:a"};
+  for (size_t i = 0; i < sizeof(bad_strings) / sizeof(bad_strings[0]); i++) {
+    cursor_on(&c, bad_strings[i]);
+    CHECK(bencode_cursor_string(&c, &data, &size) == -1);
+  }
+
+  const char *bad_values[] = {"li1e", "d1:a", "e", "x", "l3:abe"};
+  for (size_t i = 0; i < sizeof(bad_values) / sizeof(bad_values[0]); i++) {
+    cursor_on(&c, bad_values[i]);
+    CHECK(bencode_cursor_skip(&c, NULL, NULL) == -1);
+  }
+
+  // errors are sticky, even for input that would read fine.
+  cursor_on(&c, "i1ei2e");
+  CHECK(bencode_cursor_string(&c, &data, &size) == -1);
+  CHECK(bencode_cursor_int(&c, &value) == -1);
+  CHECK(bencode_cursor_peek(&c) == 0);
+
+  // a key that is not a string.
+  cursor_on(&c, "di1ei2ee");
+  CHECK(bencode_cursor_enter(&c) == 0);
+  CHECK(bencode_cursor_next_key(&c, &data, &size) == -1);
+}
+
+// open_torrent writes input out and opens it as a torrent.
+static THandle open_torrent(const char *input, size_t size) {
+  char *path = test_path("cursor.torrent");
+  CHECK(test_write_file(path, input, size) == 0);
+  THandle h = torrent_open(path);
+  free(path);
+  return h;
+}
+
+static int info_hash_is(THandle h, const char *info) {
+  uint8_t expected[SHA_DIGEST_LENGTH];
+  SHA1((const unsigned char *)info, strlen(info), expected);
+  TInfo result;
+  torrent_get_info(h, &result);
+  return memcmp(result.info_hash, expected, SHA_DIGEST_LENGTH) == 0;
+}
+
+#define HASH "aaaaaaaaaaaaaaaaaaaa"
+
+// test_metainfo_unsorted reads metainfo whose keys are out of order, with
+// the info dict hashed exactly as it appears.
+static void test_metainfo_unsorted(void) {
+  const char *info = "d6:pieces20:" HASH "12:piece lengthi100e"
+                     "4:name3:one6:lengthi100ee";
+  char input[512];
+  snprintf(input, sizeof(input),
+           "d4:info%s8:announce9:http://x/7:comment2:hie", info);
+
+  THandle h = open_torrent(input, strlen(input));
+  CHECK(h != NULL);
+  if (h == NULL) {
+    return;
+  }
+  TInfo result;
+  torrent_get_info(h, &result);
+  CHECK(strcmp(result.tracker, "http://x/") == 0);
+  CHECK(strcmp(result.name, "one") == 0);
+  CHECK(result.length == 100 && result.piece_length == 100);
+  CHECK(result.no_of_piece_hashes == 1);
+  CHECK(memcmp(result.pieces[0], HASH, SHA_DIGEST_LENGTH) == 0);
+  CHECK(info_hash_is(h, info));
+  torrent_close(h);
+}
+
+// test_metainfo_duplicate keeps the first info dict and files list.
+static void test_metainfo_duplicate(void) {
+  const char *first = "d5:filesld6:lengthi60e4:pathl1:aeed6:lengthi40e"
+                      "4:pathl1:beee4:name3:dir12:piece lengthi100e"
+                      "6:pieces20:" HASH "5:filesld6:lengthi7e4:pathl1:ceeee";
+  char input[1024];
+  snprintf(input, sizeof(input),
+           "d8:announce9:http://x/4:info%s4:infod4:name5:other6:lengthi1e"
+           "12:piece lengthi1e6:pieces20:" HASH "ee",
+           first);
+
+  THandle h = open_torrent(input, strlen(input));
+  CHECK(h != NULL);
+  if (h == NULL) {
+    return;
+  }
+  TInfo result;
+  torrent_get_info(h, &result);
+  CHECK(strcmp(result.name, "dir") == 0);
+  CHECK(result.no_of_files == 2 && result.length == 100);
+  CHECK(result.no_of_files == 2 && strcmp(result.files[1].path, "b") == 0);
+  CHECK(info_hash_is(h, first));
+  torrent_close(h);
+}
+
+static void test_metainfo_invalid(void) {
+  const char *inputs[] = {
+      // both a length and files.
+      "d8:announce1:x4:infod5:filesld6:lengthi1e4:pathl1:aeee"
+      "6:lengthi1e4:name1:n12:piece lengthi1e6:pieces20:" HASH "ee",
+      // a piece length that does not fit a long.
+      "d8:announce1:x4:infod6:lengthi1e4:name1:n"
+      "12:piece lengthi99999999999999999999e6:pieces20:" HASH "ee",
+      // cut short inside the info dict.
+      "d8:announce1:x4:infod6:lengthi1e4:name1:n",
+  };
+  for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+    THandle h = open_torrent(inputs[i], strlen(inputs[i]));
+    CHECK(h == NULL);
+    if (h != NULL) {
+      torrent_close(h);
+    }
+  }
+}
+
+int main(void) {
+  test_walk();
+  test_list();
+  test_find_unsorted();
+  test_find_duplicate();
+  test_errors();
+  test_metainfo_unsorted();
+  test_metainfo_duplicate();
+  test_metainfo_invalid();
+  return test_result();
+}
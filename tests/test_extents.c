@@ -0,0 +1,172 @@
+#include "test.h"
+#include "torrent.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define MAX_EXTENTS 8
+
+static unsigned char payload[400];
+
+// the empty files sit before, between and after the others and never show
+// up in extents.
+static const test_file files[] = {
+    {"empty", 0}, {"a", 100}, {"sub/empty", 0},
+    {"b", 50},    {"c", 250}, {"last", 0},
+};
+#define NO_OF_FILES (int)(sizeof(files) / sizeof(files[0]))
+
+static THandle open_torrent(const char *name, const test_file *list, int n,
+                            unsigned long piece_length) {
+  char *path = test_path(name);
+  CHECK(test_torrent(path, "dir", list, n, piece_length, payload) == 0);
+  THandle h = torrent_open(path);
+  CHECK(h != NULL);
+  free(path);
+  return h;
+}
+
+static int extent_is(const TExtent *e, int file, unsigned long offset,
+                     unsigned long length) {
+  return e->file == file && e->offset == offset && e->length == length;
+}
+
+static void test_boundaries(void) {
+  THandle h = open_torrent("extents.torrent", files, NO_OF_FILES, 100);
+  if (h == NULL) {
+    return;
+  }
+  TExtent e[MAX_EXTENTS];
+
+  // a piece that is exactly one file.
+  CHECK(torrent_map_extents(h, 0, 0, 100, e, MAX_EXTENTS) == 1);
+  CHECK(extent_is(&e[0], 1, 0, 100));
+
+  // a piece split over two files with an empty one before them.
+  CHECK(torrent_map_extents(h, 1, 0, 100, e, MAX_EXTENTS) == 2);
+  CHECK(extent_is(&e[0], 3, 0, 50));
+  CHECK(extent_is(&e[1], 4, 0, 50));
+
+  // ranges that start or end right at a file boundary stay in one file.
+  CHECK(torrent_map_extents(h, 1, 50, 50, e, MAX_EXTENTS) == 1);
+  CHECK(extent_is(&e[0], 4, 0, 50));
+  CHECK(torrent_map_extents(h, 1, 0, 50, e, MAX_EXTENTS) == 1);
+  CHECK(extent_is(&e[0], 3, 0, 50));
+
+  // one byte on each side of a boundary.
+  CHECK(torrent_map_extents(h, 1, 49, 2, e, MAX_EXTENTS) == 2);
+  CHECK(extent_is(&e[0], 3, 49, 1));
+  CHECK(extent_is(&e[1], 4, 0, 1));
+
+  // the last piece ends where the last non-empty file does.
+  CHECK(torrent_map_extents(h, 3, 0, 100, e, MAX_EXTENTS) == 1);
+  CHECK(extent_is(&e[0], 4, 150, 100));
+  CHECK(torrent_map_extents(h, 3, 100, 0, e, MAX_EXTENTS) == 0);
+
+  CHECK(torrent_map_extents(h, 2, 10, 0, e, MAX_EXTENTS) == 0);
+  CHECK(torrent_map_extents(h, 1, 0, 100, e, 1) == -1);
+  CHECK(torrent_map_extents(h, 4, 0, 1, e, MAX_EXTENTS) == -1);
+  CHECK(torrent_map_extents(h, -1, 0, 1, e, MAX_EXTENTS) == -1);
+  CHECK(torrent_map_extents(h, 3, 1, 100, e, MAX_EXTENTS) == -1);
+  CHECK(torrent_map_extents(h, 3, 101, 0, e, MAX_EXTENTS) == -1);
+  CHECK(torrent_map_extents(h, 0, 0, (unsigned long)-1, e, MAX_EXTENTS) == -1);
+
+  // a range may cross pieces as long as it stays within the torrent.
+  CHECK(torrent_map_extents(h, 0, 0, 400, e, MAX_EXTENTS) == 3);
+  CHECK(extent_is(&e[2], 4, 0, 250));
+
+  torrent_close(h);
+}
+
+static void test_short_last_piece(void) {
+  THandle h = open_torrent("short.torrent", files, NO_OF_FILES, 128);
+  if (h == NULL) {
+    return;
+  }
+  TInfo info;
+  torrent_get_info(h, &info);
+  CHECK(info.no_of_piece_hashes == 4);
+
+  TExtent e[MAX_EXTENTS];
+  CHECK(torrent_map_extents(h, 0, 0, 128, e, MAX_EXTENTS) == 2);
+  CHECK(extent_is(&e[0], 1, 0, 100));
+  CHECK(extent_is(&e[1], 3, 0, 28));
+  CHECK(torrent_map_extents(h, 3, 0, 16, e, MAX_EXTENTS) == 1);
+  CHECK(extent_is(&e[0], 4, 234, 16));
+  CHECK(torrent_map_extents(h, 3, 0, 17, e, MAX_EXTENTS) == -1);
+  torrent_close(h);
+}
+
+static void test_single_file(void) {
+  test_file single = {NULL, 400};
+  THandle h = open_torrent("single.torrent", &single, 1, 100);
+  if (h == NULL) {
+    return;
+  }
+  TExtent e[MAX_EXTENTS];
+  CHECK(torrent_map_extents(h, 2, 30, 70, e, MAX_EXTENTS) == 1);
+  CHECK(extent_is(&e[0], 0, 230, 70));
+  torrent_close(h);
+}
+
+static int file_is(const char *dir, const char *name, const unsigned char *data,
+                   long size) {
+  char path[512];
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    return 0;
+  }
+  unsigned char buffer[sizeof(payload) + 1];
+  long n = fread(buffer, 1, sizeof(buffer), file);
+  fclose(file);
+  return n == size && memcmp(buffer, data, size) == 0;
+}
+
+// test_storage writes every piece in uneven iovecs that straddle the file
+// boundaries, then checks the files and reads the pieces back.
+static void test_storage(void) {
+  THandle h = open_torrent("storage.torrent", files, NO_OF_FILES, 100);
+  if (h == NULL) {
+    return;
+  }
+  char *dir = test_path("storage");
+  CHECK(torrent_storage_open(h, dir) == 0);
+
+  for (int piece = 0; piece < 4; piece++) {
+    unsigned char *data = payload + piece * 100;
+    struct iovec iov[] = {{data, 7}, {data + 7, 0}, {data + 7, 44},
+                          {data + 51, 49}};
+    CHECK(torrent_storage_writev(h, piece, 0, iov, 4) == 100);
+  }
+
+  unsigned long offset = 0;
+  for (int i = 0; i < NO_OF_FILES; i++) {
+    CHECK(file_is(dir, files[i].path, payload + offset, files[i].length));
+    offset += files[i].length;
+  }
+
+  unsigned char back[400] = {0};
+  struct iovec iov[] = {{back, 149}, {back + 149, 2}, {back + 151, 249}};
+  CHECK(torrent_storage_readv(h, 0, 0, iov, 3) == 400);
+  CHECK(memcmp(back, payload, sizeof(payload)) == 0);
+
+  struct iovec past = {back, 2};
+  CHECK(torrent_storage_readv(h, 3, 99, &past, 1) == -1);
+
+  torrent_close(h);
+  free(dir);
+}
+
+int main(void) {
+  for (size_t i = 0; i < sizeof(payload); i++) {
+    payload[i] = i * 13 + 5;
+  }
+
+  test_boundaries();
+  test_short_last_piece();
+  test_single_file();
+  test_storage();
+  return test_result();
+}
@@ -0,0 +1,170 @@
+#include "test.h"
+#include "torrent.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define PIECE_LENGTH 1024
+
+static unsigned char payload[5000];
+
+// make_torrent writes a torrent below the scratch directory and returns
+// its info hash.
+static void make_torrent(const char *name, const test_file *files, int n,
+                         uint8_t info_hash[SHA_DIGEST_LENGTH]) {
+  char *path = test_path(name);
+  CHECK(test_torrent(path, name, files, n, PIECE_LENGTH, payload) == 0);
+
+  THandle h = torrent_open(path);
+  CHECK(h != NULL);
+  if (h != NULL) {
+    TInfo info;
+    torrent_get_info(h, &info);
+    memcpy(info_hash, info.info_hash, SHA_DIGEST_LENGTH);
+    torrent_close(h);
+  }
+  free(path);
+}
+
+static int same_entry(const TIndexEntry *a, const TIndexEntry *b) {
+  return memcmp(a->info_hash, b->info_hash, SHA_DIGEST_LENGTH) == 0 &&
+         a->length == b->length && a->piece_length == b->piece_length &&
+         a->no_of_piece_hashes == b->no_of_piece_hashes &&
+         strcmp(a->path, b->path) == 0 && strcmp(a->tracker, b->tracker) == 0;
+}
+
+static void test_build(void) {
+  char *dir = test_path("torrents");
+  char *nested = test_path("torrents/nested");
+  mkdir(dir, 0755);
+  mkdir(nested, 0755);
+
+  uint8_t single[SHA_DIGEST_LENGTH], multi[SHA_DIGEST_LENGTH];
+  test_file one = {NULL, 3000};
+  test_file two[] = {{"a", 1500}, {"b/c", 3500}};
+  make_torrent("torrents/single.torrent", &one, 1, single);
+  make_torrent("torrents/nested/multi.torrent", two, 2, multi);
+
+  // neither of these makes it into the index.
+  char *broken = test_path("torrents/broken.torrent");
+  char *other = test_path("torrents/notes.txt");
+  CHECK(test_write_file(broken, "d8:announce", 11) == 0);
+  CHECK(test_write_file(other, "d8:announcee", 12) == 0);
+
+  TIndex index = torrent_index_build(dir, 2);
+  CHECK(torrent_index_count(index) == 2);
+
+  const TIndexEntry *entry = torrent_index_find(index, single);
+  CHECK(entry != NULL);
+  if (entry != NULL) {
+    CHECK(entry->length == 3000);
+    CHECK(entry->piece_length == PIECE_LENGTH);
+    CHECK(entry->no_of_piece_hashes == 3);
+    CHECK(strstr(entry->path, "/single.torrent") != NULL);
+    CHECK(strcmp(entry->tracker, "http://localhost/announce") == 0);
+  }
+  entry = torrent_index_find(index, multi);
+  CHECK(entry != NULL);
+  if (entry != NULL) {
+    CHECK(entry->length == 5000);
+    CHECK(entry->no_of_piece_hashes == 5);
+    CHECK(strstr(entry->path, "/nested/multi.torrent") != NULL);
+  }
+
+  uint8_t unknown[SHA_DIGEST_LENGTH] = {0};
+  CHECK(torrent_index_find(index, unknown) == NULL);
+  CHECK(torrent_index_entry(index, 2) == NULL);
+
+  // the loaded index holds the same entries, found the same way.
+  char *file = test_path("index.bin");
+  CHECK(torrent_index_save(index, file) == 0);
+  TIndex loaded = torrent_index_load(file);
+  CHECK(loaded != NULL);
+  if (loaded != NULL) {
+    CHECK(torrent_index_count(loaded) == torrent_index_count(index));
+    for (int i = 0; i < torrent_index_count(index); i++) {
+      const TIndexEntry *a = torrent_index_entry(index, i);
+      const TIndexEntry *b = torrent_index_find(loaded, a->info_hash);
+      CHECK(b != NULL && same_entry(a, b));
+    }
+    CHECK(torrent_index_find(loaded, unknown) == NULL);
+    torrent_index_free(loaded);
+  }
+
+  torrent_index_free(index);
+  free(dir);
+  free(nested);
+  free(broken);
+  free(other);
+  free(file);
+}
+
+static void test_empty(void) {
+  char *dir = test_path("empty");
+  mkdir(dir, 0755);
+
+  TIndex index = torrent_index_build(dir, 0);
+  CHECK(torrent_index_count(index) == 0);
+
+  char *file = test_path("empty.bin");
+  CHECK(torrent_index_save(index, file) == 0);
+  TIndex loaded = torrent_index_load(file);
+  CHECK(loaded != NULL && torrent_index_count(loaded) == 0);
+
+  if (loaded != NULL) {
+    torrent_index_free(loaded);
+  }
+  torrent_index_free(index);
+  free(dir);
+  free(file);
+}
+
+static void test_load_corrupt(void) {
+  char *dir = test_path("corrupt");
+  mkdir(dir, 0755);
+  uint8_t hash[SHA_DIGEST_LENGTH];
+  test_file one = {NULL, 2000};
+  make_torrent("corrupt/one.torrent", &one, 1, hash);
+
+  TIndex index = torrent_index_build(dir, 1);
+  char *file = test_path("corrupt.bin");
+  CHECK(torrent_index_save(index, file) == 0);
+  torrent_index_free(index);
+
+  FILE *f = fopen(file, "rb");
+  char data[4096];
+  size_t size = f != NULL ? fread(data, 1, sizeof(data), f) : 0;
+  if (f != NULL) {
+    fclose(f);
+  }
+  CHECK(size > 16);
+
+  // cut short anywhere, in the header, the records or the strings.
+  for (size_t cut = 0; cut < size; cut++) {
+    CHECK(test_write_file(file, data, cut) == 0);
+    CHECK(torrent_index_load(file) == NULL);
+  }
+
+  data[0] = 'X';
+  CHECK(test_write_file(file, data, size) == 0);
+  CHECK(torrent_index_load(file) == NULL);
+
+  char *missing = test_path("missing.bin");
+  CHECK(torrent_index_load(missing) == NULL);
+
+  free(dir);
+  free(file);
+  free(missing);
+}
+
+int main(void) {
+  for (size_t i = 0; i < sizeof(payload); i++) {
+    payload[i] = i * 7 + i / 251;
+  }
+
+  test_build();
+  test_empty();
+  test_load_corrupt();
+  return test_result();
+}
@@ -0,0 +1,121 @@
+#include "bencode.h"
+#include "test.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// sink collects what bencode_json_write writes, failing the call numbered
+// fail_at if it is set.
+typedef struct {
+  char *data;
+  size_t length;
+  int calls;
+  int fail_at;
+} sink;
+
+static int sink_write(void *userdata, const char *data, size_t size) {
+  sink *s = userdata;
+  if (++s->calls == s->fail_at) {
+    return -1;
+  }
+  s->data = realloc(s->data, s->length + size + 1);
+  assert(s->data != NULL);
+  memcpy(s->data + s->length, data, size);
+  s->length += size;
+  s->data[s->length] = '\0';
+  return 0;
+}
+
+// json_is decodes size bytes of bencode and checks the JSON they turn into.
+static int json_is(const char *input, size_t size, const char *expected) {
+  bencode *b = decode_bencode_n(input, size, 0);
+  if (b == NULL) {
+    return 0;
+  }
+  sink s = {0};
+  int ok = bencode_json_write(b, sink_write, &s) == 0 && s.data != NULL &&
+           s.length == strlen(expected) && strcmp(s.data, expected) == 0;
+  if (!ok) {
+    fprintf(stderr, "got %s, want %s\n", s.data, expected);
+  }
+  free(s.data);
+  bencode_free(b);
+  return ok;
+}
+
+#define JSON_IS(input, expected) json_is(input, sizeof(input) - 1, expected)
+
+static void test_escapes(void) {
+  CHECK(JSON_IS("8:a\"b\\c/d\n", "\"a\\\"b\\\\c/d\\n\""));
+  CHECK(JSON_IS("5:\r\t\x01\x1f\x7f", "\"\\r\\t\\u0001\\u001f\x7f\""));
+  CHECK(JSON_IS("3:a\0b", "\"a\\u0000b\""));
+  CHECK(JSON_IS("0:", "\"\""));
+  // keys are escaped like values.
+  CHECK(JSON_IS("d2:\"ki1e2:k\ni2ee", "{\"\\\"k\":1,\"k\\n\":2}"));
+}
+
+static void test_utf8(void) {
+  // valid sequences of two, three and four bytes pass through.
+  CHECK(JSON_IS("9:\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80",
+                "\"\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80\""));
+  // stray continuation bytes, invalid lead bytes, overlong forms,
+  // surrogates, code points past U+10FFFF and cut short sequences are
+  // escaped byte by byte.
+  CHECK(JSON_IS("2:\x80\xff", "\"\\u0080\\u00ff\""));
+  CHECK(JSON_IS("2:\xc0\x80", "\"\\u00c0\\u0080\""));
+  CHECK(JSON_IS("3:\xe0\x80\x80", "\"\\u00e0\\u0080\\u0080\""));
+  CHECK(JSON_IS("3:\xed\xa0\x80", "\"\\u00ed\\u00a0\\u0080\""));
+  CHECK(JSON_IS("4:\xf4\x90\x80\x80",
+                "\"\\u00f4\\u0090\\u0080\\u0080\""));
+  CHECK(JSON_IS("3:a\xe2\x82", "\"a\\u00e2\\u0082\""));
+  CHECK(JSON_IS("2:\xc3" "a", "\"\\u00c3a\""));
+}
+
+static void test_values(void) {
+  CHECK(JSON_IS("i0e", "0"));
+  CHECK(JSON_IS("i-9223372036854775808e", "-9223372036854775808"));
+  CHECK(JSON_IS("i9223372036854775807e", "9223372036854775807"));
+  CHECK(JSON_IS("llelei1edee", "[[],[],1,{}]"));
+  CHECK(JSON_IS("d1:ad1:bli1e1:ceee", "{\"a\":{\"b\":[1,\"c\"]}}"));
+}
+
+// test_large checks output that spans several buffers, with every byte
+// doubled by escaping.
+static void test_large(void) {
+  size_t n = 200000;
+  char *input = malloc(n + 16);
+  assert(input != NULL);
+  size_t header = sprintf(input, "%zu:", n);
+  memset(input + header, '"', n);
+  bencode *b = decode_bencode_n(input, header + n, 0);
+  CHECK(b != NULL);
+
+  sink s = {0};
+  CHECK(bencode_json_write(b, sink_write, &s) == 0);
+  CHECK(s.calls > 1);
+  CHECK(s.length == 2 * n + 2);
+  int ok = s.data[0] == '"' && s.data[2 * n + 1] == '"';
+  for (size_t i = 1; ok && i < 2 * n + 1; i += 2) {
+    ok = s.data[i] == '\\' && s.data[i + 1] == '"';
+  }
+  CHECK(ok);
+  free(s.data);
+
+  // a failed write fails the whole call and nothing more is written.
+  sink failing = {.fail_at = 2};
+  CHECK(bencode_json_write(b, sink_write, &failing) == -1);
+  CHECK(failing.calls == 2);
+  free(failing.data);
+
+  bencode_free(b);
+  free(input);
+}
+
+int main(void) {
+  test_escapes();
+  test_utf8();
+  test_values();
+  test_large();
+  return test_result();
+}
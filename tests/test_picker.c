@@ -0,0 +1,124 @@
+#include "test.h"
+#include "torrent_internal.h"
+#include <string.h>
+
+#define PIECES 20
+#define PEERS 4
+
+static unsigned char all[(PIECES + 7) / 8];
+
+static void set(unsigned char *bitfield, int piece) {
+  bitfield[piece / 8] |= 0x80 >> (piece % 8);
+}
+
+// runs_ordered tells if the candidates are sorted by availability, with
+// the runs where bucket says they are.
+static int runs_ordered(const torrent_picker *picker) {
+  int end = picker->bucket[picker->max + 1];
+  for (int i = 0; i < end; i++) {
+    int piece = picker->order[i];
+    int a = picker->availability[piece];
+    if (picker->position[piece] != i || i < picker->bucket[a] ||
+        i >= picker->bucket[a + 1]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void test_rarest_first(void) {
+  torrent_picker picker;
+  picker_init(&picker, PIECES, PEERS);
+
+  // nobody has anything yet.
+  CHECK(picker_pick(&picker, all) == -1);
+
+  // piece p is held by p % 3 + 1 peers, the multiples of 3 are rarest.
+  for (int p = 0; p < PIECES; p++) {
+    for (int n = 0; n <= p % 3; n++) {
+      picker_add(&picker, p);
+    }
+  }
+  CHECK(runs_ordered(&picker));
+  CHECK(picker_pick(&picker, all) % 3 == 0);
+
+  // a peer with only commoner pieces still gets one of them.
+  unsigned char some[sizeof(all)] = {0};
+  set(some, 5);
+  set(some, 7);
+  CHECK(picker_pick(&picker, some) == 7);
+
+  // piece 5 losing two holders makes it the rarest one the peer has.
+  picker_remove(&picker, 5);
+  picker_remove(&picker, 5);
+  CHECK(runs_ordered(&picker));
+  CHECK(picker_pick(&picker, some) == 5);
+
+  // and gaining them back restores the order.
+  picker_add(&picker, 5);
+  picker_add(&picker, 5);
+  CHECK(picker_pick(&picker, some) == 7);
+  picker_free(&picker);
+}
+
+static void test_take_put(void) {
+  torrent_picker picker;
+  picker_init(&picker, PIECES, PEERS);
+  for (int p = 0; p < PIECES; p++) {
+    picker_add(&picker, p);
+  }
+  picker_add(&picker, 4);
+  picker_add(&picker, 9);
+
+  unsigned char some[sizeof(all)] = {0};
+  set(some, 4);
+  set(some, 9);
+  set(some, 12);
+  CHECK(picker_pick(&picker, some) == 12);
+
+  // taken pieces are no candidates, whatever their availability does.
+  picker_take(&picker, 12);
+  CHECK(!picker_candidate(&picker, 12));
+  picker_take(&picker, 12);
+  picker_remove(&picker, 12);
+  picker_add(&picker, 12);
+  picker_add(&picker, 12);
+  CHECK(runs_ordered(&picker));
+  int picked = picker_pick(&picker, some);
+  CHECK(picked == 4 || picked == 9);
+
+  picker_take(&picker, 4);
+  picker_take(&picker, 9);
+  CHECK(picker_pick(&picker, some) == -1);
+
+  // put back with the availability it has by now.
+  picker_put(&picker, 12);
+  picker_put(&picker, 12);
+  picker_put(&picker, 9);
+  picker_add(&picker, 12);
+  CHECK(picker_candidate(&picker, 12));
+  CHECK(runs_ordered(&picker));
+  CHECK(picker_pick(&picker, some) == 9);
+  picker_remove(&picker, 9);
+  CHECK(picker_pick(&picker, some) == 9);
+
+  // a candidate nobody has any more is skipped.
+  picker_remove(&picker, 9);
+  CHECK(picker_candidate(&picker, 9));
+  CHECK(picker_pick(&picker, some) == 12);
+
+  // once every piece is taken nothing is left to pick.
+  for (int p = 0; p < PIECES; p++) {
+    picker_take(&picker, p);
+  }
+  CHECK(picker.bucket[picker.max + 1] == 0);
+  CHECK(picker_pick(&picker, all) == -1);
+  picker_free(&picker);
+}
+
+int main(void) {
+  memset(all, 0xff, sizeof(all));
+  test_rarest_first();
+  test_take_put();
+  return test_result();
+}
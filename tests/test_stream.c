@@ -0,0 +1,187 @@
+#include "bencode.h"
+#include "test.h"
+#include <stdio.h>
+#include <string.h>
+
+// transcript renders the events of a stream as text, with string fragments
+// joined back together, so streams fed in different splits can be compared.
+typedef struct {
+  char text[2048];
+  size_t length;
+  char string[256];
+  size_t string_length;
+  int fragments_ok;
+  int events;
+  int abort_at;
+} transcript;
+
+static void append(transcript *t, const char *data, size_t size) {
+  if (t->length + size < sizeof(t->text)) {
+    memcpy(t->text + t->length, data, size);
+    t->length += size;
+  }
+}
+
+static int on_event(void *userdata, const bencode_event *event) {
+  transcript *t = userdata;
+  if (++t->events == t->abort_at) {
+    return -1;
+  }
+
+  char head[64];
+  int n = 0;
+  switch (event->type) {
+  case BENCODE_EV_INTEGER:
+    n = snprintf(head, sizeof(head), "i%ld@%d ", event->integer, event->depth);
+    break;
+  case BENCODE_EV_LIST_BEGIN:
+    n = snprintf(head, sizeof(head), "l@%d ", event->depth);
+    break;
+  case BENCODE_EV_DICT_BEGIN:
+    n = snprintf(head, sizeof(head), "d@%d ", event->depth);
+    break;
+  case BENCODE_EV_END:
+    n = snprintf(head, sizeof(head), "e@%d ", event->depth);
+    break;
+  case BENCODE_EV_STRING:
+    // fragments follow each other without gaps, keys come whole.
+    if (event->offset != t->string_length ||
+        event->offset + event->length > event->total ||
+        (event->is_key && event->length != event->total) ||
+        t->string_length + event->length > sizeof(t->string)) {
+      t->fragments_ok = 0;
+      return 0;
+    }
+    memcpy(t->string + t->string_length, event->data, event->length);
+    t->string_length += event->length;
+    if (t->string_length < event->total) {
+      return 0;
+    }
+    n = snprintf(head, sizeof(head), "%c%zu@%d:", event->is_key ? 'k' : 's',
+                 event->total, event->depth);
+    append(t, head, n);
+    append(t, t->string, t->string_length);
+    t->string_length = 0;
+    n = snprintf(head, sizeof(head), " ");
+    break;
+  }
+  append(t, head, n);
+  return 0;
+}
+
+// stream_split feeds input in up to three parts cut at a and b and returns
+// what bencode_stream_feed and bencode_stream_done made of it: 1 for a
+// complete value, 0 for an incomplete one and -1 for an error.
+static int stream_split(const char *input, size_t size, size_t a, size_t b,
+                        transcript *t) {
+  memset(t, 0, sizeof(*t));
+  t->fragments_ok = 1;
+  bencode_stream *stream = bencode_stream_create(on_event, t);
+  size_t cuts[] = {0, a, b, size};
+  int result = 0;
+  for (int i = 0; i < 3 && result == 0; i++) {
+    result = bencode_stream_feed(stream, input + cuts[i], cuts[i + 1] - cuts[i]);
+  }
+  if (result == 0) {
+    result = bencode_stream_done(stream);
+  }
+  bencode_stream_free(stream);
+  return result;
+}
+
+static const char document[] =
+    "d4:listli-42ei0el0:3:a\0xee6:nested"
+    "d1:xd0:i7eee6:string12:e:di1e\0\xff\x01l:e3:max"
+    "i9223372036854775807ee";
+
+static void test_every_split(void) {
+  size_t size = sizeof(document) - 1;
+  transcript whole, split;
+  CHECK(stream_split(document, size, size, size, &whole) == 1);
+  CHECK(whole.fragments_ok);
+  const char expected[] = "d@0 k4@1:list l@1 i-42@2 i0@2 l@2 s0@3: s3@3:a\0x "
+                          "e@2 e@1 k6@1:nested d@1 k1@2:x d@2 k0@3: i7@3 e@2 "
+                          "e@1 k6@1:string s12@1:e:di1e\0\xff\x01l:e k3@1:max "
+                          "i9223372036854775807@1 e@0 ";
+  CHECK(whole.length == sizeof(expected) - 1 &&
+        memcmp(whole.text, expected, whole.length) == 0);
+
+  // the same events whatever the split, in two parts and in three.
+  int same = 1;
+  for (size_t a = 0; a <= size; a++) {
+    for (size_t b = a; b <= size; b++) {
+      int result = stream_split(document, size, a, b, &split);
+      same = same && result == 1 && split.fragments_ok &&
+             split.length == whole.length &&
+             memcmp(split.text, whole.text, whole.length) == 0;
+    }
+  }
+  CHECK(same);
+}
+
+static void test_byte_by_byte(void) {
+  size_t size = sizeof(document) - 1;
+  transcript whole, bytes;
+  stream_split(document, size, size, size, &whole);
+
+  memset(&bytes, 0, sizeof(bytes));
+  bytes.fragments_ok = 1;
+  bencode_stream *stream = bencode_stream_create(on_event, &bytes);
+  int ok = 1;
+  for (size_t i = 0; i < size; i++) {
+    ok = ok && bencode_stream_feed(stream, document + i, 1) == 0;
+    // done only once the last byte is in.
+    ok = ok && bencode_stream_done(stream) == (i == size - 1);
+  }
+  CHECK(ok);
+  CHECK(bytes.fragments_ok);
+  CHECK(bytes.length == whole.length &&
+        memcmp(bytes.text, whole.text, whole.length) == 0);
+
+  // nothing may follow the top level value.
+  CHECK(bencode_stream_feed(stream, "i1e", 3) == -1);
+  bencode_stream_free(stream);
+}
+
+static void test_errors(void) {
+  const char *inputs[] = {
+      "i12x",  "i-e",    "ie",       "i--1e",       "3ab",  
+      "x",     "di1e1:ae", "d1:ae",  "le1",         "i9223372036854775808e",
+      "5x:abc", "d1:ai1e",
+  };
+  transcript t;
+  for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+    size_t size = strlen(inputs[i]);
+    int fails = 1;
+    for (size_t a = 0; a <= size; a++) {
+      fails = fails && stream_split(inputs[i], size, a, size, &t) != 1;
+    }
+    CHECK(fails);
+  }
+
+  // cut short is not an error yet, only incomplete.
+  CHECK(stream_split("d1:al2:ab", 9, 4, 9, &t) == 0);
+  CHECK(stream_split("d1:ai1e", 7, 3, 7, &t) == 0);
+}
+
+static void test_abort(void) {
+  size_t size = sizeof(document) - 1;
+  transcript t;
+  memset(&t, 0, sizeof(t));
+  t.abort_at = 3;
+  bencode_stream *stream = bencode_stream_create(on_event, &t);
+  CHECK(bencode_stream_feed(stream, document, size) == -1);
+  CHECK(t.events == 3);
+  // the stream stays failed.
+  CHECK(bencode_stream_feed(stream, "e", 1) == -1);
+  CHECK(!bencode_stream_done(stream));
+  bencode_stream_free(stream);
+}
+
+int main(void) {
+  test_every_split();
+  test_byte_by_byte();
+  test_errors();
+  test_abort();
+  return test_result();
+}
@@ -0,0 +1,137 @@
+#include "test.h"
+#include "torrent.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PIECE_LENGTH 1024
+#define LENGTH 21000
+#define PIECES ((LENGTH + PIECE_LENGTH - 1) / PIECE_LENGTH)
+
+static unsigned char payload[LENGTH];
+
+// whole pieces inside a file go through the batched kernels, the ones on a
+// boundary are hashed across files and the last one is short.
+static const test_file files[] = {
+    {"a", 5000}, {"empty", 0}, {"b", 3000}, {"c/d", 13000}};
+#define NO_OF_FILES (int)(sizeof(files) / sizeof(files[0]))
+
+// write_files lays the payload out below dir, file skip is left out.
+static void write_files(const char *dir, int skip) {
+  mkdir(dir, 0755);
+  char *sub = malloc(strlen(dir) + 3);
+  strcpy(sub, dir);
+  strcat(sub, "/c");
+  mkdir(sub, 0755);
+  free(sub);
+
+  unsigned long offset = 0;
+  for (int i = 0; i < NO_OF_FILES; i++) {
+    char *path = malloc(strlen(dir) + strlen(files[i].path) + 2);
+    strcpy(path, dir);
+    strcat(path, "/");
+    strcat(path, files[i].path);
+    unlink(path);
+    if (i != skip) {
+      CHECK(test_write_file(path, payload + offset, files[i].length) == 0);
+    }
+    free(path);
+    offset += files[i].length;
+  }
+}
+
+// verify checks the payload below dir and compares the bitfield to the
+// pieces expected to fail, given as a range [bad_from, bad_to).
+static void verify(THandle h, const char *dir, int workers, int bad_from,
+                   int bad_to) {
+  uint8_t bitfield[(PIECES + 7) / 8 + 1];
+  memset(bitfield, 0xaa, sizeof(bitfield));
+  int good = torrent_verify(h, dir, workers, bitfield);
+  CHECK(good == PIECES - (bad_to - bad_from));
+
+  int matches = 1;
+  for (int i = 0; i < PIECES; i++) {
+    int set = (bitfield[i / 8] & (0x80 >> (i % 8))) != 0;
+    matches = matches && set == (i < bad_from || i >= bad_to);
+  }
+  CHECK(matches);
+  // the spare bits of the last byte are clear, the byte after untouched.
+  CHECK((bitfield[PIECES / 8] & (0xff >> (PIECES % 8))) == 0);
+  CHECK(bitfield[(PIECES + 7) / 8] == 0xaa);
+}
+
+static void test_multi_file(void) {
+  char *path = test_path("verify.torrent");
+  CHECK(test_torrent(path, "dir", files, NO_OF_FILES, PIECE_LENGTH,
+                     payload) == 0);
+  THandle h = torrent_open(path);
+  CHECK(h != NULL);
+  free(path);
+  if (h == NULL) {
+    return;
+  }
+
+  char *dir = test_path("data");
+  write_files(dir, -1);
+  verify(h, dir, 1, 0, 0);
+  verify(h, dir, 3, 0, 0);
+  verify(h, dir, 0, 0, 0);
+
+  // a flipped byte fails the piece holding it, here one hashed in a batch
+  // and one across a boundary.
+  payload[2 * PIECE_LENGTH + 5] ^= 1;
+  write_files(dir, -1);
+  verify(h, dir, 2, 2, 3);
+  payload[2 * PIECE_LENGTH + 5] ^= 1;
+  payload[5001] ^= 1;
+  write_files(dir, -1);
+  verify(h, dir, 2, 4, 5);
+  payload[5001] ^= 1;
+
+  // b covers bytes 5000 to 8000, pieces 4 to 7.
+  write_files(dir, 2);
+  verify(h, dir, 2, 4, 8);
+
+  // c/d cut short at byte 9000 of the data, pieces 8 on.
+  write_files(dir, -1);
+  char *last = test_path("data/c/d");
+  CHECK(truncate(last, 1000) == 0);
+  verify(h, dir, 2, 8, PIECES);
+  free(last);
+
+  torrent_close(h);
+  free(dir);
+}
+
+static void test_single_file(void) {
+  test_file single = {NULL, LENGTH};
+  char *path = test_path("single.torrent");
+  CHECK(test_torrent(path, "single", &single, 1, PIECE_LENGTH, payload) == 0);
+  THandle h = torrent_open(path);
+  CHECK(h != NULL);
+  free(path);
+  if (h == NULL) {
+    return;
+  }
+
+  char *file = test_path("single");
+  CHECK(test_write_file(file, payload, LENGTH) == 0);
+  verify(h, file, 2, 0, 0);
+
+  unlink(file);
+  verify(h, file, 2, 0, PIECES);
+
+  torrent_close(h);
+  free(file);
+}
+
+int main(void) {
+  for (size_t i = 0; i < sizeof(payload); i++) {
+    payload[i] = i * 31 + i / 509;
+  }
+
+  test_multi_file();
+  test_single_file();
+  return test_result();
+}
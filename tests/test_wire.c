@@ -0,0 +1,314 @@
+#include "test.h"
+#include "torrent_internal.h"
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define HANDSHAKE 68
+#define PIECE_HEADER 8
+#define MAX_MESSAGE (1 + PIECE_HEADER + BLOCK_SIZE)
+#define MAX_SENT 32
+
+// wire_stream is what a peer sends: a handshake and then messages, with the
+// payload of every message kept to compare against.
+typedef struct {
+  unsigned char data[HANDSHAKE + MAX_SENT * (4 + MAX_MESSAGE)];
+  size_t length;
+  int count;
+  int ids[MAX_SENT];
+  size_t sizes[MAX_SENT];
+  size_t offsets[MAX_SENT];
+} wire_stream;
+
+static void put_length(wire_stream *s, uint32_t length) {
+  length = htonl(length);
+  memcpy(s->data + s->length, &length, 4);
+  s->length += 4;
+}
+
+static void keep_alive(wire_stream *s) { put_length(s, 0); }
+
+// message appends a message with size bytes of payload made from seed.
+static void message(wire_stream *s, int id, size_t size, int seed) {
+  put_length(s, 1 + size);
+  s->data[s->length++] = id;
+  s->ids[s->count] = id;
+  s->sizes[s->count] = size;
+  s->offsets[s->count] = s->length;
+  s->count++;
+  for (size_t i = 0; i < size; i++) {
+    s->data[s->length++] = (unsigned char)(i * 31 + seed * 7 + i / 251);
+  }
+}
+
+// peer_stream is a handshake followed by the messages of a download, more
+// than a ring's worth so the ring wraps around several times.
+static void peer_stream(wire_stream *s) {
+  memset(s, 0, sizeof(*s));
+  for (int i = 0; i < HANDSHAKE; i++) {
+    s->data[s->length++] = i;
+  }
+  message(s, 5, 40, 1);
+  keep_alive(s);
+  message(s, 1, 0, 2);
+  for (int i = 0; i < 10; i++) {
+    message(s, 7, PIECE_HEADER + BLOCK_SIZE, 10 + i);
+    if (i % 3 == 0) {
+      keep_alive(s);
+      keep_alive(s);
+    }
+    message(s, 4, 4, 20 + i);
+  }
+  message(s, 7, PIECE_HEADER + 100, 3);
+  message(s, 0, 0, 4);
+}
+
+// receiver takes the messages off a reader and checks them against the
+// stream, receiving the body of split messages into dest if use_dest is
+// set.
+typedef struct {
+  wire_reader r;
+  const wire_stream *stream;
+  int handshake;
+  int received;
+  int splits;
+  int use_dest;
+  int ok;
+  unsigned char dest[BLOCK_SIZE];
+} receiver;
+
+static void receiver_init(receiver *rc, const wire_stream *stream, int split,
+                          int use_dest) {
+  memset(rc, 0, sizeof(*rc));
+  wire_reader_init(&rc->r, MAX_MESSAGE);
+  if (split) {
+    wire_reader_split(&rc->r, 7, PIECE_HEADER);
+  }
+  rc->stream = stream;
+  rc->use_dest = use_dest;
+  rc->ok = 1;
+}
+
+static void receiver_check(receiver *rc, const wire_message *m) {
+  const wire_stream *s = rc->stream;
+  int i = rc->received++;
+  if (i >= s->count || m->id != s->ids[i] || m->size != s->sizes[i]) {
+    rc->ok = 0;
+    return;
+  }
+  const unsigned char *expected = s->data + s->offsets[i];
+  if (m->direct) {
+    rc->ok = rc->ok && rc->use_dest &&
+             memcmp(m->payload, expected, PIECE_HEADER) == 0 &&
+             memcmp(rc->dest, expected + PIECE_HEADER,
+                    m->size - PIECE_HEADER) == 0;
+  } else {
+    rc->ok = rc->ok && memcmp(m->payload, expected, m->size) == 0;
+  }
+}
+
+// receiver_drain handles whatever is buffered.
+static void receiver_drain(receiver *rc) {
+  if (!rc->handshake) {
+    unsigned char handshake[HANDSHAKE];
+    if (wire_reader_read(&rc->r, handshake, HANDSHAKE) == -1) {
+      return;
+    }
+    rc->handshake = 1;
+    rc->ok = rc->ok && memcmp(handshake, rc->stream->data, HANDSHAKE) == 0;
+  }
+
+  wire_message m;
+  int result;
+  while ((result = wire_reader_next(&rc->r, &m)) != 0) {
+    if (result == WIRE_SPLIT) {
+      rc->splits++;
+      rc->ok = rc->ok && m.id == 7 &&
+               m.size == rc->stream->sizes[rc->received];
+      wire_reader_direct(&rc->r, rc->use_dest ? rc->dest : NULL);
+    } else if (result == 1) {
+      receiver_check(rc, &m);
+    } else {
+      rc->ok = 0;
+      return;
+    }
+  }
+}
+
+// feed hands size bytes to the reader the way a completed read does,
+// through the iovecs of wire_reader_prepare.
+static int feed(wire_reader *r, const unsigned char *data, size_t size) {
+  struct iovec iov[3];
+  int count = wire_reader_prepare(r, iov);
+  size_t n = 0;
+  for (int i = 0; i < count && n < size; i++) {
+    size_t part = size - n < iov[i].iov_len ? size - n : iov[i].iov_len;
+    memcpy(iov[i].iov_base, data + n, part);
+    n += part;
+  }
+  wire_reader_commit(r, n);
+  return n == size ? 0 : -1;
+}
+
+// receive_chunks feeds the stream in chunks of the sizes in chunks, over
+// and over, and drains the reader after each.
+static int receive_chunks(const wire_stream *s, const size_t *chunks,
+                          int no_of_chunks, int split, int use_dest) {
+  receiver *rc = malloc(sizeof(*rc));
+  receiver_init(rc, s, split, use_dest);
+  int ok = 1;
+  for (size_t sent = 0, i = 0; sent < s->length && ok; i++) {
+    size_t n = chunks[i % no_of_chunks];
+    if (n > s->length - sent) {
+      n = s->length - sent;
+    }
+    ok = feed(&rc->r, s->data + sent, n) == 0;
+    sent += n;
+    receiver_drain(rc);
+  }
+  ok = ok && rc->ok && rc->received == s->count &&
+       wire_reader_buffered(&rc->r) == 0 &&
+       (split ? rc->splits > 0 : rc->splits == 0);
+  wire_reader_free(&rc->r);
+  free(rc);
+  return ok;
+}
+
+static const size_t bytes[] = {1};
+static const size_t odd[] = {3, 1, 4, 1, 5, 9, 2, 6, 5, 3, 5, 8, 97};
+static const size_t blocks[] = {4096, 13, 16397, 2, 7000, 9, 40000};
+
+static void test_partial_receive(void) {
+  wire_stream *s = malloc(sizeof(*s));
+  peer_stream(s);
+  CHECK(receive_chunks(s, bytes, 1, 0, 0));
+  CHECK(receive_chunks(s, odd, 13, 0, 0));
+  CHECK(receive_chunks(s, blocks, 7, 0, 0));
+  free(s);
+}
+
+static void test_split_receive(void) {
+  wire_stream *s = malloc(sizeof(*s));
+  peer_stream(s);
+  for (int use_dest = 0; use_dest <= 1; use_dest++) {
+    CHECK(receive_chunks(s, bytes, 1, 1, use_dest));
+    CHECK(receive_chunks(s, odd, 13, 1, use_dest));
+    CHECK(receive_chunks(s, blocks, 7, 1, use_dest));
+  }
+
+  // a piece buffered whole by the time it is looked at is not split.
+  receiver *rc = malloc(sizeof(*rc));
+  receiver_init(rc, s, 1, 1);
+  size_t start = s->offsets[2] - 5;
+  CHECK(feed(&rc->r, s->data, start) == 0);
+  receiver_drain(rc);
+  CHECK(rc->received == 2 && rc->splits == 0);
+  CHECK(feed(&rc->r, s->data + start, 4 + 1 + s->sizes[2]) == 0);
+  receiver_drain(rc);
+  CHECK(rc->ok && rc->received == 3 && rc->splits == 0);
+
+  // but one whose body is still missing is, and the rest of the body goes
+  // to dest in the same read as the message after it.
+  start += 4 + 1 + s->sizes[2];
+  size_t piece = s->offsets[4] - 5;
+  CHECK(feed(&rc->r, s->data + start, piece - start) == 0);
+  receiver_drain(rc);
+  CHECK(rc->ok && rc->received == 4 && rc->splits == 0);
+  CHECK(feed(&rc->r, s->data + piece, 5 + PIECE_HEADER + 10) == 0);
+  receiver_drain(rc);
+  CHECK(rc->ok && rc->received == 4 && rc->splits == 1);
+  start = piece + 5 + PIECE_HEADER + 10;
+  CHECK(feed(&rc->r, s->data + start, BLOCK_SIZE - 10 + 4 + 5) == 0);
+  CHECK(rc->r.direct_left == 0 && wire_reader_buffered(&rc->r) == 9);
+  receiver_drain(rc);
+  CHECK(rc->ok && rc->received == 6 && rc->splits == 1);
+  wire_reader_free(&rc->r);
+  free(rc);
+  free(s);
+}
+
+// test_wrap splits pieces that straddle the end of the ring, with the
+// header or the part of the body that came with it wrapping around.
+static void test_wrap(void) {
+  wire_stream *s = malloc(sizeof(*s));
+  static const size_t chunks[] = {1000};
+  int ok = 1;
+  for (size_t before = 1; before < 1000; before += 3) {
+    // bitfields with nothing split fill the ring up to before bytes short
+    // of its end, where a piece starts.
+    memset(s, 0, sizeof(*s));
+    s->length = HANDSHAKE;
+    size_t end = (1 << 16) - before;
+    while (s->length < end) {
+      size_t size = end - s->length - 5;
+      if (size > 16000) {
+        size = end - s->length - 5 > 17000 ? 16000 : 8000;
+      }
+      message(s, 5, size, s->count);
+    }
+    message(s, 7, PIECE_HEADER + BLOCK_SIZE, 1);
+    message(s, 4, 4, 2);
+    message(s, 7, PIECE_HEADER + BLOCK_SIZE, 3);
+    ok = ok && receive_chunks(s, chunks, 1, 1, 1) &&
+         receive_chunks(s, chunks, 1, 1, 0);
+  }
+  CHECK(ok);
+  free(s);
+}
+
+// test_socket receives the stream from a socket with wire_reader_fill
+// while the peer sends it in small writes.
+static void test_socket(void) {
+  wire_stream *s = malloc(sizeof(*s));
+  peer_stream(s);
+  int fds[2];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+  receiver *rc = malloc(sizeof(*rc));
+  receiver_init(rc, s, 1, 1);
+  int ok = 1;
+  for (size_t sent = 0, i = 0; sent < s->length && ok; i++) {
+    size_t n = odd[i % 13] * 37;
+    if (n > s->length - sent) {
+      n = s->length - sent;
+    }
+    ok = write(fds[0], s->data + sent, n) == (ssize_t)n &&
+         wire_reader_fill(&rc->r, fds[1]) == (ssize_t)n;
+    sent += n;
+    receiver_drain(rc);
+  }
+  CHECK(ok);
+  CHECK(rc->ok && rc->received == s->count && rc->splits > 0);
+
+  close(fds[0]);
+  CHECK(wire_reader_fill(&rc->r, fds[1]) == 0);
+  close(fds[1]);
+  wire_reader_free(&rc->r);
+  free(rc);
+  free(s);
+}
+
+static void test_too_long(void) {
+  wire_reader r;
+  wire_reader_init(&r, MAX_MESSAGE);
+  wire_message m;
+  unsigned char data[] = {0, 0, 0, 0, 0, 0, 0x40, 0x0a};
+  CHECK(feed(&r, data, 4) == 0);
+  CHECK(wire_reader_next(&r, &m) == 0);
+  CHECK(feed(&r, data + 4, 3) == 0);
+  CHECK(wire_reader_next(&r, &m) == 0);
+  CHECK(feed(&r, data + 7, 1) == 0);
+  CHECK(wire_reader_next(&r, &m) == -1);
+  wire_reader_free(&r);
+}
+
+int main(void) {
+  test_partial_receive();
+  test_split_receive();
+  test_wrap();
+  test_socket();
+  test_too_long();
+  return test_result();
+}
@@ -0,0 +1,143 @@
+#include "bencode.h"
+#include "test.h"
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+// sink collects what a writer hands to its callback, fail_after makes the
+// callback fail once that many calls went through.
+typedef struct {
+  char *data;
+  size_t length;
+  int calls;
+  int fail_after;
+} sink;
+
+static int sink_write(void *userdata, const char *data, size_t size) {
+  sink *s = userdata;
+  if (s->fail_after >= 0 && s->calls >= s->fail_after) {
+    return -1;
+  }
+  s->calls++;
+  s->data = realloc(s->data, s->length + size);
+  memcpy(s->data + s->length, data, size);
+  s->length += size;
+  return 0;
+}
+
+static int output_is(const bencode_writer *w, const char *expected,
+                     size_t size) {
+  return w->length == size && memcmp(w->data, expected, size) == 0;
+}
+
+static void test_values(void) {
+  bencode_writer w;
+  bencode_writer_init(&w, NULL, NULL);
+  bencode_write_list(&w);
+  bencode_write_int(&w, 0);
+  bencode_write_int(&w, -42);
+  bencode_write_int(&w, LONG_MAX);
+  bencode_write_int(&w, LONG_MIN);
+  bencode_write_string(&w, "", 0);
+  bencode_write_string(&w, "a\0b", 3);
+  bencode_write_dict(&w);
+  bencode_write_string(&w, "k", 1);
+  bencode_write_list(&w);
+  bencode_write_end(&w);
+  bencode_write_end(&w);
+  CHECK(bencode_write_end(&w) == 0);
+  CHECK(bencode_writer_flush(&w) == 0);
+
+  const char expected[] = "li0ei-42ei9223372036854775807e"
+                          "i-9223372036854775808e0:3:a\0bd1:kleee";
+  CHECK(output_is(&w, expected, sizeof(expected) - 1));
+  bencode_writer_free(&w);
+}
+
+// test_callback writes the same values with and without a callback, past
+// the staging buffer and with a string large enough to bypass it.
+static void test_callback(void) {
+  size_t big_size = 3 << 12;
+  char *big = malloc(big_size);
+  for (size_t i = 0; i < big_size; i++) {
+    big[i] = i % 251;
+  }
+
+  bencode_writer plain, staged;
+  sink s = {.fail_after = -1};
+  bencode_writer_init(&plain, NULL, NULL);
+  bencode_writer_init(&staged, sink_write, &s);
+  bencode_writer *writers[] = {&plain, &staged};
+  for (int i = 0; i < 2; i++) {
+    bencode_writer *w = writers[i];
+    bencode_write_list(w);
+    for (int j = 0; j < 2000; j++) {
+      bencode_write_int(w, j);
+    }
+    bencode_write_string(w, big, big_size);
+    bencode_write_string(w, "tail", 4);
+    bencode_write_end(w);
+  }
+  CHECK(bencode_writer_flush(&staged) == 0);
+
+  CHECK(s.calls > 2);
+  CHECK(s.length == plain.length);
+  CHECK(s.data != NULL && memcmp(s.data, plain.data, plain.length) == 0);
+
+  bencode_writer_free(&plain);
+  bencode_writer_free(&staged);
+  free(s.data);
+  free(big);
+}
+
+static void test_failure(void) {
+  sink s = {.fail_after = 0};
+  bencode_writer w;
+  bencode_writer_init(&w, sink_write, &s);
+  CHECK(bencode_write_string(&w, "spam", 4) == 0);
+  CHECK(bencode_writer_flush(&w) == -1);
+
+  // the error sticks, nothing else goes out.
+  s.fail_after = -1;
+  CHECK(bencode_write_int(&w, 1) == -1);
+  CHECK(bencode_write_list(&w) == -1);
+  CHECK(bencode_writer_flush(&w) == -1);
+  CHECK(s.length == 0);
+
+  bencode_writer_free(&w);
+  free(s.data);
+}
+
+// test_value re-encodes decoded trees, which must give back their input.
+static void test_value(void) {
+  const char *inputs[] = {
+      "i-7e",
+      "4:spam",
+      "le",
+      "de",
+      "d3:bar4:spam3:fooi42e4:listli1ei2eld1:x0:eeee",
+  };
+  for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+    size_t size = strlen(inputs[i]);
+    bencode *b = decode_bencode_n(inputs[i], size, 0);
+    CHECK(b != NULL);
+    if (b == NULL) {
+      continue;
+    }
+
+    bencode_writer w;
+    bencode_writer_init(&w, NULL, NULL);
+    CHECK(bencode_write_value(&w, b) == 0);
+    CHECK(output_is(&w, inputs[i], size));
+    bencode_writer_free(&w);
+    bencode_free(b);
+  }
+}
+
+int main(void) {
+  test_values();
+  test_callback();
+  test_failure();
+  test_value();
+  return test_result();
+}